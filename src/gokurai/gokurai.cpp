@@ -2,17 +2,27 @@
 
 #include <ix.hpp>
 #include <ix_Buffer.hpp>
+#include <ix_Clock.hpp>
 #include <ix_HashMapSingleArray.hpp>
+#include <ix_HashSet.hpp>
+#include <ix_MappedFile.hpp>
 #include <ix_StringArena.hpp>
 #include <ix_StringView.hpp>
 #include <ix_TempFile.hpp>
+#include <ix_Vector.hpp>
 #include <ix_Writer.hpp>
 #include <ix_assert.hpp>
+#include <ix_atomic.hpp>
+#include <ix_bit.hpp>
 #include <ix_doctest.hpp>
+#include <ix_environment.hpp>
 #include <ix_file.hpp>
+#include <ix_hash.hpp>
 #include <ix_memory.hpp>
+#include <ix_min_max.hpp>
 #include <ix_printf.hpp>
 #include <ix_string.hpp>
+#include <ix_utility.hpp>
 
 #include <inttypes.h>
 #include <lauxlib.h>
@@ -35,7 +45,223 @@ constexpr ix_StringView COMMENT_BLOCK_FOOTER      ("#+COMMENT_END\n");
 constexpr ix_StringView LUA_RETURN                ("return ");
 // clang-format on
 
+enum Directive : uint8_t
+{
+    DIRECTIVE_NONE = 0,
+    DIRECTIVE_GLOBAL_MACRO_HEADER,
+    DIRECTIVE_GLOBAL_BLOCK_MACRO_HEADER,
+    DIRECTIVE_GLOBAL_BLOCK_MACRO_FOOTER,
+    DIRECTIVE_LOCAL_MACRO_HEADER,
+    DIRECTIVE_LOCAL_BLOCK_MACRO_HEADER,
+    DIRECTIVE_LOCAL_BLOCK_MACRO_FOOTER,
+    DIRECTIVE_LUA_BLOCK_HEADER,
+    DIRECTIVE_LUA_BLOCK_FOOTER,
+    DIRECTIVE_COMMENT_BLOCK_HEADER,
+    DIRECTIVE_COMMENT_BLOCK_FOOTER,
+};
+
+struct DirectiveEntry
+{
+    ix_StringView text;
+    Directive directive;
+};
+
+// clang-format off
+static constexpr DirectiveEntry DIRECTIVES[] = {
+    {GLOBAL_MACRO_HEADER,       DIRECTIVE_GLOBAL_MACRO_HEADER},
+    {GLOBAL_BLOCK_MACRO_HEADER, DIRECTIVE_GLOBAL_BLOCK_MACRO_HEADER},
+    {GLOBAL_BLOCK_MACRO_FOOTER, DIRECTIVE_GLOBAL_BLOCK_MACRO_FOOTER},
+    {LOCAL_MACRO_HEADER,        DIRECTIVE_LOCAL_MACRO_HEADER},
+    {LOCAL_BLOCK_MACRO_HEADER,  DIRECTIVE_LOCAL_BLOCK_MACRO_HEADER},
+    {LOCAL_BLOCK_MACRO_FOOTER,  DIRECTIVE_LOCAL_BLOCK_MACRO_FOOTER},
+    {LUA_BLOCK_HEADER,          DIRECTIVE_LUA_BLOCK_HEADER},
+    {LUA_BLOCK_FOOTER,          DIRECTIVE_LUA_BLOCK_FOOTER},
+    {COMMENT_BLOCK_HEADER,      DIRECTIVE_COMMENT_BLOCK_HEADER},
+    {COMMENT_BLOCK_FOOTER,      DIRECTIVE_COMMENT_BLOCK_FOOTER},
+};
+// clang-format on
+
+// A trie of the directives, built at compile time. Characters are first mapped to a small set of symbols so that
+// each node can have a full transition table. Node 0 is the root, so a transition to node 0 means a mismatch.
+// No directive is a prefix of another, so the first terminal node reached decides the directive.
+struct DirectiveTrie
+{
+    static constexpr size_t MAX_NUM_NODES = 128;
+    static constexpr size_t MAX_NUM_SYMBOLS = 32;
+
+    uint8_t symbols[256];
+    uint8_t next[MAX_NUM_NODES][MAX_NUM_SYMBOLS];
+    Directive directives[MAX_NUM_NODES];
+    size_t num_nodes;
+    size_t num_symbols;
+    bool is_valid;
+};
+
+static constexpr DirectiveTrie make_directive_trie()
+{
+    DirectiveTrie trie = {};
+    trie.num_nodes = 1;
+    trie.num_symbols = 1; // Symbol 0 is for the characters that no directive contains.
+    trie.is_valid = true;
+    for (const DirectiveEntry &entry : DIRECTIVES)
+    {
+        size_t node = 0;
+        for (size_t i = 0; i < entry.text.length(); i++)
+        {
+            const unsigned char c = static_cast<unsigned char>(entry.text.data()[i]);
+            if (trie.symbols[c] == 0)
+            {
+                if (trie.num_symbols == DirectiveTrie::MAX_NUM_SYMBOLS)
+                {
+                    trie.is_valid = false;
+                    return trie;
+                }
+                trie.symbols[c] = static_cast<uint8_t>(trie.num_symbols);
+                trie.num_symbols += 1;
+            }
+
+            const bool another_directive_is_prefix = (trie.directives[node] != DIRECTIVE_NONE);
+            if (another_directive_is_prefix)
+            {
+                trie.is_valid = false;
+                return trie;
+            }
+
+            uint8_t &next_node = trie.next[node][trie.symbols[c]];
+            if (next_node == 0)
+            {
+                if (trie.num_nodes == DirectiveTrie::MAX_NUM_NODES)
+                {
+                    trie.is_valid = false;
+                    return trie;
+                }
+                next_node = static_cast<uint8_t>(trie.num_nodes);
+                trie.num_nodes += 1;
+            }
+            node = next_node;
+        }
+
+        for (size_t symbol = 0; symbol < DirectiveTrie::MAX_NUM_SYMBOLS; symbol++)
+        {
+            const bool is_prefix_of_another_directive = (trie.next[node][symbol] != 0);
+            if (is_prefix_of_another_directive)
+            {
+                trie.is_valid = false;
+                return trie;
+            }
+        }
+        trie.directives[node] = entry.directive;
+    }
+    return trie;
+}
+
+static constexpr DirectiveTrie DIRECTIVE_TRIE = make_directive_trie();
+static_assert(DIRECTIVE_TRIE.is_valid);
+
+// `line` must end with '\n'. Since every directive ends with ' ' or '\n', this never reads past the line.
+static Directive find_directive(const char *line)
+{
+    size_t node = 0;
+    const char *p = line;
+    while (true)
+    {
+        const uint8_t symbol = DIRECTIVE_TRIE.symbols[static_cast<unsigned char>(*p)];
+        node = DIRECTIVE_TRIE.next[node][symbol];
+        if (node == 0)
+        {
+            return DIRECTIVE_NONE;
+        }
+
+        const Directive directive = DIRECTIVE_TRIE.directives[node];
+        if (directive != DIRECTIVE_NONE)
+        {
+            return directive;
+        }
+        p += 1;
+    }
+}
+
 static constexpr size_t MAX_NUM_ARGS = 9;
+static constexpr size_t MAX_NUM_LUA_CHUNKS = 1024;
+
+// A call with a tail at least this long opens a gap in the line buffer (see `move_line_gap_to()`).
+static constexpr size_t LINE_GAP_MIN_TAIL_LENGTH = 4096;
+
+// How often the limits on a run of Lua code are checked, in VM instructions.
+static constexpr int LUA_LIMIT_CHECK_INTERVAL = 1000;
+
+// The address is the key of the table of Lua macro functions (by name) in the Lua registry.
+static const char LUA_MACROS_KEY = 0;
+static constexpr size_t DEFAULT_OUTPUT_HIGH_WATER_MARK = 64 * 1024;
+
+enum BuiltinMacro : uint8_t
+{
+    BUILTIN_MACRO_NONE = 0,
+    BUILTIN_MACRO_LUA,
+    BUILTIN_MACRO_NO_NEWLINE,
+    BUILTIN_MACRO_INPUT_LINE_NUMBER,
+    BUILTIN_MACRO_OUTPUT_LINE_NUMBER,
+    BUILTIN_MACRO_ENABLE_LUA,
+    BUILTIN_MACRO_DISABLE_LUA,
+};
+
+struct BuiltinMacroEntry
+{
+    ix_StringView name;
+    BuiltinMacro builtin;
+};
+
+// clang-format off
+static constexpr BuiltinMacroEntry BUILTIN_MACROS[] = {
+    {ix_StringView("__LUA__"),                BUILTIN_MACRO_LUA},
+    {ix_StringView("__NO_NEWLINE__"),         BUILTIN_MACRO_NO_NEWLINE},
+    {ix_StringView("__INPUT_LINE_NUMBER__"),  BUILTIN_MACRO_INPUT_LINE_NUMBER},
+    {ix_StringView("__OUTPUT_LINE_NUMBER__"), BUILTIN_MACRO_OUTPUT_LINE_NUMBER},
+    {ix_StringView("__ENABLE_LUA__"),         BUILTIN_MACRO_ENABLE_LUA},
+    {ix_StringView("__DISABLE_LUA__"),        BUILTIN_MACRO_DISABLE_LUA},
+};
+// clang-format on
+
+// Builtin macros are found with a perfect hash of the name length and the first character after "__".
+// If a new builtin collides with another one, the static_assert below fires; then change the hash.
+static constexpr size_t BUILTIN_MACRO_TABLE_SIZE = 16;
+
+ix_FORCE_INLINE static constexpr size_t builtin_macro_slot(const char *name, size_t name_length)
+{
+    return (name_length * 8 + static_cast<unsigned char>(name[2])) % BUILTIN_MACRO_TABLE_SIZE;
+}
+
+struct BuiltinMacroTable
+{
+    BuiltinMacroEntry slots[BUILTIN_MACRO_TABLE_SIZE];
+    bool has_collision;
+};
+
+static constexpr BuiltinMacroTable make_builtin_macro_table()
+{
+    BuiltinMacroTable table = {};
+    for (const BuiltinMacroEntry &entry : BUILTIN_MACROS)
+    {
+        BuiltinMacroEntry &slot = table.slots[builtin_macro_slot(entry.name.data(), entry.name.length())];
+        table.has_collision = table.has_collision || (slot.builtin != BUILTIN_MACRO_NONE);
+        slot = entry;
+    }
+    return table;
+}
+
+static constexpr BuiltinMacroTable BUILTIN_MACRO_TABLE = make_builtin_macro_table();
+static_assert(!BUILTIN_MACRO_TABLE.has_collision);
+
+ix_FORCE_INLINE static BuiltinMacro find_builtin_macro(const ix_StringView &name)
+{
+    if (name.length() < ix_strlen("__X__"))
+    {
+        return BUILTIN_MACRO_NONE;
+    }
+
+    const BuiltinMacroEntry &entry = BUILTIN_MACRO_TABLE.slots[builtin_macro_slot(name.data(), name.length())];
+    return (entry.name == name) ? entry.builtin : BUILTIN_MACRO_NONE;
+}
 
 class GokuraiResultImpl
 {
@@ -76,51 +302,66 @@ class GokuraiResultImpl
     friend class GokuraiContextImpl;
 };
 
-static void unquote_macro_calls(ix_Buffer &buffer)
+ix_FORCE_INLINE static bool starts_with_triple(const char *p, const char *end, char c)
 {
-    char *p = buffer.data();
-    size_t size = buffer.size();
-    const bool no_quote = (ix_memchr(p, '\'', size) == nullptr);
-    if (ix_LIKELY(no_quote))
-    {
-        return;
-    }
+    return (ix_strlen("[[[") <= static_cast<size_t>(end - p)) && (p[0] == c) && (p[1] == c) && (p[2] == c);
+}
 
-    // Code below is not optimal, but should be fine since this path is very cold.
-    buffer.push_char('\0'); // To use ix_strstr.
-                            // IDEA: Implement ix_strstr_length().
-    p = buffer.data();
-    const char *end = p + buffer.size();
-    char *quote = ix_strstr(p, "'[[[");
-    while (quote != nullptr)
+// Returns true if "[[[" starts at `p` once the quotes of "'[[[" are removed (e.g. "['[[").
+static bool starts_with_call_start_once_unquoted(const char *p, const char *end)
+{
+    size_t num_opening_square_bracket = 0;
+    while ((num_opening_square_bracket < ix_strlen("[[[")) && (p < end))
     {
-        const size_t mvmt = static_cast<size_t>(end - quote) - 1;
-        ix_memmove(quote, quote + 1, mvmt);
-        quote = ix_strstr(quote, "'[[[");
-        size -= 1;
+        if (*p == '[')
+        {
+            num_opening_square_bracket += 1;
+        }
+        else if ((*p != '\'') || !starts_with_triple(p + 1, end, '['))
+        {
+            return false;
+        }
+        p += 1;
     }
+    return (num_opening_square_bracket == ix_strlen("[[["));
+}
 
-    p = buffer.data();
-    quote = ix_strstr(p, "']]]");
-    while (quote != nullptr)
+// Removes the quote of "'[[[", "']]]" and "'^[[[" in one forward pass, compacting the buffer in place.
+// The result is the same as removing the quotes of each form in turn, in the order above.
+// In particular, "'^'[[[" becomes "^[[[", since "'^[[[" appears only after the quote of "'[[[" is removed.
+static void unquote_macro_calls(ix_Buffer &buffer)
+{
+    char *start = buffer.data();
+    const char *end = start + buffer.size();
+    const char *quote = static_cast<const char *>(ix_memchr(start, '\'', buffer.size()));
+    if (ix_LIKELY(quote == nullptr))
     {
-        const size_t mvmt = static_cast<size_t>(end - quote) - 1;
-        ix_memmove(quote, quote + 1, mvmt);
-        quote = ix_strstr(quote, "']]]");
-        size -= 1;
+        return;
     }
 
-    p = buffer.data();
-    quote = ix_strstr(p, "'^[[[");
+    char *dst = start + (quote - start); // The first quote is where compaction starts.
     while (quote != nullptr)
     {
-        const size_t mvmt = static_cast<size_t>(end - quote) - 1;
-        ix_memmove(quote, quote + 1, mvmt);
-        quote = ix_strstr(quote, "'^[[[");
-        size -= 1;
+        const char *p = quote + 1;
+        bool quoting = starts_with_triple(p, end, '[') || starts_with_triple(p, end, ']');
+        if (!quoting && (p < end) && (*p == '^'))
+        {
+            quoting = starts_with_call_start_once_unquoted(p + 1, end);
+        }
+        if (!quoting)
+        {
+            *dst = '\'';
+            dst += 1;
+        }
+
+        quote = static_cast<const char *>(ix_memchr(p, '\'', static_cast<size_t>(end - p)));
+        const char *copy_end = (quote != nullptr) ? quote : end;
+        const size_t length = static_cast<size_t>(copy_end - p);
+        ix_memmove(dst, p, length);
+        dst += length;
     }
 
-    buffer.set_size(size);
+    buffer.pop_back(static_cast<size_t>(end - dst));
 }
 
 static void unquote_directive(ix_Buffer &buffer)
@@ -143,17 +384,7 @@ static void unquote_directive(ix_Buffer &buffer)
         return;
     }
 
-    // IDEA: Use Aho-Corasick.
-    if (ix_starts_with(p, GLOBAL_MACRO_HEADER.data()) ||       //
-        ix_starts_with(p, GLOBAL_BLOCK_MACRO_HEADER.data()) || //
-        ix_starts_with(p, GLOBAL_BLOCK_MACRO_FOOTER.data()) || //
-        ix_starts_with(p, LOCAL_MACRO_HEADER.data()) ||        //
-        ix_starts_with(p, LOCAL_BLOCK_MACRO_HEADER.data()) ||  //
-        ix_starts_with(p, LOCAL_BLOCK_MACRO_FOOTER.data()) ||  //
-        ix_starts_with(p, LUA_BLOCK_HEADER.data()) ||          //
-        ix_starts_with(p, LUA_BLOCK_FOOTER.data()) ||          //
-        ix_starts_with(p, COMMENT_BLOCK_HEADER.data()) ||      //
-        ix_starts_with(p, COMMENT_BLOCK_FOOTER.data()))        //
+    if (find_directive(p) != DIRECTIVE_NONE)
     {
         const char *end = buffer.data() + buffer.size();
         const size_t mvmt = static_cast<size_t>(end - p);
@@ -162,12 +393,64 @@ static void unquote_directive(ix_Buffer &buffer)
     }
 }
 
+// Calls are usually only a few bytes apart, where a vectorized search costs more than it saves. So the searches for
+// call boundaries read the characters one by one, and use `ix_memrchr()` and the like only after this many of them.
+static constexpr ptrdiff_t SHORT_SCAN_LENGTH = 64;
+
+// Returns the last `c` in [`front`, `p`], or `front - 1` if there is none. `p - front` must exceed `SHORT_SCAN_LENGTH`.
+static char *find_previous_char(char *front, char *p, char c)
+{
+    const char *scan_limit = p - SHORT_SCAN_LENGTH;
+    for (; scan_limit < p; p--)
+    {
+        if (*p == c)
+        {
+            return p;
+        }
+    }
+    char *found = ix_memrchr(front, c, static_cast<size_t>(p + 1 - front));
+    return (found != nullptr) ? found : front - 1;
+}
+
+// Same as `find_previous_char()`, but for either `c0` or `c1`.
+static char *find_previous_char2(char *front, char *p, char c0, char c1)
+{
+    const char *scan_limit = p - SHORT_SCAN_LENGTH;
+    for (; scan_limit < p; p--)
+    {
+        if ((*p == c0) || (*p == c1))
+        {
+            return p;
+        }
+    }
+    char *found = ix_memrchr2(front, c0, c1, static_cast<size_t>(p + 1 - front));
+    return (found != nullptr) ? found : front - 1;
+}
+
 static const char *find_first_unmatched_call_end(const char *start, const char *end)
 {
     int balance = 0;
     const char *p = start;
-    while (p < end)
+    // The characters are read one by one, and after every `SHORT_SCAN_LENGTH` bytes the search skips to the next
+    // special character with `ix_memchr3()`.
+    const char *scan_limit = (SHORT_SCAN_LENGTH < (end - p)) ? p + SHORT_SCAN_LENGTH : end;
+    while (true)
     {
+        if (ix_UNLIKELY(scan_limit <= p))
+        {
+            if (end <= p)
+            {
+                break;
+            }
+            p = ix_memchr3(p, ']', '^', '\'', static_cast<size_t>(end - p));
+            if (p == nullptr)
+            {
+                return nullptr;
+            }
+            scan_limit = (SHORT_SCAN_LENGTH < (end - p)) ? p + SHORT_SCAN_LENGTH : end;
+            continue;
+        }
+
         const char c = *p;
 
         const bool normal_char = (c != ']') && (c != '^') && (c != '\'');
@@ -401,79 +684,318 @@ ix_FORCE_INLINE static bool is_digit(char c)
     return static_cast<unsigned char>(c - '0') < 10;
 }
 
-static void expand_call_with_args(const char *args[MAX_NUM_ARGS + 1], const char *str, size_t str_length,
-                                  ix_Buffer &buffer)
+// A piece of a compiled macro body: a span of the body followed by a reference to an argument.
+struct MacroSegment
 {
-    const char *next_write_start = str;
-    const char *p = str;
-    const char *end = str + str_length;
-    while (p != end)
-    {
-        char c = *p;
+    size_t literal_offset;
+    size_t literal_length;
+    uint8_t arg_index; // 0-9 for `$0`-`$9`, or NO_ARG.
+};
 
-        const bool normal_char = (c != '$');
-        if (ix_LIKELY(normal_char))
+static constexpr uint8_t NO_ARG = UINT8_MAX;
+
+// Splits the body at every `$N` once at definition, so that expanding a call is a sequence of copies.
+static void compile_macro_body(const char *body, const char *body_start, const char *body_end,
+                               ix_Vector<MacroSegment> &segments)
+{
+    const char *next_literal_start = body_start;
+    const char *p = body_start;
+    while (true)
+    {
+        p = static_cast<const char *>(ix_memchr(p, '$', static_cast<size_t>(body_end - p)));
+        if (p == nullptr)
         {
-            p += 1;
-            continue;
+            break;
         }
 
         p += 1;
-        c = *p;
-        if (!is_digit(c))
+        if ((p == body_end) || !is_digit(*p))
         {
             continue;
         }
 
-        buffer.push_between(next_write_start, p - 1);
-        next_write_start = p + 1;
-        const uint8_t arg_index = static_cast<uint8_t>(c - '0');
+        const size_t literal_offset = static_cast<size_t>(next_literal_start - body);
+        const size_t literal_length = static_cast<size_t>(p - 1 - next_literal_start);
+        segments.push_back(MacroSegment{literal_offset, literal_length, static_cast<uint8_t>(*p - '0')});
+        p += 1;
+        next_literal_start = p;
+    }
+
+    if (next_literal_start != body_end)
+    {
+        const size_t literal_offset = static_cast<size_t>(next_literal_start - body);
+        const size_t literal_length = static_cast<size_t>(body_end - next_literal_start);
+        segments.push_back(MacroSegment{literal_offset, literal_length, NO_ARG});
+    }
+}
+
+static void expand_call_with_args(const char *args[MAX_NUM_ARGS + 1], const char *body,
+                                  const MacroSegment *segments, size_t num_segments, ix_Buffer &buffer)
+{
+    for (size_t i = 0; i < num_segments; i++)
+    {
+        const MacroSegment &segment = segments[i];
+        buffer.push(body + segment.literal_offset, segment.literal_length);
+
+        const uint8_t arg_index = segment.arg_index;
         if (arg_index == 0)
         {
             const char *from = args[0];
             const char *until = args[MAX_NUM_ARGS] - ix_strlen(",");
             buffer.push_between(from, until);
         }
-        else if (args[arg_index] != nullptr)
+        else if ((arg_index != NO_ARG) && (args[arg_index] != nullptr))
         {
             const char *from = args[arg_index - 1];
             const char *until = args[arg_index] - ix_strlen(",");
             push_macro_argument(buffer, from, until);
         }
-        p += 1;
     }
-
-    const char *macro_body_end = str + str_length;
-    buffer.push_between(next_write_start, macro_body_end);
 }
 
-static int eval_lua_program(lua_State *L, const char *program, size_t program_len, const ix_FileHandle *err_out)
+// Compiles a fragment starting with "return " as an expression and, if that fails, as a statement.
+// Leaves the function, or the error message if neither compiles, on top of the stack.
+static bool load_lua_fragment(lua_State *L, const char *fragment, size_t fragment_length, const ix_FileHandle *err_out)
 {
-    const bool print_warnings = (err_out != nullptr);
-    int result;
+    ix_ASSERT(ix_memcmp(fragment, LUA_RETURN.data(), LUA_RETURN.length()) == 0);
+    ix_ASSERT(fragment[fragment_length - 1] == '\0');
 
-    result = luaL_loadbuffer(L, program, program_len, program);
+    // Both forms are named after the statement, so that messages do not depend on the form.
+    constexpr size_t OFFSET = LUA_RETURN.length();
+    const char *statement = fragment + OFFSET;
+    int result = luaL_loadbuffer(L, fragment, fragment_length - 1, statement);
     if (result != LUA_OK)
     {
-        if (print_warnings)
-        {
-            err_out->write_stringf("Lua load failed: %s\n", lua_tostring(L, -1));
-        }
-        return result;
+        lua_pop(L, 1);
+        result = luaL_loadbuffer(L, statement, fragment_length - 1 - OFFSET, statement);
+    }
+
+    if ((result != LUA_OK) && (err_out != nullptr))
+    {
+        err_out->write_stringf("Lua load failed: %s\n", lua_tostring(L, -1));
     }
+    return (result == LUA_OK);
+}
 
-    const int num_args = 0;
+// Replaces the function and its arguments on top of the stack with its result, or with the error message if it fails.
+static void call_lua_function(lua_State *L, int num_args, const ix_FileHandle *err_out)
+{
     const int num_results = 1;
     const int msgh = 0;
-    result = lua_pcall(L, num_args, num_results, msgh);
-    if (result != LUA_OK)
+    const int result = lua_pcall(L, num_args, num_results, msgh);
+    if ((result != LUA_OK) && (err_out != nullptr))
+    {
+        err_out->write_stringf("Lua evaluation failed: %s\n", lua_tostring(L, -1));
+    }
+}
+
+// A Lua string literal which reads back as `str`. Quotes, backslashes and control characters are written as "\ddd".
+static void push_lua_string_literal(ix_Buffer &buffer, const char *str, size_t length)
+{
+    buffer.push_char('"');
+    for (size_t i = 0; i < length; i++)
     {
-        if (print_warnings)
+        const uint8_t c = static_cast<uint8_t>(str[i]);
+        if ((c == '"') || (c == '\\') || (c < ' ') || (c == 0x7f))
+        {
+            const char escape[4] = {'\\', static_cast<char>('0' + (c / 100)), static_cast<char>('0' + ((c / 10) % 10)),
+                                    static_cast<char>('0' + (c % 10))};
+            buffer.push(escape, sizeof(escape));
+        }
+        else
         {
-            err_out->write_stringf("Lua evaluation failed: %s\n", lua_tostring(L, -1));
+            buffer.push_char(static_cast<char>(c));
         }
     }
-    return result;
+    buffer.push_char('"');
+}
+
+// The `lua_Alloc` of the Lua state of a context. Lua makes and frees a great many small objects (strings, tables,
+// closures), so blocks up to `MAX_POOLED_SIZE` bytes are cut from large chunks and recycled through a free list per
+// size class. Lua tells the size of a block when it frees or resizes it, so blocks carry no header.
+// The chunks are kept until `reset()`, which is called once the Lua state is closed.
+class LuaAllocator
+{
+    static constexpr size_t SIZE_CLASS_GRANULARITY = 16;
+    static constexpr size_t MAX_POOLED_SIZE = 256;
+    static constexpr size_t NUM_SIZE_CLASSES = MAX_POOLED_SIZE / SIZE_CLASS_GRANULARITY;
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+
+    FreeBlock *m_free_lists[NUM_SIZE_CLASSES];
+    ix_Vector<char *> m_chunks;
+    char *m_chunk_cursor;
+    char *m_chunk_end;
+    size_t m_heap_size;
+    size_t m_peak_heap_size;
+    size_t m_heap_limit; // Zero for none.
+
+  public:
+    LuaAllocator(const LuaAllocator &) = delete;
+    LuaAllocator(LuaAllocator &&) = delete;
+    LuaAllocator &operator=(const LuaAllocator &) = delete;
+    LuaAllocator &operator=(LuaAllocator &&) = delete;
+
+    LuaAllocator()
+        : m_free_lists(),
+          m_chunk_cursor(nullptr),
+          m_chunk_end(nullptr),
+          m_heap_size(0),
+          m_peak_heap_size(0),
+          m_heap_limit(0)
+    {
+    }
+
+    ~LuaAllocator()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        for (char *chunk : m_chunks)
+        {
+            ix_FREE(chunk);
+        }
+        m_chunks.clear();
+        ix_memset(static_cast<void *>(m_free_lists), 0, sizeof(m_free_lists));
+        m_chunk_cursor = nullptr;
+        m_chunk_end = nullptr;
+        m_heap_size = 0;
+        m_peak_heap_size = 0;
+        m_heap_limit = 0;
+    }
+
+    // Growing the heap past the limit fails, which Lua reports as "not enough memory" after a full collection.
+    ix_FORCE_INLINE void set_heap_limit(size_t heap_limit)
+    {
+        m_heap_limit = heap_limit;
+    }
+
+    // The bytes Lua has asked for and not freed yet.
+    ix_FORCE_INLINE size_t heap_size() const
+    {
+        return m_heap_size;
+    }
+
+    ix_FORCE_INLINE size_t peak_heap_size() const
+    {
+        return m_peak_heap_size;
+    }
+
+    static void *alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+    {
+        LuaAllocator *allocator = static_cast<LuaAllocator *>(ud);
+        if (ptr == nullptr)
+        {
+            osize = 0; // Lua passes the type of the object instead.
+        }
+
+        const bool over_limit = (allocator->m_heap_limit != 0) && (nsize > osize) &&
+                                (allocator->m_heap_size - osize + nsize > allocator->m_heap_limit);
+        if (ix_UNLIKELY(over_limit))
+        {
+            return nullptr;
+        }
+
+        allocator->m_heap_size = allocator->m_heap_size - osize + nsize;
+        allocator->m_peak_heap_size = ix_max(allocator->m_peak_heap_size, allocator->m_heap_size);
+
+        if (nsize == 0)
+        {
+            allocator->free(ptr, osize);
+            return nullptr;
+        }
+
+        if (ptr == nullptr)
+        {
+            return allocator->allocate(nsize);
+        }
+
+        const bool both_pooled = (osize <= MAX_POOLED_SIZE) && (nsize <= MAX_POOLED_SIZE);
+        if (both_pooled && (size_class(osize) == size_class(nsize)))
+        {
+            return ptr;
+        }
+
+        const bool both_large = (osize > MAX_POOLED_SIZE) && (nsize > MAX_POOLED_SIZE);
+        if (both_large)
+        {
+            return ix_realloc(ptr, nsize);
+        }
+
+        void *new_ptr = allocator->allocate(nsize);
+        ix_memcpy(new_ptr, ptr, ix_min(osize, nsize));
+        allocator->free(ptr, osize);
+        return new_ptr;
+    }
+
+  private:
+    ix_FORCE_INLINE static size_t size_class(size_t size)
+    {
+        return (size - 1) / SIZE_CLASS_GRANULARITY;
+    }
+
+    void *allocate(size_t size)
+    {
+        if (size > MAX_POOLED_SIZE)
+        {
+            return ix_malloc(size);
+        }
+
+        const size_t index = size_class(size);
+        FreeBlock *block = m_free_lists[index];
+        if (ix_LIKELY(block != nullptr))
+        {
+            m_free_lists[index] = block->next;
+            return block;
+        }
+
+        const size_t block_size = (index + 1) * SIZE_CLASS_GRANULARITY;
+        if (ix_UNLIKELY(static_cast<size_t>(m_chunk_end - m_chunk_cursor) < block_size))
+        {
+            // The rest of the old chunk is left unused. It is smaller than a block of the largest class.
+            char *chunk = ix_MALLOC(char *, CHUNK_SIZE);
+            m_chunks.push_back(chunk);
+            m_chunk_cursor = chunk;
+            m_chunk_end = chunk + CHUNK_SIZE;
+        }
+
+        void *p = m_chunk_cursor;
+        m_chunk_cursor += block_size;
+        return p;
+    }
+
+    void free(void *ptr, size_t size)
+    {
+        if (ptr == nullptr)
+        {
+            return;
+        }
+
+        if (size > MAX_POOLED_SIZE)
+        {
+            ix_free(ptr);
+            return;
+        }
+
+        const size_t index = size_class(size);
+        FreeBlock *block = static_cast<FreeBlock *>(ptr);
+        block->next = m_free_lists[index];
+        m_free_lists[index] = block;
+    }
+};
+
+static int lua_panic(lua_State *L)
+{
+    const char *message = lua_tostring(L, -1);
+    ix_FileHandle::of_stderr().write_stringf("PANIC: unprotected error in call to Lua API (%s)\n",
+                                             (message == nullptr) ? "?" : message);
+    return 0; // Lua aborts.
 }
 
 struct Macro
@@ -481,6 +1003,18 @@ struct Macro
     size_t body_length;
     size_t first_line_length;
     const char *body;
+    size_t first_segment; // Index into the segments of the scope the macro is defined in.
+    size_t num_segments;
+    size_t num_first_line_segments;
+
+    // The expansion of a constant global macro, valid while `cache_generation` is the context's current one.
+    const char *cached_expansion = nullptr;
+    size_t cached_expansion_length = 0;
+    uint64_t cache_generation = 0;
+    bool cacheable = false;
+
+    // A global macro defined by `gokurai.macro()`, whose function is kept in the Lua state.
+    bool lua_function = false;
 
     ix_FORCE_INLINE bool is_oneline() const
     {
@@ -507,13 +1041,735 @@ struct MacroCall
     }
 };
 
-class GokuraiContextImpl
+// A part of the input which is read before the rest of `m_input`, such as the lines after the first line of a multiline
+// expansion. It points either into a macro body in a string arena or into `m_pending_input_arena`.
+struct PendingInput
 {
-    const char *m_input;
-    size_t m_input_length;
-    size_t m_input_remaining;
-    const ix_FileHandle *m_err_handle;
-
+    const char *start;
+    const char *end;
+};
+
+// A state of `find_last_call()` at a character which is not a part of a bracket run.
+// Offsets are measured from the line end, so they stay valid while the text before them is replaced.
+struct CallSearchCheckpoint
+{
+    size_t scan_offset;     // Where the search resumes.
+    size_t call_end_offset; // The call end pending at that point (0 if the search was in the first phase).
+};
+
+enum LuaHistoryResultKind : uint8_t
+{
+    LUA_HISTORY_RESULT_KIND_NIL,
+    LUA_HISTORY_RESULT_KIND_FALSE,
+    LUA_HISTORY_RESULT_KIND_TRUE,
+    LUA_HISTORY_RESULT_KIND_STRING,
+    LUA_HISTORY_RESULT_KIND_FUNCTION, // The function of a Lua macro, which the Lua history defines again.
+    NUM_LUA_HISTORY_RESULT_KINDS,
+};
+
+// What a call of the `gokurai` table returned to the recorded Lua code. When the Lua history is run again, the macros
+// are already as the history left them, so the calls return these, in order, instead of looking at the macros.
+struct LuaHistoryResult
+{
+    ix_StringView string;
+    LuaHistoryResultKind kind;
+};
+
+// A precompiled macro library (.gkc) holds the global macros and the Lua history of a context, laid out so that it is
+// used where it is mapped: a header, an open-addressing hash index of `uint32_t` (entry index + 1, or 0 if empty),
+// the macro entries, the segments of their bodies, the Lua programs, the results of their calls of the `gokurai`
+// table and finally the strings, each followed by '\0'.
+// Offsets are from the start of the file, so it can be mapped anywhere. It is native-endian and is rejected by a
+// machine with another byte order or hash function.
+static constexpr char LIBRARY_MAGIC[8] = {'G', 'O', 'K', 'U', 'R', 'A', 'I', 'C'};
+static constexpr uint32_t LIBRARY_VERSION = 2;
+static constexpr uint32_t LIBRARY_BYTE_ORDER_MARK = 0x01020304;
+
+struct LibraryHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order_mark;
+    uint32_t hash_size;
+    uint32_t num_buckets; // A power of two greater than `num_macros`.
+    uint32_t num_macros;
+    uint32_t num_lua_programs;
+    uint64_t num_segments;
+    uint64_t buckets_offset;
+    uint64_t entries_offset;
+    uint64_t segments_offset;
+    uint64_t lua_programs_offset;
+    uint64_t num_lua_results;
+    uint64_t lua_results_offset;
+    uint64_t file_size;
+};
+
+struct LibraryEntry
+{
+    uint64_t hash;
+    uint64_t name_offset;
+    uint64_t name_length;
+    uint64_t body_offset;
+    uint64_t body_length;
+    uint64_t first_line_length;
+    uint64_t first_segment;
+    uint32_t num_segments;
+    uint32_t num_first_line_segments;
+};
+
+struct LibrarySegment
+{
+    uint64_t literal_offset;
+    uint64_t literal_length;
+    uint64_t arg_index;
+};
+
+struct LibraryLuaProgram
+{
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct LibraryLuaResult
+{
+    uint64_t string_offset;
+    uint64_t string_length;
+    uint64_t kind;
+};
+
+// The `num_first_line_segments` of a Lua macro, whose function is defined again by the Lua programs.
+static constexpr uint32_t LIBRARY_LUA_MACRO_MARK = UINT32_MAX;
+
+static_assert(sizeof(LibraryHeader) == 96, "");
+static_assert(sizeof(LibraryEntry) == 64, "");
+static_assert(sizeof(LibrarySegment) == 24, "");
+static_assert(sizeof(LibraryLuaProgram) == 16, "");
+static_assert(sizeof(LibraryLuaResult) == 24, "");
+
+// Loading checks the header and the Lua programs. An entry is checked when a lookup hits it, so that a broken file is
+// never read out of bounds and loading does not depend on the number of macros.
+struct GokuraiLibraryImpl
+{
+    ix_MappedFile mapped;
+    ix_UniquePointer<char[]> loaded{nullptr}; // For a file handle that cannot be mapped.
+    const char *data = nullptr;
+    size_t size = 0;
+    const LibraryHeader *header = nullptr;
+    const uint32_t *buckets = nullptr;
+    const LibraryEntry *entries = nullptr;
+    const LibrarySegment *segments = nullptr;
+    const LibraryLuaProgram *lua_programs = nullptr;
+    const LibraryLuaResult *lua_results = nullptr;
+
+    static bool is_valid_section(uint64_t offset, uint64_t count, size_t element_size, size_t file_size)
+    {
+        const bool aligned = ((offset % alignof(uint64_t)) == 0);
+        return aligned && (offset <= file_size) && (count <= (file_size - offset) / element_size);
+    }
+
+    bool bind(const char *file_data, size_t file_size)
+    {
+        data = file_data;
+        size = file_size;
+        if (size < sizeof(LibraryHeader))
+        {
+            return false;
+        }
+
+        header = reinterpret_cast<const LibraryHeader *>(data);
+        const bool header_is_valid = (ix_memcmp(header->magic, LIBRARY_MAGIC, sizeof(LIBRARY_MAGIC)) == 0) &&
+                                     (header->version == LIBRARY_VERSION) &&
+                                     (header->byte_order_mark == LIBRARY_BYTE_ORDER_MARK) &&
+                                     (header->hash_size == sizeof(size_t)) && (header->file_size == size) &&
+                                     ix_is_power_of_2(header->num_buckets) &&
+                                     (header->num_macros < header->num_buckets);
+        if (!header_is_valid ||
+            !is_valid_section(header->buckets_offset, header->num_buckets, sizeof(uint32_t), size) ||
+            !is_valid_section(header->entries_offset, header->num_macros, sizeof(LibraryEntry), size) ||
+            !is_valid_section(header->segments_offset, header->num_segments, sizeof(LibrarySegment), size) ||
+            !is_valid_section(header->lua_programs_offset, header->num_lua_programs, sizeof(LibraryLuaProgram), size) ||
+            !is_valid_section(header->lua_results_offset, header->num_lua_results, sizeof(LibraryLuaResult), size))
+        {
+            return false;
+        }
+
+        buckets = reinterpret_cast<const uint32_t *>(data + header->buckets_offset);
+        entries = reinterpret_cast<const LibraryEntry *>(data + header->entries_offset);
+        segments = reinterpret_cast<const LibrarySegment *>(data + header->segments_offset);
+        lua_programs = reinterpret_cast<const LibraryLuaProgram *>(data + header->lua_programs_offset);
+        lua_results = reinterpret_cast<const LibraryLuaResult *>(data + header->lua_results_offset);
+        for (size_t i = 0; i < header->num_lua_programs; i++)
+        {
+            if (!is_valid_string(lua_programs[i].offset, lua_programs[i].length))
+            {
+                return false;
+            }
+        }
+        for (size_t i = 0; i < header->num_lua_results; i++)
+        {
+            const LibraryLuaResult &result = lua_results[i];
+            if ((result.kind >= NUM_LUA_HISTORY_RESULT_KINDS) ||
+                !is_valid_string(result.string_offset, result.string_length))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // A string is followed by '\0' in the file.
+    bool is_valid_string(uint64_t offset, uint64_t length) const
+    {
+        return (offset < size) && (length < size - offset) && (data[offset + length] == '\0');
+    }
+
+    bool is_valid_entry(const LibraryEntry &entry) const
+    {
+        if (!is_valid_string(entry.name_offset, entry.name_length) ||
+            !is_valid_string(entry.body_offset, entry.body_length))
+        {
+            return false;
+        }
+
+        if (entry.num_first_line_segments == LIBRARY_LUA_MACRO_MARK)
+        {
+            return (entry.body_length == 0) && (entry.first_line_length == 0) && (entry.num_segments == 0);
+        }
+
+        if ((entry.first_line_length > entry.body_length) ||
+            (entry.first_segment > header->num_segments) ||
+            (entry.num_segments > header->num_segments - entry.first_segment) ||
+            (entry.num_first_line_segments > entry.num_segments))
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < entry.num_segments; i++)
+        {
+            const LibrarySegment &segment = segments[entry.first_segment + i];
+            const bool segment_is_valid = (segment.literal_offset <= entry.body_length) &&
+                                          (segment.literal_length <= entry.body_length - segment.literal_offset) &&
+                                          ((segment.arg_index <= 9) || (segment.arg_index == NO_ARG));
+            if (!segment_is_valid)
+            {
+                return false;
+            }
+        }
+
+        // As a definition leaves it: the first line of a multiline body, and the expansion of it, end with '\n'.
+        const char *body = data + entry.body_offset;
+        if (entry.first_line_length == 0)
+        {
+            return (ix_memchr(body, '\n', entry.body_length) == nullptr);
+        }
+        if ((body[entry.first_line_length - 1] != '\n') || (entry.num_first_line_segments == 0))
+        {
+            return false;
+        }
+        const LibrarySegment &last_segment = segments[entry.first_segment + entry.num_first_line_segments - 1];
+        return (last_segment.arg_index == NO_ARG) &&
+               (last_segment.literal_offset + last_segment.literal_length == entry.first_line_length);
+    }
+
+    const LibraryEntry *find(const ix_StringView &name) const
+    {
+        const uint64_t hash = ix_hash(name.data(), name.length());
+        const size_t mask = header->num_buckets - 1;
+        size_t bucket_index = hash & mask;
+        for (size_t i = 0; i < header->num_buckets; i++)
+        {
+            const uint32_t slot = buckets[bucket_index];
+            if ((slot == 0) || (slot > header->num_macros))
+            {
+                return nullptr;
+            }
+
+            const LibraryEntry &entry = entries[slot - 1];
+            const bool match = (entry.hash == hash) && (entry.name_length == name.length()) && is_valid_entry(entry) &&
+                               (ix_memcmp(data + entry.name_offset, name.data(), name.length()) == 0);
+            if (match)
+            {
+                return &entry;
+            }
+            bucket_index = (bucket_index + 1) & mask;
+        }
+        return nullptr;
+    }
+};
+
+// Arena memory shared by a snapshot, the context it was taken from and the contexts forked from it.
+// Nothing is written to it once it is shared, so it is freed without copying when the last of them lets go of it.
+struct SharedArenaChunks
+{
+    ix_Vector<char *> chunks;
+    size_t ref_count;
+
+    static SharedArenaChunks *retain(SharedArenaChunks *shared)
+    {
+        ix_atomic_fetch_add(&shared->ref_count, 1);
+        return shared;
+    }
+
+    static void release(SharedArenaChunks *shared)
+    {
+        if (ix_atomic_fetch_sub(&shared->ref_count, 1) != 1)
+        {
+            return;
+        }
+
+        for (char *chunk : shared->chunks)
+        {
+            ix_FREE(chunk);
+        }
+        ix_delete(shared);
+    }
+};
+
+// The macros, line numbers and Lua history of a context, whose strings live in shared arena chunks.
+struct GokuraiSnapshotImpl
+{
+    ix_HashMapSingleArray<ix_StringView, Macro> global_macros;
+    ix_HashMapSingleArray<ix_StringView, Macro> local_macros;
+    ix_Vector<MacroSegment> global_macro_segments;
+    ix_Vector<MacroSegment> local_macro_segments;
+    ix_Vector<ix_StringView> lua_history;
+    ix_Vector<LuaHistoryResult> lua_history_results;
+    ix_Vector<SharedArenaChunks *> shared_chunks;
+    const GokuraiLibraryImpl *library = nullptr;
+    ix_HashSet<ix_StringView> undefined_library_macros;
+    uint64_t input_line_number = 0;
+    uint64_t output_line_number = 0;
+    bool lua_enabled = true;
+    bool lua_history_enabled = false;
+    bool clear_local_macro_on_next_read = false;
+    bool local_macros_hidden = false;
+
+    GokuraiSnapshotImpl() = default;
+    GokuraiSnapshotImpl(const GokuraiSnapshotImpl &) = delete;
+    GokuraiSnapshotImpl &operator=(const GokuraiSnapshotImpl &) = delete;
+
+    ~GokuraiSnapshotImpl()
+    {
+        for (SharedArenaChunks *shared : shared_chunks)
+        {
+            SharedArenaChunks::release(shared);
+        }
+    }
+};
+
+enum MacroProfileKind : uint8_t
+{
+    MACRO_PROFILE_KIND_MACRO,
+    MACRO_PROFILE_KIND_LUA_MACRO,
+    MACRO_PROFILE_KIND_BUILTIN,
+    MACRO_PROFILE_KIND_LUA_FRAGMENT,
+};
+
+static constexpr const char *MACRO_PROFILE_KIND_NAMES[] = {"macro", "lua macro", "builtin", "lua"};
+
+#if gokurai_PROFILE
+// The calls, output bytes and time of each macro expanded by `expand_macros()`. `__LUA__` fragments are told apart by
+// the input line they are on (e.g. "__LUA__:12"). The time of a call is that of replacing it, so the calls in its
+// output are counted on their own, but the time includes probing for the macro cache. Units retried for want of
+// input are counted again.
+class MacroProfiler
+{
+    struct Entry
+    {
+        const char *name;
+        size_t name_length;
+        MacroProfileKind kind;
+        uint64_t num_calls;
+        uint64_t output_bytes;
+        double elapsed_sec;
+    };
+
+    bool m_enabled;
+    ix_Clock m_clock;
+    ix_HashMapSingleArray<ix_StringView, size_t> m_entry_indices;
+    ix_Vector<Entry> m_entries;
+    ix_StringArena m_name_arena;
+
+  public:
+    MacroProfiler()
+        : m_enabled(false),
+          m_name_arena(ix_OPT_LEVEL(DEBUG) ? 1 : 1024)
+    {
+    }
+
+    ix_FORCE_INLINE bool enabled() const
+    {
+        return m_enabled;
+    }
+
+    void set_enabled(bool enabled)
+    {
+        m_enabled = enabled;
+    }
+
+    void clear()
+    {
+        m_enabled = false;
+        m_entry_indices.clear();
+        m_entries.clear();
+        m_name_arena.clear();
+    }
+
+    ix_FORCE_INLINE double now_sec() const
+    {
+        return m_clock.elaplsed_sec();
+    }
+
+    // The name of a call is looked up before the call is replaced, since it points into the line.
+    size_t find_or_add_entry(const ix_StringView &name)
+    {
+        const size_t *index = m_entry_indices.find(name);
+        if (index != nullptr)
+        {
+            return *index;
+        }
+
+        const size_t new_index = m_entries.size();
+        const char *stored_name = m_name_arena.push(name.data(), name.length());
+        m_entry_indices.emplace(ix_StringView(stored_name, name.length()), new_index);
+        m_entries.push_back({stored_name, name.length(), MACRO_PROFILE_KIND_MACRO, 0, 0, 0.0});
+        return new_index;
+    }
+
+    size_t find_or_add_lua_fragment_entry(uint64_t line_number)
+    {
+        char name[64];
+        const int length = ix_snprintf(name, ix_LENGTH_OF(name), "__LUA__:%" PRIu64 "", line_number);
+        return find_or_add_entry(ix_StringView(name, static_cast<size_t>(length)));
+    }
+
+    void record(size_t index, MacroProfileKind kind, size_t output_length, double elapsed_sec)
+    {
+        Entry &entry = m_entries[index];
+        entry.kind = kind; // A name may be redefined as a Lua macro and back.
+        entry.num_calls += 1;
+        entry.output_bytes += output_length;
+        entry.elapsed_sec += elapsed_sec;
+    }
+
+    // The slowest macros come first.
+    void write(const ix_FileHandle &file, bool json) const
+    {
+        ix_Vector<const Entry *> sorted;
+        sorted.reserve(m_entries.size());
+        for (const Entry &entry : m_entries)
+        {
+            if (entry.num_calls == 0)
+            {
+                continue; // Looked up, but cancelled or recorded under another name.
+            }
+            size_t i = sorted.size();
+            sorted.push_back(&entry);
+            while ((i > 0) && (sorted[i - 1]->elapsed_sec < entry.elapsed_sec))
+            {
+                sorted[i] = sorted[i - 1];
+                i -= 1;
+            }
+            sorted[i] = &entry;
+        }
+
+        if (json)
+        {
+            write_json(file, sorted);
+            return;
+        }
+
+        uint64_t total_calls = 0;
+        uint64_t total_bytes = 0;
+        double total_sec = 0.0;
+        file.write_stringf("%12s %14s %12s  %-10s %s\n", "calls", "bytes", "ms", "kind", "name");
+        for (const Entry *entry : sorted)
+        {
+            file.write_stringf("%12" PRIu64 " %14" PRIu64 " %12.3f  %-10s %.*s\n", entry->num_calls,
+                               entry->output_bytes, entry->elapsed_sec * 1000.0, MACRO_PROFILE_KIND_NAMES[entry->kind],
+                               static_cast<int>(entry->name_length), entry->name);
+            total_calls += entry->num_calls;
+            total_bytes += entry->output_bytes;
+            total_sec += entry->elapsed_sec;
+        }
+        file.write_stringf("%12" PRIu64 " %14" PRIu64 " %12.3f  %-10s\n", total_calls, total_bytes, total_sec * 1000.0,
+                           "total");
+    }
+
+  private:
+    static void write_json(const ix_FileHandle &file, const ix_Vector<const Entry *> &sorted)
+    {
+        ix_Buffer name(64);
+        file.write_string("{\"macros\": [");
+        for (size_t i = 0; i < sorted.size(); i++)
+        {
+            const Entry *entry = sorted[i];
+            name.clear();
+            for (size_t j = 0; j < entry->name_length; j++)
+            {
+                const char c = entry->name[j];
+                if ((c == '"') || (c == '\\'))
+                {
+                    name.push_char('\\');
+                    name.push_char(c);
+                }
+                else if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    char escaped[8];
+                    const int length = ix_snprintf(escaped, ix_LENGTH_OF(escaped), "\\u%04x", c);
+                    name.push(escaped, static_cast<size_t>(length));
+                }
+                else
+                {
+                    name.push_char(c);
+                }
+            }
+
+            file.write_stringf("%s\n  {\"name\": \"%.*s\", \"kind\": \"%s\", "
+                               "\"calls\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"time_ms\": %.6f}",
+                               (i == 0) ? "" : ",", static_cast<int>(name.size()), name.data(),
+                               MACRO_PROFILE_KIND_NAMES[entry->kind], entry->num_calls, entry->output_bytes,
+                               entry->elapsed_sec * 1000.0);
+        }
+        file.write_string("\n]}\n");
+    }
+};
+#endif
+
+// Times one call in `expand_macros()` and records it when it goes out of scope, that is, when the loop moves on to the
+// next call. The default is a call of a user macro that produces nothing. Compiles to nothing without gokurai_PROFILE.
+class MacroCallProfile
+{
+#if gokurai_PROFILE
+    MacroProfiler *m_profiler; // `nullptr` if the call is not recorded.
+    size_t m_entry_index;
+    MacroProfileKind m_kind;
+    size_t m_output_length;
+    double m_start_sec;
+
+  public:
+    ix_FORCE_INLINE MacroCallProfile(MacroProfiler *profiler, const ix_StringView &name)
+        : m_profiler(profiler),
+          m_entry_index((profiler == nullptr) ? 0 : profiler->find_or_add_entry(name)),
+          m_kind(MACRO_PROFILE_KIND_MACRO),
+          m_output_length(0),
+          m_start_sec((profiler == nullptr) ? 0.0 : profiler->now_sec())
+    {
+    }
+
+    ix_FORCE_INLINE ~MacroCallProfile()
+    {
+        end();
+    }
+
+    MacroCallProfile(const MacroCallProfile &) = delete;
+    MacroCallProfile &operator=(const MacroCallProfile &) = delete;
+
+    ix_FORCE_INLINE void set_kind(MacroProfileKind kind)
+    {
+        m_kind = kind;
+    }
+
+    ix_FORCE_INLINE void set_lua_fragment(uint64_t line_number)
+    {
+        m_kind = MACRO_PROFILE_KIND_LUA_FRAGMENT;
+        if (m_profiler != nullptr)
+        {
+            m_entry_index = m_profiler->find_or_add_lua_fragment_entry(line_number);
+        }
+    }
+
+    ix_FORCE_INLINE void set_output_length(size_t output_length)
+    {
+        m_output_length = output_length;
+    }
+
+    ix_FORCE_INLINE void cancel()
+    {
+        m_profiler = nullptr;
+    }
+
+    // Records the call now, e.g. before the next line is expanded as a part of it.
+    ix_FORCE_INLINE void end()
+    {
+        if (ix_UNLIKELY(m_profiler != nullptr))
+        {
+            const double elapsed_sec = m_profiler->now_sec() - m_start_sec;
+            m_profiler->record(m_entry_index, m_kind, m_output_length, elapsed_sec);
+            m_profiler = nullptr;
+        }
+    }
+#else
+  public:
+    ix_FORCE_INLINE void set_kind(MacroProfileKind)
+    {
+    }
+
+    ix_FORCE_INLINE void set_lua_fragment(uint64_t)
+    {
+    }
+
+    ix_FORCE_INLINE void set_output_length(size_t)
+    {
+    }
+
+    ix_FORCE_INLINE void cancel()
+    {
+    }
+
+    ix_FORCE_INLINE void end()
+    {
+    }
+#endif
+};
+
+#if gokurai_TRACE
+// Writes spans of work as Chrome trace events (in the JSON array format) to be opened in Perfetto or
+// chrome://tracing. Times are in microseconds since the trace started, and each span has the input line number it
+// started on. The events are buffered and written as the buffer fills up, and the array is closed by `stop()`.
+class Tracer
+{
+    static constexpr size_t BUFFER_SIZE = 64 * 1024;
+
+    ix_Writer m_writer;
+    ix_Clock m_clock;
+    bool m_enabled;
+    bool m_first_event;
+
+  public:
+    Tracer()
+        : m_writer(0),
+          m_enabled(false),
+          m_first_event(true)
+    {
+    }
+
+    ~Tracer()
+    {
+        stop();
+    }
+
+    Tracer(const Tracer &) = delete;
+    Tracer &operator=(const Tracer &) = delete;
+
+    ix_FORCE_INLINE bool enabled() const
+    {
+        return m_enabled;
+    }
+
+    void start(const ix_FileHandle *file)
+    {
+        stop();
+        m_writer.substitute(file);
+        m_writer.reserve_buffer_capacity(BUFFER_SIZE);
+        m_writer.write_string("[\n");
+        m_clock.capture();
+        m_enabled = true;
+        m_first_event = true;
+    }
+
+    void stop()
+    {
+        if (!m_enabled)
+        {
+            return;
+        }
+
+        m_writer.write_string("\n]\n");
+        m_writer.flush();
+        m_writer.substitute(nullptr);
+        m_enabled = false;
+    }
+
+    ix_FORCE_INLINE double now_us() const
+    {
+        return m_clock.elaplsed_us();
+    }
+
+    void write_span(const char *name, double start_us, uint64_t line_number)
+    {
+        const double duration_us = now_us() - start_us;
+        m_writer.write_stringf("%s{\"name\": \"%s\", \"cat\": \"gokurai\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                               "\"pid\": 1, \"tid\": 1, \"args\": {\"line\": %" PRIu64 "}}",
+                               m_first_event ? "" : ",\n", name, start_us, duration_us, line_number);
+        m_first_event = false;
+        if (m_writer.buffer_size() >= BUFFER_SIZE)
+        {
+            m_writer.flush();
+        }
+    }
+};
+#endif
+
+// A span of work written to the tracer when it goes out of scope. Compiles to nothing without gokurai_TRACE.
+class TraceSpan
+{
+#if gokurai_TRACE
+    Tracer *m_tracer; // `nullptr` if not tracing.
+    const char *m_name;
+    uint64_t m_line_number;
+    double m_start_us;
+
+  public:
+    ix_FORCE_INLINE TraceSpan(Tracer *tracer, const char *name, uint64_t line_number)
+        : m_tracer(tracer),
+          m_name(name),
+          m_line_number(line_number),
+          m_start_us((tracer == nullptr) ? 0.0 : tracer->now_us())
+    {
+    }
+
+    ix_FORCE_INLINE ~TraceSpan()
+    {
+        if (ix_UNLIKELY(m_tracer != nullptr))
+        {
+            m_tracer->write_span(m_name, m_start_us, m_line_number);
+        }
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+    ix_FORCE_INLINE void set_line_number(uint64_t line_number)
+    {
+        m_line_number = line_number;
+    }
+#else
+  public:
+    ix_FORCE_INLINE ~TraceSpan() // Not trivial, so that unused spans are not warned about.
+    {
+    }
+
+    ix_FORCE_INLINE void set_line_number(uint64_t)
+    {
+    }
+#endif
+};
+
+class GokuraiContextImpl
+{
+    const char *m_input; // Either the chunk being fed or `m_input_carry`.
+    size_t m_input_length;
+    size_t m_input_remaining;
+    ix_Buffer m_input_carry; // Input fed but not processed yet, e.g. an incomplete last line.
+    size_t m_input_needed;   // A starved unit is not retried before the carry grows this large.
+    bool m_input_ended;
+    bool m_input_ends_with_newline;
+    bool m_input_starved;
+    // A unit is a line read by the main loop together with everything it pulls in (blocks, NO_NEWLINE, ...).
+    // A unit that runs out of input before the input ends is rolled back to its start and retried with more input.
+    size_t m_unit_input_offset;
+    uint64_t m_unit_input_line_number;
+    bool m_unit_clear_local_macro_on_next_read;
+    bool m_unit_lua_enabled;
+    bool m_local_macros_hidden; // Cleared by the unit, but kept until it is done in case it is rolled back.
+    ix_Vector<PendingInput> m_unit_pending_inputs;
+    // Lua code is not run again when a unit is retried. Its outputs are replayed instead.
+    ix_StringArena m_unit_lua_output_arena;
+    ix_Vector<ix_StringView> m_unit_lua_outputs;
+    size_t m_unit_lua_output_index;
+    const ix_FileHandle *m_err_handle;
+
     bool m_lua_enabled;
     bool m_current_line_has_lazy_call;
     bool m_redo_macro_expansion;
@@ -521,16 +1777,67 @@ class GokuraiContextImpl
     uint64_t m_current_input_line_number;
     uint64_t m_current_output_line_number;
     ix_Writer m_output_writer;
+    size_t m_output_high_water_mark; // Output to a file handle is flushed once this much is buffered.
     ix_Buffer m_line_buffer;
+    size_t m_line_tail_length;
     ix_Buffer m_block_buffer;
     ix_Buffer m_temp_buffer;
-    ix_Buffer m_secondary_input_buffer;
-    size_t m_secondary_input_offset;
+    ix_Vector<PendingInput> m_pending_inputs; // The last one is read first.
+    ix_StringArena m_pending_input_arena;
     ix_StringArena m_global_string_arena;
     ix_StringArena m_local_string_arena;
     ix_HashMapSingleArray<ix_StringView, Macro> m_global_macros;
     ix_HashMapSingleArray<ix_StringView, Macro> m_local_macros;
+    ix_Vector<MacroSegment> m_global_macro_segments;
+    ix_Vector<MacroSegment> m_local_macro_segments;
+    ix_Vector<CallSearchCheckpoint> m_call_search_checkpoints;
+    bool m_macro_cache_enabled;
+    bool m_probing_macro_expansion;
+    bool m_macro_expansion_probe_failed;
+    uint64_t m_macro_cache_generation;
+    uint64_t m_macro_cache_hits;
+    uint64_t m_macro_cache_misses;
+    ix_StringArena m_macro_cache_arena;
+    ix_HashSet<ix_StringView> m_macro_cache_dependencies; // Names looked up while making the cache.
+    ix_Buffer m_probe_line_buffer;
+    ix_Vector<CallSearchCheckpoint> m_probe_call_search_checkpoints;
     lua_State *m_lua_state;
+    // The functions compiled from fragments, kept in the Lua registry and keyed by the fragment without "return ".
+    // The same fragment is often run many times, e.g. from a macro body, but fragments made from arguments may all
+    // differ, so the cache is emptied when it is full.
+    ix_HashMapSingleArray<ix_StringView, int> m_lua_chunk_refs;
+    ix_StringArena m_lua_chunk_arena;
+    uint64_t m_lua_chunk_cache_hits;
+    uint64_t m_lua_chunk_cache_misses;
+    bool m_replaying_lua_history;
+    LuaAllocator m_lua_allocator;
+
+    // Limits on each run of Lua code (zero for none), and what is left of them in the current run.
+    uint64_t m_lua_instruction_limit;
+    double m_lua_time_limit_sec;
+    size_t m_lua_heap_limit;
+    uint64_t m_lua_instructions_left;
+    int m_lua_hook_count;
+    ix_Clock m_lua_run_clock;
+    // The Lua code run so far, if recorded. A context forked from a snapshot runs it again in its own Lua state.
+    bool m_lua_history_enabled;
+    ix_StringArena m_lua_history_arena;
+    ix_Vector<ix_StringView> m_lua_history;
+    ix_Vector<LuaHistoryResult> m_lua_history_results;
+    size_t m_lua_history_result_index; // The next result to return while the history is run again.
+    bool m_recording_lua_program;      // Whether the Lua code being run goes to the history.
+    ix_Vector<SharedArenaChunks *> m_shared_chunks; // What the macros and the history may point into.
+
+    // Global macros not defined in the context are looked up here, and copied into `m_global_macros` when found.
+    const GokuraiLibraryImpl *m_library;
+    ix_HashSet<ix_StringView> m_undefined_library_macros; // Removed by `gokurai.undefine()`. Point into the library.
+
+#if gokurai_PROFILE
+    MacroProfiler m_profiler;
+#endif
+#if gokurai_TRACE
+    Tracer m_tracer;
+#endif
 
   public:
     GokuraiContextImpl(const GokuraiContextImpl &) = delete;
@@ -541,6 +1848,7 @@ class GokuraiContextImpl
     ~GokuraiContextImpl()
     {
         m_output_writer.flush();
+        release_shared_chunks();
 
         if (m_lua_state != nullptr)
         {
@@ -552,20 +1860,55 @@ class GokuraiContextImpl
         : m_input(nullptr),
           m_input_length(0),
           m_input_remaining(0),
+          m_input_carry(ix_OPT_LEVEL(DEBUG) ? 1 : 4096),
+          m_input_needed(0),
+          m_input_ended(false),
+          m_input_ends_with_newline(true),
+          m_input_starved(false),
+          m_unit_input_offset(0),
+          m_unit_input_line_number(0),
+          m_unit_clear_local_macro_on_next_read(false),
+          m_unit_lua_enabled(true),
+          m_local_macros_hidden(false),
+          m_unit_lua_output_arena(ix_OPT_LEVEL(DEBUG) ? 1 : 256),
+          m_unit_lua_output_index(0),
           m_err_handle(err_handle),
           m_lua_enabled(true),
           m_clear_local_macro_on_next_read(false),
           m_current_input_line_number(0),
           m_current_output_line_number(1),
-          m_output_writer(8192, out_handle),
+          m_output_writer(DEFAULT_OUTPUT_HIGH_WATER_MARK, out_handle),
+          m_output_high_water_mark((out_handle == nullptr) ? ix_SIZE_MAX : DEFAULT_OUTPUT_HIGH_WATER_MARK),
           m_line_buffer(ix_OPT_LEVEL(DEBUG) ? 1 : 1024),
+          m_line_tail_length(0),
           m_block_buffer(ix_OPT_LEVEL(DEBUG) ? 1 : 1024),
           m_temp_buffer(ix_OPT_LEVEL(DEBUG) ? 1 : 1024),
-          m_secondary_input_buffer(ix_OPT_LEVEL(DEBUG) ? 1 : 1024),
-          m_secondary_input_offset(0),
+          m_pending_input_arena(ix_OPT_LEVEL(DEBUG) ? 1 : 1024),
           m_global_string_arena(ix_OPT_LEVEL(DEBUG) ? 1 : 4096),
           m_local_string_arena(ix_OPT_LEVEL(DEBUG) ? 1 : 1024),
-          m_lua_state(nullptr)
+          m_macro_cache_enabled(true),
+          m_probing_macro_expansion(false),
+          m_macro_expansion_probe_failed(false),
+          m_macro_cache_generation(1),
+          m_macro_cache_hits(0),
+          m_macro_cache_misses(0),
+          m_macro_cache_arena(ix_OPT_LEVEL(DEBUG) ? 1 : 1024),
+          m_probe_line_buffer(ix_OPT_LEVEL(DEBUG) ? 1 : 256),
+          m_lua_state(nullptr),
+          m_lua_chunk_arena(ix_OPT_LEVEL(DEBUG) ? 1 : 4096),
+          m_lua_chunk_cache_hits(0),
+          m_lua_chunk_cache_misses(0),
+          m_replaying_lua_history(false),
+          m_lua_instruction_limit(0),
+          m_lua_time_limit_sec(0.0),
+          m_lua_heap_limit(0),
+          m_lua_instructions_left(0),
+          m_lua_hook_count(0),
+          m_lua_history_enabled(false),
+          m_lua_history_arena(ix_OPT_LEVEL(DEBUG) ? 1 : 1024),
+          m_lua_history_result_index(0),
+          m_recording_lua_program(false),
+          m_library(nullptr)
     {
     }
 
@@ -576,6 +1919,16 @@ class GokuraiContextImpl
         m_input = nullptr;
         m_input_length = 0;
         m_input_remaining = 0;
+        m_input_carry.clear();
+        m_input_needed = 0;
+        m_input_ended = false;
+        m_input_ends_with_newline = true;
+        m_input_starved = false;
+        m_local_macros_hidden = false;
+        m_unit_pending_inputs.clear();
+        m_unit_lua_output_arena.clear();
+        m_unit_lua_outputs.clear();
+        m_unit_lua_output_index = 0;
 
         m_lua_enabled = true;
         m_current_line_has_lazy_call = false;
@@ -585,29 +1938,69 @@ class GokuraiContextImpl
         m_current_input_line_number = 0;
         m_current_output_line_number = 1;
         m_output_writer.clear();
+        set_output_high_water_mark(DEFAULT_OUTPUT_HIGH_WATER_MARK);
         m_line_buffer.clear();
+        m_line_tail_length = 0;
         m_block_buffer.clear();
         m_temp_buffer.clear();
-        m_secondary_input_buffer.clear();
-        m_secondary_input_offset = 0;
+        m_pending_inputs.clear();
+        m_pending_input_arena.clear();
         m_global_string_arena.clear();
         m_local_string_arena.clear();
         m_global_macros.clear();
         m_local_macros.clear();
+        m_global_macro_segments.clear();
+        m_local_macro_segments.clear();
+        m_call_search_checkpoints.clear();
+        m_macro_cache_enabled = true;
+        m_macro_cache_hits = 0;
+        m_macro_cache_misses = 0;
+        invalidate_macro_cache();
         if (m_lua_state != nullptr)
         {
             lua_close(m_lua_state);
             m_lua_state = nullptr;
         }
+        m_lua_allocator.reset();
+        m_lua_chunk_refs.clear();
+        m_lua_chunk_arena.clear();
+        m_lua_chunk_cache_hits = 0;
+        m_lua_chunk_cache_misses = 0;
+        m_lua_instruction_limit = 0;
+        m_lua_time_limit_sec = 0.0;
+        m_lua_heap_limit = 0;
+        m_lua_history_enabled = false;
+        m_lua_history_arena.clear();
+        m_lua_history.clear();
+        m_lua_history_results.clear();
+        m_lua_history_result_index = 0;
+        release_shared_chunks();
+        m_library = nullptr;
+        m_undefined_library_macros.clear();
+#if gokurai_PROFILE
+        m_profiler.clear();
+#endif
+#if gokurai_TRACE
+        m_tracer.stop();
+#endif
     }
 
-    void feed_input(const char *input, size_t input_length)
+    void release_shared_chunks()
     {
-        m_input = input;
-        m_input_length = input_length;
-        m_input_remaining = input_length;
+        for (SharedArenaChunks *shared : m_shared_chunks)
+        {
+            SharedArenaChunks::release(shared);
+        }
+        m_shared_chunks.clear();
+    }
 
-        if (m_output_writer.buffer_capacity() < input_length)
+    // The input may be fed in chunks of any size. A line that does not end in the chunk is carried over to the next
+    // one, and so is a unit (e.g. a block) that does not end in it. `end_input()` processes whatever is left.
+    void feed_input(const char *input, size_t input_length)
+    {
+        // Output to a file handle is flushed as it goes, so only the in-memory output is worth reserving.
+        const bool backed_by_file_handle = (m_output_writer.file_handle() != nullptr);
+        if (!backed_by_file_handle && (m_output_writer.buffer_capacity() < input_length))
         {
             m_output_writer.reserve_buffer_capacity(input_length);
         }
@@ -617,11 +2010,54 @@ class GokuraiContextImpl
             return;
         }
 
-        const bool input_ends_with_newline = (input[input_length - 1] == '\n');
+        m_input_ends_with_newline = (input[input_length - 1] == '\n');
+
+        if (ix_LIKELY(m_input_carry.empty()))
+        {
+            m_input = input;
+            m_input_length = input_length;
+            m_input_remaining = input_length;
+            process_input();
+            carry_unprocessed_input();
+            return;
+        }
+
+        m_input_carry.push(input, input_length);
+        if (m_input_carry.size() < m_input_needed)
+        {
+            return;
+        }
+
+        process_carried_input();
+    }
+
+    void process_carried_input()
+    {
+        m_input = m_input_carry.data();
+        m_input_length = m_input_carry.size();
+        m_input_remaining = m_input_length;
+        process_input();
+
+        const size_t processed_length = m_input_length - m_input_remaining;
+        ix_memmove(m_input_carry.data(), m_input_carry.data() + processed_length, m_input_remaining);
+        m_input_carry.pop_back(processed_length);
+        m_input = m_input_carry.data();
+        m_input_length = m_input_remaining;
+    }
+
+    void carry_unprocessed_input()
+    {
+        m_input_carry.push(m_input + (m_input_length - m_input_remaining), m_input_remaining);
+        m_input = m_input_carry.data();
+        m_input_length = m_input_remaining;
+    }
 
-        // The main loop.
+    // The main loop.
+    void process_input()
+    {
         while (true)
         {
+            begin_unit();
             m_line_buffer.clear();
             load_next_line(true);
 
@@ -631,11 +2067,15 @@ class GokuraiContextImpl
             }
 
             m_clear_local_macro_on_next_read = true;
-            bool directive_found;
+            bool directive_found = false;
             do
             {
                 m_redo_macro_expansion = false;
                 expand_non_lazy_macros();
+                if (ix_UNLIKELY(m_input_starved))
+                {
+                    break;
+                }
 
                 directive_found = find_and_process_directive();
                 if (directive_found)
@@ -646,6 +2086,10 @@ class GokuraiContextImpl
                 if (m_current_line_has_lazy_call)
                 {
                     expand_lazy_macros();
+                    if (ix_UNLIKELY(m_input_starved))
+                    {
+                        break;
+                    }
                 }
 
                 directive_found = find_and_process_directive();
@@ -656,6 +2100,11 @@ class GokuraiContextImpl
 
             } while (m_redo_macro_expansion);
 
+            if (ix_UNLIKELY(m_input_starved))
+            {
+                break;
+            }
+
             if (directive_found)
             {
                 continue;
@@ -664,9 +2113,10 @@ class GokuraiContextImpl
             unquote_macro_calls(m_line_buffer);
             unquote_directive(m_line_buffer);
 
-            const bool trim_newline = !input_ends_with_newline && //
-                                      (m_input_remaining == 0) && //
-                                      (m_secondary_input_buffer.size() == m_secondary_input_offset);
+            const bool trim_newline = m_input_ended &&               //
+                                      !m_input_ends_with_newline && //
+                                      (m_input_remaining == 0) &&   //
+                                      m_pending_inputs.empty();
             if (ix_UNLIKELY(trim_newline))
             {
                 m_output_writer.write(m_line_buffer.data(), m_line_buffer.size() - ix_strlen("\n"));
@@ -676,11 +2126,36 @@ class GokuraiContextImpl
                 m_output_writer.write(m_line_buffer.data(), m_line_buffer.size());
             }
             m_current_output_line_number += 1;
+
+            if (ix_UNLIKELY(m_output_writer.buffer_size() >= m_output_high_water_mark))
+            {
+                const TraceSpan span = trace_span("flush output");
+                m_output_writer.flush();
+            }
+        }
+
+        if (ix_UNLIKELY(m_input_starved))
+        {
+            rollback_unit();
+            // Retrying costs as much as the unit read so far, so wait until there is twice as much input.
+            m_input_needed = 2 * m_input_remaining;
+        }
+        else
+        {
+            m_input_needed = 0;
         }
     }
 
     void end_input(GokuraiResultImpl *result)
     {
+        m_input_ended = true;
+        process_carried_input();
+        m_input_ended = false;
+        m_input_ends_with_newline = true;
+        m_input_needed = 0;
+        m_input = nullptr;
+        m_input_length = 0;
+
         if (result != nullptr)
         {
             result->clear();
@@ -689,6 +2164,7 @@ class GokuraiContextImpl
         const bool backed_by_file_handle = (m_output_writer.file_handle() != nullptr);
         if (backed_by_file_handle)
         {
+            const TraceSpan span = trace_span("flush output");
             m_output_writer.flush();
             return;
         }
@@ -701,6 +2177,359 @@ class GokuraiContextImpl
         }
     }
 
+    // Records the Lua code run from now on, so that forks of this context can run it again.
+    void set_lua_history_enabled(bool enabled)
+    {
+        m_lua_history_enabled = enabled;
+    }
+
+    // The strings pushed so far to the global and local arenas and the Lua history are handed over to shared chunks,
+    // which the snapshot and this context then share with each fork. Nothing is deep-copied but the macro tables.
+    void take_snapshot(GokuraiSnapshotImpl &snapshot)
+    {
+        SharedArenaChunks *shared = ix_new<SharedArenaChunks>();
+        shared->ref_count = 1;
+        m_global_string_arena.detach(shared->chunks);
+        m_local_string_arena.detach(shared->chunks);
+        m_lua_history_arena.detach(shared->chunks);
+        m_shared_chunks.push_back(shared);
+
+        snapshot.global_macros = m_global_macros;
+        snapshot.local_macros = m_local_macros;
+        snapshot.global_macro_segments = m_global_macro_segments;
+        snapshot.local_macro_segments = m_local_macro_segments;
+        for (auto &kv : snapshot.global_macros)
+        {
+            kv.value.cache_generation = 0; // The cached expansions stay with this context.
+        }
+        snapshot.lua_history = m_lua_history;
+        snapshot.lua_history_results = m_lua_history_results;
+        snapshot.library = m_library;
+        snapshot.undefined_library_macros = m_undefined_library_macros;
+        for (SharedArenaChunks *s : m_shared_chunks)
+        {
+            snapshot.shared_chunks.push_back(SharedArenaChunks::retain(s));
+        }
+        snapshot.input_line_number = m_current_input_line_number;
+        snapshot.output_line_number = m_current_output_line_number;
+        snapshot.lua_enabled = m_lua_enabled;
+        snapshot.lua_history_enabled = m_lua_history_enabled;
+        snapshot.clear_local_macro_on_next_read = m_clear_local_macro_on_next_read;
+        snapshot.local_macros_hidden = m_local_macros_hidden;
+    }
+
+    // Continues from where the snapshot was taken, on a context which is fresh or has just been cleared.
+    // The Lua history is run again when the context first needs its Lua state.
+    void restore_snapshot(const GokuraiSnapshotImpl &snapshot)
+    {
+        ix_ASSERT(m_lua_state == nullptr);
+        ix_ASSERT(m_global_macros.empty() && m_local_macros.empty() && m_shared_chunks.empty());
+
+        for (SharedArenaChunks *shared : snapshot.shared_chunks)
+        {
+            m_shared_chunks.push_back(SharedArenaChunks::retain(shared));
+        }
+        m_global_macros = snapshot.global_macros;
+        m_local_macros = snapshot.local_macros;
+        m_global_macro_segments = snapshot.global_macro_segments;
+        m_local_macro_segments = snapshot.local_macro_segments;
+        m_lua_history = snapshot.lua_history;
+        m_lua_history_results = snapshot.lua_history_results;
+        m_library = snapshot.library;
+        m_undefined_library_macros = snapshot.undefined_library_macros;
+        invalidate_macro_cache();
+
+        m_current_input_line_number = snapshot.input_line_number;
+        m_current_output_line_number = snapshot.output_line_number;
+        m_lua_enabled = snapshot.lua_enabled;
+        m_lua_history_enabled = snapshot.lua_history_enabled;
+        m_clear_local_macro_on_next_read = snapshot.clear_local_macro_on_next_read;
+        m_local_macros_hidden = snapshot.local_macros_hidden;
+    }
+
+    // Makes a fresh (or just cleared) context start with the macros and the Lua history of `library`.
+    // Nothing is read from it until a macro is looked up or the Lua state is made.
+    void use_library(const GokuraiLibraryImpl *library)
+    {
+        ix_ASSERT(m_lua_state == nullptr);
+        ix_ASSERT(m_global_macros.empty() && (m_library == nullptr));
+
+        m_library = library;
+        const LibraryHeader *header = library->header;
+        for (size_t i = 0; i < header->num_lua_programs; i++)
+        {
+            const LibraryLuaProgram &program = library->lua_programs[i];
+            m_lua_history.emplace_back(library->data + program.offset, program.length);
+        }
+        for (size_t i = 0; i < header->num_lua_results; i++)
+        {
+            const LibraryLuaResult &result = library->lua_results[i];
+            const ix_StringView string(library->data + result.string_offset, result.string_length);
+            m_lua_history_results.push_back(LuaHistoryResult{string, static_cast<LuaHistoryResultKind>(result.kind)});
+        }
+    }
+
+    Macro *import_library_macro(const ix_StringView &name)
+    {
+        const LibraryEntry *entry = m_library->find(name);
+        if ((entry == nullptr) || m_undefined_library_macros.contains(name))
+        {
+            return nullptr;
+        }
+        import_library_entry(*entry);
+        return m_global_macros.find(name);
+    }
+
+    void import_library_entry(const LibraryEntry &entry)
+    {
+        const size_t first_segment = m_global_macro_segments.size();
+        for (size_t i = 0; i < entry.num_segments; i++)
+        {
+            const LibrarySegment &segment = m_library->segments[entry.first_segment + i];
+            m_global_macro_segments.push_back(MacroSegment{static_cast<size_t>(segment.literal_offset),
+                                                           static_cast<size_t>(segment.literal_length),
+                                                           static_cast<uint8_t>(segment.arg_index)});
+        }
+
+        const char *name = m_library->data + entry.name_offset;
+        const char *body = m_library->data + entry.body_offset;
+        const bool lua_macro = (entry.num_first_line_segments == LIBRARY_LUA_MACRO_MARK);
+        Macro macro = {static_cast<size_t>(entry.body_length), static_cast<size_t>(entry.first_line_length),
+                       body,
+                       first_segment,
+                       entry.num_segments,
+                       lua_macro ? 0 : entry.num_first_line_segments};
+        macro.lua_function = lua_macro;
+        m_global_macros.emplace(ix_StringView(name, static_cast<size_t>(entry.name_length)), macro);
+    }
+
+    // Writes the global macros (including those of the library in use) and the Lua history as a library.
+    // Local macros and line numbers are not saved.
+    bool save_library(const ix_FileHandle &file)
+    {
+        if (m_library != nullptr)
+        {
+            const LibraryHeader *header = m_library->header;
+            for (size_t i = 0; i < header->num_macros; i++)
+            {
+                const LibraryEntry &entry = m_library->entries[i];
+                if (!m_library->is_valid_entry(entry))
+                {
+                    return false;
+                }
+                const ix_StringView name(m_library->data + entry.name_offset, static_cast<size_t>(entry.name_length));
+                if (!m_global_macros.contains(name) && !m_undefined_library_macros.contains(name))
+                {
+                    import_library_entry(entry);
+                }
+            }
+        }
+
+        ix_Buffer strings(4096);
+        const auto push_string = [&strings](const char *str, size_t length) {
+            const size_t offset = strings.size();
+            strings.push(str, length);
+            strings.push_char('\0');
+            return static_cast<uint64_t>(offset);
+        };
+
+        const size_t num_macros = m_global_macros.size();
+        const size_t num_buckets = ix_max(size_t{8}, ix_ceil_2_power(2 * num_macros));
+        ix_Vector<uint32_t> buckets(num_buckets);
+        ix_Vector<LibraryEntry> entries;
+        ix_Vector<LibrarySegment> segments;
+        ix_Vector<LibraryLuaProgram> lua_programs;
+        ix_Vector<LibraryLuaResult> lua_results;
+        entries.reserve(num_macros);
+        for (const auto &kv : m_global_macros)
+        {
+            const Macro &macro = kv.value;
+            LibraryEntry entry;
+            entry.hash = ix_hash(kv.key.data(), kv.key.length());
+            entry.name_offset = push_string(kv.key.data(), kv.key.length());
+            entry.name_length = kv.key.length();
+            entry.body_offset = push_string(macro.body, macro.body_length);
+            entry.body_length = macro.body_length;
+            entry.first_line_length = macro.first_line_length;
+            entry.first_segment = segments.size();
+            entry.num_segments = static_cast<uint32_t>(macro.num_segments);
+            entry.num_first_line_segments = static_cast<uint32_t>(macro.num_first_line_segments);
+            if (macro.lua_function)
+            {
+                entry.num_first_line_segments = LIBRARY_LUA_MACRO_MARK;
+            }
+            for (size_t i = 0; i < macro.num_segments; i++)
+            {
+                const MacroSegment &segment = m_global_macro_segments[macro.first_segment + i];
+                segments.push_back(LibrarySegment{segment.literal_offset, segment.literal_length, segment.arg_index});
+            }
+
+            size_t bucket_index = entry.hash & (num_buckets - 1);
+            while (buckets[bucket_index] != 0)
+            {
+                bucket_index = (bucket_index + 1) & (num_buckets - 1);
+            }
+            entries.push_back(entry);
+            buckets[bucket_index] = static_cast<uint32_t>(entries.size());
+        }
+        for (const ix_StringView &program : m_lua_history)
+        {
+            lua_programs.push_back(LibraryLuaProgram{push_string(program.data(), program.length()), program.length()});
+        }
+        for (const LuaHistoryResult &result : m_lua_history_results)
+        {
+            const uint64_t string_offset = push_string(result.string.data(), result.string.length());
+            lua_results.push_back(LibraryLuaResult{string_offset, result.string.length(), result.kind});
+        }
+
+        LibraryHeader header;
+        ix_memset(&header, 0, sizeof(header));
+        ix_memcpy(header.magic, LIBRARY_MAGIC, sizeof(LIBRARY_MAGIC));
+        header.version = LIBRARY_VERSION;
+        header.byte_order_mark = LIBRARY_BYTE_ORDER_MARK;
+        header.hash_size = sizeof(size_t);
+        header.num_buckets = static_cast<uint32_t>(num_buckets);
+        header.num_macros = static_cast<uint32_t>(num_macros);
+        header.num_lua_programs = static_cast<uint32_t>(lua_programs.size());
+        header.num_segments = segments.size();
+        header.buckets_offset = sizeof(LibraryHeader);
+        header.entries_offset = header.buckets_offset + (num_buckets * sizeof(uint32_t));
+        header.segments_offset = header.entries_offset + (entries.size() * sizeof(LibraryEntry));
+        header.lua_programs_offset = header.segments_offset + (segments.size() * sizeof(LibrarySegment));
+        header.num_lua_results = lua_results.size();
+        header.lua_results_offset = header.lua_programs_offset + (lua_programs.size() * sizeof(LibraryLuaProgram));
+        const uint64_t strings_offset = header.lua_results_offset + (lua_results.size() * sizeof(LibraryLuaResult));
+        header.file_size = strings_offset + strings.size();
+
+        for (LibraryEntry &entry : entries)
+        {
+            entry.name_offset += strings_offset;
+            entry.body_offset += strings_offset;
+        }
+        for (LibraryLuaProgram &program : lua_programs)
+        {
+            program.offset += strings_offset;
+        }
+        for (LibraryLuaResult &result : lua_results)
+        {
+            result.string_offset += strings_offset;
+        }
+
+        const auto write = [&file](const void *data, size_t length) { return (file.write(data, length) == length); };
+        return write(&header, sizeof(header)) &&                                       //
+               write(buckets.data(), buckets.size() * sizeof(uint32_t)) &&             //
+               write(entries.data(), entries.size() * sizeof(LibraryEntry)) &&         //
+               write(segments.data(), segments.size() * sizeof(LibrarySegment)) &&     //
+               write(lua_programs.data(), lua_programs.size() * sizeof(LibraryLuaProgram)) && //
+               write(lua_results.data(), lua_results.size() * sizeof(LibraryLuaResult)) &&    //
+               write(strings.data(), strings.size());
+    }
+
+    // The output buffered so far is flushed to the previous handle, or discarded if there is none.
+    void set_output_handle(const ix_FileHandle *out_handle)
+    {
+        m_output_writer.substitute(out_handle);
+        m_output_high_water_mark = (out_handle == nullptr) ? ix_SIZE_MAX : DEFAULT_OUTPUT_HIGH_WATER_MARK;
+    }
+
+    // Ignored unless the output goes to a file handle.
+    void set_output_high_water_mark(size_t size)
+    {
+        const bool backed_by_file_handle = (m_output_writer.file_handle() != nullptr);
+        if (!backed_by_file_handle)
+        {
+            return;
+        }
+
+        m_output_high_water_mark = size;
+        m_output_writer.reserve_buffer_capacity(size);
+    }
+
+    ix_FORCE_INLINE void set_macro_cache_enabled(bool enabled)
+    {
+        m_macro_cache_enabled = enabled;
+    }
+
+    ix_FORCE_INLINE uint64_t macro_cache_hits() const
+    {
+        return m_macro_cache_hits;
+    }
+
+    ix_FORCE_INLINE uint64_t macro_cache_misses() const
+    {
+        return m_macro_cache_misses;
+    }
+
+    ix_FORCE_INLINE uint64_t lua_chunk_cache_hits() const
+    {
+        return m_lua_chunk_cache_hits;
+    }
+
+    ix_FORCE_INLINE uint64_t lua_chunk_cache_misses() const
+    {
+        return m_lua_chunk_cache_misses;
+    }
+
+    ix_FORCE_INLINE size_t lua_heap_size() const
+    {
+        return m_lua_allocator.heap_size();
+    }
+
+    ix_FORCE_INLINE size_t lua_peak_heap_size() const
+    {
+        return m_lua_allocator.peak_heap_size();
+    }
+
+    void set_lua_limits(uint64_t instruction_limit, double time_limit_sec, size_t heap_limit)
+    {
+        m_lua_instruction_limit = instruction_limit;
+        m_lua_time_limit_sec = time_limit_sec;
+        m_lua_heap_limit = heap_limit;
+    }
+
+    // Returns false if the profiler is not compiled in.
+    bool set_profile_enabled(bool enabled)
+    {
+#if gokurai_PROFILE
+        m_profiler.set_enabled(enabled);
+        return true;
+#else
+        ix_UNUSED(enabled);
+        return false;
+#endif
+    }
+
+    // Returns false if the tracer is not compiled in.
+    bool set_trace_handle(const ix_FileHandle *file)
+    {
+#if gokurai_TRACE
+        if (file == nullptr)
+        {
+            m_tracer.stop();
+        }
+        else
+        {
+            m_tracer.start(file);
+        }
+        return true;
+#else
+        ix_UNUSED(file);
+        return false;
+#endif
+    }
+
+    bool write_profile(const ix_FileHandle &file, bool json) const
+    {
+#if gokurai_PROFILE
+        m_profiler.write(file, json);
+        return true;
+#else
+        ix_UNUSED(file);
+        ix_UNUSED(json);
+        return false;
+#endif
+    }
+
   private:
     bool find_and_process_directive()
     {
@@ -711,49 +2540,41 @@ class GokuraiContextImpl
             return false;
         }
 
-        const size_t line_length = m_line_buffer.size();
-        if ((line_length >= GLOBAL_MACRO_HEADER.length()) && //
-            ix_starts_with(line_start, GLOBAL_MACRO_HEADER.data()))
+        const TraceSpan span = trace_span("directive");
+        switch (find_directive(line_start))
         {
+        case DIRECTIVE_GLOBAL_MACRO_HEADER:
             read_global_macro_definition();
             return true;
-        }
 
-        if ((line_length >= LOCAL_MACRO_HEADER.length()) && //
-            ix_starts_with(line_start, LOCAL_MACRO_HEADER.data()))
-        {
+        case DIRECTIVE_LOCAL_MACRO_HEADER:
             m_clear_local_macro_on_next_read = false;
             read_local_macro_definition();
             return true;
-        }
 
-        if ((line_length >= GLOBAL_BLOCK_MACRO_HEADER.length()) && //
-            ix_starts_with(line_start, GLOBAL_BLOCK_MACRO_HEADER.data()))
-        {
+        case DIRECTIVE_GLOBAL_BLOCK_MACRO_HEADER:
             read_global_block_macro_definition();
             return true;
-        }
 
-        if ((line_length >= LOCAL_BLOCK_MACRO_HEADER.length()) && //
-            ix_starts_with(line_start, LOCAL_BLOCK_MACRO_HEADER.data()))
-        {
+        case DIRECTIVE_LOCAL_BLOCK_MACRO_HEADER:
             m_clear_local_macro_on_next_read = false;
             read_local_block_macro_definition();
             return true;
-        }
 
-        if ((line_length >= LUA_BLOCK_HEADER.length()) && //
-            ix_starts_with(line_start, LUA_BLOCK_HEADER.data()))
-        {
+        case DIRECTIVE_LUA_BLOCK_HEADER:
             read_and_eval_lua_block();
             return true;
-        }
 
-        if ((line_length >= COMMENT_BLOCK_HEADER.length()) && //
-            ix_starts_with(line_start, COMMENT_BLOCK_HEADER.data()))
-        {
+        case DIRECTIVE_COMMENT_BLOCK_HEADER:
             skip_comment_block(true);
             return true;
+
+        case DIRECTIVE_NONE:
+        case DIRECTIVE_GLOBAL_BLOCK_MACRO_FOOTER:
+        case DIRECTIVE_LOCAL_BLOCK_MACRO_FOOTER:
+        case DIRECTIVE_LUA_BLOCK_FOOTER:
+        case DIRECTIVE_COMMENT_BLOCK_FOOTER:
+            break;
         }
 
         return false;
@@ -789,18 +2610,27 @@ class GokuraiContextImpl
 
     void load_next_line(bool clear_local_macro)
     {
-        const bool secondary_is_empty = (m_secondary_input_buffer.size() == m_secondary_input_offset);
-        if (ix_LIKELY(secondary_is_empty))
+        ix_ASSERT(m_line_tail_length == 0);
+        if (ix_UNLIKELY(m_input_starved))
+        {
+            return;
+        }
+
+        TraceSpan span = trace_span("load line");
+
+        const bool no_pending_input = m_pending_inputs.empty();
+        if (ix_LIKELY(no_pending_input))
         {
             if (ix_UNLIKELY(m_clear_local_macro_on_next_read && clear_local_macro))
             {
-                m_local_macros.clear();
-                m_local_string_arena.clear();
+                hide_local_macros();
             }
 
+            // Until the input ends, a unit that runs out of it is abandoned and retried once more input is fed.
             const bool input_exhausted = (m_input_remaining == 0);
             if (input_exhausted)
             {
+                m_input_starved = !m_input_ended;
                 return;
             }
 
@@ -810,42 +2640,209 @@ class GokuraiContextImpl
             const bool this_line_is_last_and_has_no_newline = (line_end == nullptr);
             if (this_line_is_last_and_has_no_newline)
             {
+                if (!m_input_ended)
+                {
+                    m_input_starved = true;
+                    return;
+                }
                 line_end = m_input + m_input_length;
             }
 
-            m_line_buffer.push_between(line_start, line_end);
-            m_line_buffer.push_char('\n');
-            m_input_remaining = static_cast<size_t>((m_input + m_input_length) - line_end) - 1;
-            if (this_line_is_last_and_has_no_newline)
-            {
-                ix_ASSERT(m_input_remaining == ix_SIZE_MAX);
-                m_input_remaining = 0;
-            }
-            m_current_input_line_number += 1;
+            m_line_buffer.push_between(line_start, line_end);
+            m_line_buffer.push_char('\n');
+            m_input_remaining = static_cast<size_t>((m_input + m_input_length) - line_end) - 1;
+            if (this_line_is_last_and_has_no_newline)
+            {
+                ix_ASSERT(m_input_remaining == ix_SIZE_MAX);
+                m_input_remaining = 0;
+            }
+            m_current_input_line_number += 1;
+            span.set_line_number(m_current_input_line_number);
+        }
+        else
+        {
+            // A line can continue into the next pending input (e.g. the last line of a multiline macro is followed
+            // by the rest of the line in which it was called).
+            while (true)
+            {
+                PendingInput &pending_input = m_pending_inputs.back();
+                const size_t length = static_cast<size_t>(pending_input.end - pending_input.start);
+                const char *newline = static_cast<const char *>(ix_memchr(pending_input.start, '\n', length));
+                if (newline != nullptr)
+                {
+                    m_line_buffer.push_between(pending_input.start, newline + 1);
+                    pending_input.start = newline + 1;
+                    if (pending_input.start == pending_input.end)
+                    {
+                        pop_pending_input();
+                    }
+                    break;
+                }
+
+                m_line_buffer.push_between(pending_input.start, pending_input.end);
+                pop_pending_input();
+                ix_ASSERT(!m_pending_inputs.empty()); // Pending inputs always end with a newline.
+            }
+        }
+    }
+
+    // `str` must outlive the pending input, i.e. it must be in a string arena (or be a string literal).
+    ix_FORCE_INLINE void push_pending_input(const char *str, size_t str_length)
+    {
+        if (str_length != 0)
+        {
+            m_pending_inputs.push_back(PendingInput{str, str + str_length});
+        }
+    }
+
+    ix_FORCE_INLINE void push_pending_input_copy(const char *str, size_t str_length)
+    {
+        if (str_length != 0)
+        {
+            const char *copy = m_pending_input_arena.push(str, str_length);
+            m_pending_inputs.push_back(PendingInput{copy, copy + str_length});
+        }
+    }
+
+    // `m_pending_input_arena` is cleared by `begin_unit()`, since a rollback may bring popped inputs back.
+    ix_FORCE_INLINE void pop_pending_input()
+    {
+        m_pending_inputs.pop_back();
+    }
+
+    void hide_local_macros()
+    {
+        if (m_local_macros_hidden || m_local_macros.empty())
+        {
+            return;
+        }
+
+        for (const auto &kv : m_local_macros)
+        {
+            on_macro_definition_change(kv.key);
+        }
+        m_local_macros_hidden = true;
+    }
+
+    void clear_hidden_local_macros()
+    {
+        if (m_local_macros_hidden)
+        {
+            m_local_macros.clear();
+            m_local_string_arena.clear();
+            m_local_macro_segments.clear();
+            m_local_macros_hidden = false;
+        }
+    }
+
+    // The unit is past its last load, so it will not be rolled back. The strings stay until the next clear.
+    void drop_hidden_local_macros()
+    {
+        if (m_local_macros_hidden)
+        {
+            m_local_macros.clear();
+            m_local_macro_segments.clear();
+            m_local_macros_hidden = false;
+        }
+    }
+
+    // Unlike the assignment of `ix_Vector`, which reallocates, this keeps the capacity of `dst` across units.
+    ix_FORCE_INLINE static void copy_pending_inputs(ix_Vector<PendingInput> &dst, const ix_Vector<PendingInput> &src)
+    {
+        dst.clear();
+        if (src.empty())
+        {
+            return; // The data of an empty vector may be null, which `ix_memcpy()` must not be given.
+        }
+        dst.insert(dst.end(), src.begin(), src.end());
+    }
+
+    void begin_unit()
+    {
+        clear_hidden_local_macros();
+        if (m_pending_inputs.empty())
+        {
+            m_pending_input_arena.clear();
+            m_unit_pending_inputs.clear();
         }
         else
         {
-            const char *line_start = m_secondary_input_buffer.data() + m_secondary_input_offset;
-            const char *line_end = ix_memnext(line_start, '\n') + 1;
-            m_line_buffer.push_between(line_start, line_end);
-            m_secondary_input_offset += static_cast<size_t>(line_end - line_start);
+            copy_pending_inputs(m_unit_pending_inputs, m_pending_inputs);
+        }
+
+        m_unit_input_offset = m_input_length - m_input_remaining;
+        m_unit_input_line_number = m_current_input_line_number;
+        m_unit_clear_local_macro_on_next_read = m_clear_local_macro_on_next_read;
+        m_unit_lua_enabled = m_lua_enabled;
+        if (!m_unit_lua_outputs.empty())
+        {
+            m_unit_lua_output_arena.clear();
+            m_unit_lua_outputs.clear();
+        }
+        m_unit_lua_output_index = 0;
+    }
+
+    void rollback_unit()
+    {
+        ix_ASSERT(m_input_starved);
+        m_input_starved = false;
+        m_input_remaining = m_input_length - m_unit_input_offset;
+        m_current_input_line_number = m_unit_input_line_number;
+        m_clear_local_macro_on_next_read = m_unit_clear_local_macro_on_next_read;
+        m_lua_enabled = m_unit_lua_enabled;
+        m_unit_lua_output_index = 0;
+        copy_pending_inputs(m_pending_inputs, m_unit_pending_inputs);
+        m_line_buffer.clear();
+        m_line_tail_length = 0;
+        if (m_local_macros_hidden)
+        {
+            m_local_macros_hidden = false;
+            for (const auto &kv : m_local_macros)
+            {
+                on_macro_definition_change(kv.key);
+            }
         }
     }
 
     ix_FORCE_INLINE void expand_non_lazy_macros()
     {
+        const TraceSpan span = trace_span("expand");
         m_current_line_has_lazy_call = false;
         expand_macros(false);
     }
 
     ix_FORCE_INLINE void expand_lazy_macros()
     {
+        const TraceSpan span = trace_span("expand lazy");
         expand_macros(true);
     }
 
+    ix_FORCE_INLINE TraceSpan trace_span(const char *name)
+    {
+#if gokurai_TRACE
+        return TraceSpan(m_tracer.enabled() ? &m_tracer : nullptr, name, m_current_input_line_number);
+#else
+        ix_UNUSED(name);
+        return TraceSpan();
+#endif
+    }
+
+    // Calls made while probing for the macro cache count as a part of the call that probes.
+    ix_FORCE_INLINE MacroCallProfile begin_call_profile(const ix_StringView &name)
+    {
+#if gokurai_PROFILE
+        const bool record = m_profiler.enabled() && !m_probing_macro_expansion;
+        return MacroCallProfile(record ? &m_profiler : nullptr, name);
+#else
+        ix_UNUSED(name);
+        return MacroCallProfile();
+#endif
+    }
+
     void expand_macros(bool expand_lazy_calls)
     {
         size_t macro_free_suffix_length = ix_strlen("\n");
+        m_call_search_checkpoints.clear();
 
         while (true)
         {
@@ -880,6 +2877,7 @@ class GokuraiContextImpl
             }
 
             const ix_StringView macro_name_view = ix_StringView(macro_name_start, macro_name_end);
+            MacroCallProfile profile = begin_call_profile(macro_name_view);
             const char first_char = *macro_name_start;
             const bool normal_macro = (first_char != '_');
             if (ix_LIKELY(normal_macro))
@@ -887,135 +2885,162 @@ class GokuraiContextImpl
                 goto MACRO_LOOKUP;
             }
 
-            if (m_lua_enabled)
+            if (m_probing_macro_expansion && (find_builtin_macro(macro_name_view) != BUILTIN_MACRO_NONE))
             {
-                constexpr ix_StringView LUA("__LUA__");
-                const bool lua_call = (macro_name_view == LUA);
-                if (ix_UNLIKELY(lua_call))
-                {
-                    const char *fragment_start = call.start + ix_strlen("[[[__LUA__(");
-                    const size_t fragment_length = call.length() - ix_strlen("[[[__LUA__()]]]");
-                    m_temp_buffer.clear();
-                    m_temp_buffer.reserve(LUA_RETURN.length() + fragment_length + 1); // 1 = len("\0")
-                    m_temp_buffer.push(LUA_RETURN.data(), LUA_RETURN.length());
-                    m_temp_buffer.push(fragment_start, fragment_length);
-                    m_temp_buffer.push_char('\0');
-
-                    const char *output;
-                    size_t output_length;
-                    eval_lua_fragment(m_temp_buffer.data(), m_temp_buffer.size(), &output, &output_length);
-
-                    if (output_length == 0)
-                    {
-                        clear_call(call);
-                    }
-                    else
-                    {
-                        const char *first_line_end_minus_one = ix_strchr(output, '\n');
-                        const bool multiline_output = (first_line_end_minus_one != nullptr);
-                        if (!multiline_output)
-                        {
-                            replace_call(call, output, output_length);
-                        }
-                        else
-                        {
-                            const char *first_line_end = first_line_end_minus_one + 1;
-                            const size_t first_line_length = static_cast<size_t>(first_line_end - output);
-                            replace_call_multiline(call, output, output_length, first_line_length);
-                            macro_free_suffix_length = ix_strlen("\n");
-                        }
-                    }
-
-                    lua_settop(m_lua_state, 0);
-                    continue;
-                }
+                m_macro_expansion_probe_failed = true;
+                break;
             }
 
-            if (*call.end == '\n')
+            switch (find_builtin_macro(macro_name_view))
             {
-                constexpr ix_StringView NO_NEWLINE("__NO_NEWLINE__");
-                const bool no_newline = (macro_name_view == NO_NEWLINE);
-                if (ix_UNLIKELY(no_newline))
+            case BUILTIN_MACRO_NONE:
+                break;
+
+            case BUILTIN_MACRO_LUA: {
+                if (!m_lua_enabled)
                 {
-                    m_line_buffer.pop_back(call.offset + ix_strlen("[[[__NO_NEWLINE__]]]\n"));
-                    const size_t old_size = m_line_buffer.size();
-                    // This load does not clear the local macro.
-                    load_next_line(false);
-                    const bool nothing_loaded = (old_size == m_line_buffer.size());
-                    if (nothing_loaded)
-                    {
-                        m_line_buffer.push_char('\n');
-                    }
-                    if (expand_lazy_calls)
-                    {
-                        // IDEA: Avoid recursion.
-                        expand_non_lazy_macros();
-                    }
-                    macro_free_suffix_length = ix_strlen("\n");
-                    continue;
+                    break;
                 }
+
+                const char *fragment_start = call.start + ix_strlen("[[[__LUA__(");
+                const size_t fragment_length = call.length() - ix_strlen("[[[__LUA__()]]]");
+                m_temp_buffer.clear();
+                m_temp_buffer.reserve(LUA_RETURN.length() + fragment_length + 1); // 1 = len("\0")
+                m_temp_buffer.push(LUA_RETURN.data(), LUA_RETURN.length());
+                m_temp_buffer.push(fragment_start, fragment_length);
+                m_temp_buffer.push_char('\0');
+
+                const char *output;
+                size_t output_length;
+                eval_lua_fragment(m_temp_buffer.data(), m_temp_buffer.size(), &output, &output_length);
+                replace_call_with_lua_output(call, output, output_length, &macro_free_suffix_length);
+                profile.set_lua_fragment(m_current_input_line_number);
+                profile.set_output_length(output_length);
+                continue;
             }
 
-            {
-                constexpr ix_StringView INPUT_LINE_NUMBER("__INPUT_LINE_NUMBER__");
-                const bool input_line_number = (macro_name_view == INPUT_LINE_NUMBER);
-                if (ix_UNLIKELY(input_line_number))
+            case BUILTIN_MACRO_NO_NEWLINE: {
+                if (*call.end != '\n')
                 {
-                    char buf[32];
-                    const int length =
-                        ix_snprintf(buf, ix_LENGTH_OF(buf), "%" PRIu64 "", m_current_input_line_number);
-                    replace_call(call, buf, static_cast<size_t>(length));
-                    continue;
+                    break;
                 }
-            }
 
-            {
-                constexpr ix_StringView OUTPUT_LINE_NUMBER("__OUTPUT_LINE_NUMBER__");
-                const bool output_line_number = (macro_name_view == OUTPUT_LINE_NUMBER);
-                if (ix_UNLIKELY(output_line_number))
+                ix_ASSERT(m_line_tail_length == 0);
+                m_line_buffer.pop_back(call.offset + ix_strlen("[[[__NO_NEWLINE__]]]\n"));
+                profile.set_kind(MACRO_PROFILE_KIND_BUILTIN);
+                profile.end();
+                const size_t old_size = m_line_buffer.size();
+                // This load does not clear the local macro.
+                load_next_line(false);
+                if (ix_UNLIKELY(m_input_starved))
                 {
-                    char buf[32];
-                    const int length =
-                        ix_snprintf(buf, ix_LENGTH_OF(buf), "%" PRIu64 "", m_current_output_line_number);
-                    replace_call(call, buf, static_cast<size_t>(length));
-                    continue;
+                    m_redo_macro_expansion = false;
+                    return;
                 }
-            }
-
-            {
-                constexpr ix_StringView ENABLE_LUA("__ENABLE_LUA__");
-                const bool enable_lua = (macro_name_view == ENABLE_LUA);
-                if (ix_UNLIKELY(enable_lua))
+                const bool nothing_loaded = (old_size == m_line_buffer.size());
+                if (nothing_loaded)
                 {
-                    m_lua_enabled = true;
-                    clear_call(call);
-                    continue;
+                    m_line_buffer.push_char('\n');
                 }
-            }
-
-            {
-                constexpr ix_StringView DISABLE_LUA("__DISABLE_LUA__");
-                const bool disable_lua = (macro_name_view == DISABLE_LUA);
-                if (ix_UNLIKELY(disable_lua))
+                if (expand_lazy_calls)
                 {
-                    m_lua_enabled = false;
-                    clear_call(call);
-                    continue;
+                    // IDEA: Avoid recursion.
+                    expand_non_lazy_macros();
+                    if (ix_UNLIKELY(m_input_starved))
+                    {
+                        return;
+                    }
                 }
+                restart_call_search(&macro_free_suffix_length);
+                continue;
+            }
+
+            case BUILTIN_MACRO_INPUT_LINE_NUMBER: {
+                char buf[32];
+                const int length = ix_snprintf(buf, ix_LENGTH_OF(buf), "%" PRIu64 "", m_current_input_line_number);
+                replace_call(call, buf, static_cast<size_t>(length));
+                profile.set_kind(MACRO_PROFILE_KIND_BUILTIN);
+                profile.set_output_length(static_cast<size_t>(length));
+                continue;
+            }
+
+            case BUILTIN_MACRO_OUTPUT_LINE_NUMBER: {
+                char buf[32];
+                const int length = ix_snprintf(buf, ix_LENGTH_OF(buf), "%" PRIu64 "", m_current_output_line_number);
+                replace_call(call, buf, static_cast<size_t>(length));
+                profile.set_kind(MACRO_PROFILE_KIND_BUILTIN);
+                profile.set_output_length(static_cast<size_t>(length));
+                continue;
+            }
+
+            case BUILTIN_MACRO_ENABLE_LUA:
+                m_lua_enabled = true;
+                clear_call(call);
+                profile.set_kind(MACRO_PROFILE_KIND_BUILTIN);
+                continue;
+
+            case BUILTIN_MACRO_DISABLE_LUA:
+                m_lua_enabled = false;
+                clear_call(call);
+                profile.set_kind(MACRO_PROFILE_KIND_BUILTIN);
+                continue;
             }
 
         MACRO_LOOKUP:
-            const Macro *macro = m_local_macros.find(macro_name_view);
+            if (m_probing_macro_expansion)
+            {
+                add_macro_cache_dependency(macro_name_view);
+            }
+
+            Macro *macro = m_local_macros_hidden ? nullptr : m_local_macros.find(macro_name_view);
+            const ix_Vector<MacroSegment> *segments = &m_local_macro_segments;
             bool macro_found = (macro != nullptr);
             if (ix_LIKELY(!macro_found))
             {
                 macro = m_global_macros.find(macro_name_view);
+                segments = &m_global_macro_segments;
                 macro_found = (macro != nullptr);
+                if (ix_UNLIKELY(!macro_found && (m_library != nullptr)))
+                {
+                    macro = import_library_macro(macro_name_view);
+                    macro_found = (macro != nullptr);
+                }
             }
 
             if (ix_UNLIKELY(!macro_found))
             {
                 clear_call(call);
+                profile.cancel();
+                continue;
+            }
+
+            if (ix_UNLIKELY(macro->lua_function))
+            {
+                profile.set_kind(MACRO_PROFILE_KIND_LUA_MACRO);
+                if (m_probing_macro_expansion)
+                {
+                    m_macro_expansion_probe_failed = true;
+                    break;
+                }
+                if (!m_lua_enabled)
+                {
+                    clear_call(call);
+                    continue;
+                }
+
+                const char *lua_args[MAX_NUM_ARGS + 1] = {};
+                if (!constant_macro)
+                {
+                    const char *args_start = macro_name_end + ix_strlen("(");
+                    const char *args_end = call.end - ix_strlen(")]]]");
+                    parse_args(lua_args, args_start, args_end);
+                }
+
+                const char *output;
+                size_t output_length;
+                call_lua_macro(macro_name_view, constant_macro ? nullptr : lua_args, &output, &output_length);
+                replace_call_with_lua_output(call, output, output_length, &macro_free_suffix_length);
+                profile.set_output_length(output_length);
                 continue;
             }
 
@@ -1023,13 +3048,30 @@ class GokuraiContextImpl
             {
                 if (macro->is_oneline())
                 {
+                    const bool global_macro = (segments == &m_global_macro_segments);
+                    const bool use_cache = m_macro_cache_enabled && global_macro && call.is_lazy();
+                    if (use_cache && find_or_make_macro_cache(macro_name_view, &macro))
+                    {
+                        replace_call(call, macro->cached_expansion, macro->cached_expansion_length);
+                        profile.set_output_length(macro->cached_expansion_length);
+                        continue;
+                    }
+
                     replace_call(call, macro->body, macro->body_length);
+                    profile.set_output_length(macro->body_length);
                     continue;
                 }
 
+                if (m_probing_macro_expansion)
+                {
+                    m_macro_expansion_probe_failed = true;
+                    break;
+                }
+
                 // constant multiline macro
-                replace_call_multiline(call, macro->body, macro->body_length, macro->first_line_length);
-                macro_free_suffix_length = ix_strlen("\n");
+                replace_call_multiline(call, macro->body, macro->body_length, macro->first_line_length, true);
+                restart_call_search(&macro_free_suffix_length);
+                profile.set_output_length(macro->body_length);
                 continue;
             }
 
@@ -1039,30 +3081,173 @@ class GokuraiContextImpl
             const char *args_end = call.end - ix_strlen(")]]]");
             parse_args(args, args_start, args_end);
 
+            const MacroSegment *first_segment = segments->data() + macro->first_segment;
             m_temp_buffer.clear();
-            expand_call_with_args(args, macro->body, macro->body_length, m_temp_buffer);
-
             if (macro->is_oneline())
             {
+                expand_call_with_args(args, macro->body, first_segment, macro->num_segments, m_temp_buffer);
                 replace_call(call, m_temp_buffer.data(), m_temp_buffer.size());
+                profile.set_output_length(m_temp_buffer.size());
                 continue;
             }
 
             // The most complicated case (multiline macro with arguments).
-            const char *expanded_macro = m_temp_buffer.data();
-            const char *first_line_end = ix_memnext(expanded_macro, '\n');
-            const size_t first_line_length = static_cast<size_t>(first_line_end - expanded_macro) + 1;
-            replace_call_multiline(call, m_temp_buffer.data(), m_temp_buffer.size(), first_line_length);
-            macro_free_suffix_length = ix_strlen("\n");
+            if (m_probing_macro_expansion)
+            {
+                m_macro_expansion_probe_failed = true;
+                break;
+            }
+
+            // Arguments do not contain newlines, so the first line ends where the first line of the body does.
+            const size_t num_first_line_segments = macro->num_first_line_segments;
+            expand_call_with_args(args, macro->body, first_segment, num_first_line_segments, m_temp_buffer);
+            const size_t first_line_length = m_temp_buffer.size();
+            expand_call_with_args(args, macro->body, first_segment + num_first_line_segments,
+                                  macro->num_segments - num_first_line_segments, m_temp_buffer);
+            replace_call_multiline(call, m_temp_buffer.data(), m_temp_buffer.size(), first_line_length, false);
+            restart_call_search(&macro_free_suffix_length);
+            profile.set_output_length(m_temp_buffer.size());
+        }
+
+        flatten_line();
+    }
+
+    // The lazy expansion of a constant macro is cached if it does not depend on anything but the macros it calls,
+    // that is, if its body expands to plain text on a line of its own using only one-line user macros. Such an
+    // expansion is made once by expanding the body on a separate line (a probe), which is aborted before anything with
+    // a side effect (a builtin or a multiline macro) runs. Plain text cannot interact with the text around the call,
+    // so replacing the call with the cached expansion gives the same line as expanding its body in place.
+    // Only lazy calls are cached. Calls in a definition are expanded when it is read, so the calls left in a one-line
+    // body are lazy ones, and a normal call must leave them for the lazy pass, where an enclosing call may see them.
+    // Returns true if `(*macro_pointer)->cached_expansion` is valid. `*macro_pointer` is updated if the macro moves.
+    bool find_or_make_macro_cache(const ix_StringView &name, Macro **macro_pointer)
+    {
+        Macro *macro = *macro_pointer;
+        const bool cache_is_valid = (macro->cache_generation == m_macro_cache_generation);
+        if (ix_LIKELY(cache_is_valid))
+        {
+            if (macro->cacheable)
+            {
+                m_macro_cache_hits += 1;
+                return true;
+            }
+            m_macro_cache_misses += 1;
+            return false;
+        }
+
+        m_macro_cache_misses += 1;
+        if (m_probing_macro_expansion)
+        {
+            // A nested call is expanded in place, like any other macro in the probe.
+            return false;
+        }
+
+        add_macro_cache_dependency(name);
+        const bool cacheable = probe_macro_expansion(macro->body, macro->body_length);
+        // The probe never invalidates the cache, but it may import library macros, which can move `macro`.
+        macro = m_global_macros.find(name);
+        ix_ASSERT(macro != nullptr);
+        *macro_pointer = macro;
+        macro->cache_generation = m_macro_cache_generation;
+        macro->cacheable = cacheable;
+        if (cacheable)
+        {
+            const size_t expansion_length = m_probe_line_buffer.size() - ix_strlen("\n");
+            macro->cached_expansion = m_macro_cache_arena.push(m_probe_line_buffer.data(), expansion_length);
+            macro->cached_expansion_length = expansion_length;
+        }
+        return cacheable;
+    }
+
+    // Expands `body` on a line of its own into `m_probe_line_buffer`.
+    // Returns false if the expansion is not cacheable.
+    bool probe_macro_expansion(const char *body, size_t body_length)
+    {
+        const size_t saved_line_tail_length = m_line_tail_length;
+        const bool saved_current_line_has_lazy_call = m_current_line_has_lazy_call;
+        const bool saved_redo_macro_expansion = m_redo_macro_expansion;
+        ix_swap(m_line_buffer, m_probe_line_buffer);
+        ix_swap(m_call_search_checkpoints, m_probe_call_search_checkpoints);
+        m_line_tail_length = 0;
+        m_probing_macro_expansion = true;
+        m_macro_expansion_probe_failed = false;
+
+        m_line_buffer.clear();
+        m_line_buffer.push(body, body_length);
+        m_line_buffer.push_char('\n');
+        expand_lazy_macros();
+
+        bool cacheable = !m_macro_expansion_probe_failed;
+        if (cacheable)
+        {
+            const size_t expansion_length = m_line_buffer.size() - ix_strlen("\n");
+            const char *p = m_line_buffer.data();
+            const char *end = p + expansion_length;
+            for (; p < end; p++)
+            {
+                const char c = *p;
+                if ((c == '[') || (c == ']') || (c == '\'') || (c == '^'))
+                {
+                    cacheable = false;
+                    break;
+                }
+            }
+        }
+
+        m_probing_macro_expansion = false;
+        ix_swap(m_line_buffer, m_probe_line_buffer);
+        ix_swap(m_call_search_checkpoints, m_probe_call_search_checkpoints);
+        m_line_tail_length = saved_line_tail_length;
+        m_current_line_has_lazy_call = saved_current_line_has_lazy_call;
+        m_redo_macro_expansion = saved_redo_macro_expansion;
+        return cacheable;
+    }
+
+    void add_macro_cache_dependency(const ix_StringView &name)
+    {
+        if (!m_macro_cache_dependencies.contains(name))
+        {
+            const char *name_copy = m_macro_cache_arena.push(name.data(), name.length());
+            m_macro_cache_dependencies.insert(ix_StringView(name_copy, name.length()));
         }
     }
 
-    MacroCall find_last_call(size_t *macro_free_suffix_length, bool find_lazy_call)
+    // Called when a macro is defined, redefined or removed.
+    ix_FORCE_INLINE void on_macro_definition_change(const ix_StringView &name)
+    {
+        if (ix_UNLIKELY(m_macro_cache_dependencies.contains(name)))
+        {
+            invalidate_macro_cache();
+        }
+    }
+
+    void invalidate_macro_cache()
+    {
+        m_macro_cache_generation += 1;
+        m_macro_cache_arena.clear();
+        m_macro_cache_dependencies.clear();
+    }
+
+    // Called when the line is changed other than by replacing the last call found.
+    ix_FORCE_INLINE void restart_call_search(size_t *macro_free_suffix_length)
+    {
+        *macro_free_suffix_length = ix_strlen("\n");
+        m_call_search_checkpoints.clear();
+    }
+
+    // The search below is a deterministic backward scan, and replacing a call never touches the text after it.
+    // So, instead of starting over from the macro-free suffix after every replacement, we resume from the last
+    // checkpoint at or after the end of the replaced call. A checkpoint is the last state of the search before
+    // it consumed a "]]]" that became a call end, taken at a non-bracket character so that no bracket run is
+    // split by resuming there. This keeps the expansion of a line linear in the length of the text produced,
+    // even when many calls are nested in the arguments of another call.
+    ix_FORCE_INLINE MacroCall find_last_call(size_t *macro_free_suffix_length, bool find_lazy_call)
     {
         // We need to calculate 'line_start' and 'line_end' here, because the main loop modifies `m_line_buffer`.
+        // `line_end` is where the line would end if it were contiguous, see `move_line_gap_to()`.
         char *line_start = m_line_buffer.data();
-        char *line_end = m_line_buffer.data() + m_line_buffer.size(); // cppcheck-suppress constVariablePointer
-        ix_ASSERT(line_end[-1] == '\n');
+        char *line_end = m_line_buffer.data() + m_line_buffer.size() + m_line_tail_length;
+        ix_ASSERT(line_last_char() == '\n');
 
         char *search_start = line_start;
         char *search_end = line_end - *macro_free_suffix_length;
@@ -1080,8 +3265,36 @@ class GokuraiContextImpl
         const char *call_end_search_end = search_start + ix_strlen("[[[]]]") - 1;
         const char *call_start_search_end = search_start + ix_strlen("[[[") - 1;
 
+        // A lazy call whose end is unmatched sends the search back to the first phase, which may then move the
+        // macro-free suffix past checkpoints taken earlier. The search never goes back there, and neither do we.
+        while (!m_call_search_checkpoints.empty() &&
+               (m_call_search_checkpoints.back().scan_offset < *macro_free_suffix_length))
+        {
+            m_call_search_checkpoints.pop_back();
+        }
+
+        CallSearchCheckpoint checkpoint = {static_cast<size_t>(line_end - p), 0};
+        if (!m_call_search_checkpoints.empty())
+        {
+            checkpoint = m_call_search_checkpoints.back();
+            m_call_search_checkpoints.pop_back();
+            p = line_end - checkpoint.scan_offset;
+        }
+
+        // The search only reads the characters before `p` and the ones it has already seen.
+        make_line_contiguous_until(static_cast<size_t>(line_end - p));
+        if (checkpoint.call_end_offset != 0)
+        {
+            call.end = line_end - checkpoint.call_end_offset;
+            goto SECOND_PHASE_ENTRY;
+        }
+
     SEARCH_ENTRY:
         // First phase: Search for an unquoted "]]]".
+        if (SHORT_SCAN_LENGTH < (p - call_end_search_end))
+        {
+            p = find_previous_char(search_start, p, ']');
+        }
         while (call_end_search_end <= p)
         {
             if (ix_LIKELY(*p != ']'))
@@ -1090,6 +3303,8 @@ class GokuraiContextImpl
                 continue;
             }
 
+            // The character after this run of ']' has been seen, and it is not a ']'.
+            checkpoint = {static_cast<size_t>(line_end - (p + 1)), 0};
             p -= 1;
             size_t num_closing_square_bracket = 1;
             while ((search_start <= p) && (*p == ']'))
@@ -1116,6 +3331,7 @@ class GokuraiContextImpl
             }
 
             *macro_free_suffix_length = static_cast<size_t>(line_end - p) - num_closing_square_bracket - 1;
+            m_call_search_checkpoints.push_back(checkpoint);
             call.end = p + ix_strlen("]]]") + 1;
             break;
         }
@@ -1128,15 +3344,27 @@ class GokuraiContextImpl
         // Second phase: Search for an unquoted "[[[".
         // However, if we find "]]]" during this search, that "]]]" replaces the one we found in the first phase.
         // This complication makes the search slower, which is why this function is split into two phases.
+    SECOND_PHASE_ENTRY:
+        if (SHORT_SCAN_LENGTH < (p - call_start_search_end))
+        {
+            p = find_previous_char2(search_start, p, '[', ']');
+        }
         while (call_start_search_end <= p)
         {
             const char c = *p;
-            if ((c != '[') && (c != ']'))
+            if (ix_LIKELY((c != '[') && (c != ']')))
             {
                 p -= 1;
                 continue;
             }
 
+            // If this bracket run follows other characters, the search can resume at the last of them.
+            const char next = p[1];
+            if ((next != '[') && (next != ']'))
+            {
+                checkpoint = {static_cast<size_t>(line_end - (p + 1)), static_cast<size_t>(line_end - call.end)};
+            }
+
             if (c == '[')
             {
                 p -= 1;
@@ -1169,7 +3397,7 @@ class GokuraiContextImpl
                     m_current_line_has_lazy_call = true;
 
                     call.start = nullptr;
-                    call.end = find_first_unmatched_call_end(call.end, line_end);
+                    call.end = find_first_unmatched_call_end_in_line(call.end, line_end);
                     if (call.end == nullptr)
                     {
                         goto SEARCH_ENTRY;
@@ -1201,6 +3429,17 @@ class GokuraiContextImpl
                 // Macro call found.
                 call.head_length = static_cast<size_t>(call.start - line_start);
                 call.tail_length = static_cast<size_t>(line_end - call.end);
+
+                // The caller reads the call and the character right after it.
+                make_line_contiguous_until(call.tail_length);
+
+                // Checkpoints inside this call are invalidated by its replacement.
+                while (!m_call_search_checkpoints.empty() &&
+                       (m_call_search_checkpoints.back().scan_offset > call.tail_length))
+                {
+                    m_call_search_checkpoints.pop_back();
+                }
+
                 return call;
             }
 
@@ -1225,68 +3464,228 @@ class GokuraiContextImpl
                 }
                 p += ix_strlen("]]]");
             }
+            m_call_search_checkpoints.push_back(checkpoint);
             call.end = p + ix_strlen("]]]") + 1;
         }
 
         return call;
     }
 
+    // Same as `find_first_unmatched_call_end(start, line_end)`, but the text after `start` may be in the tail.
+    // Instead of flattening the line, the gap is moved to `start`, as replacing the calls before it would do anyway.
+    const char *find_first_unmatched_call_end_in_line(const char *start, const char *line_end)
+    {
+        if (ix_LIKELY(m_line_tail_length == 0))
+        {
+            return find_first_unmatched_call_end(start, line_end);
+        }
+
+        const size_t start_offset = static_cast<size_t>(line_end - start);
+        if (m_line_tail_length < start_offset)
+        {
+            move_line_gap_to(start_offset);
+        }
+        const char *tail_end = m_line_buffer.data() + m_line_buffer.capacity();
+        const char *found = find_first_unmatched_call_end(tail_end - start_offset, tail_end);
+        return (found == nullptr) ? nullptr : line_end - static_cast<size_t>(tail_end - found);
+    }
+
+    // While the macros of a long line are expanded, `m_line_buffer` is used as a gap buffer: its contents are the
+    // head of the line, and the last `m_line_tail_length` bytes of its capacity are the tail. Since calls are expanded
+    // from right to left, replacing a call only moves the text between the call and the gap, instead of the whole
+    // rest of the line. Offsets from the line end are not affected by moving the gap.
+    // Keeping a gap costs an extra move of the tail when the line is flattened, so a gap is opened only for a call
+    // with a long tail. Until then, calls are replaced in place.
+    void move_line_gap_to(size_t tail_length)
+    {
+        char *data = m_line_buffer.data();
+        char *capacity_end = data + m_line_buffer.capacity();
+        const size_t head_length = m_line_buffer.size();
+        if (tail_length < m_line_tail_length)
+        {
+            const size_t length = m_line_tail_length - tail_length;
+            ix_memmove(data + head_length, capacity_end - m_line_tail_length, length);
+            m_line_buffer.add_size(length);
+        }
+        else if (m_line_tail_length < tail_length)
+        {
+            const size_t length = tail_length - m_line_tail_length;
+            ix_ASSERT(length <= head_length);
+            ix_memmove(capacity_end - tail_length, data + head_length - length, length);
+            m_line_buffer.pop_back(length);
+        }
+        m_line_tail_length = tail_length;
+    }
+
+    ix_FORCE_INLINE void make_line_contiguous_until(size_t tail_length)
+    {
+        if (tail_length <= m_line_tail_length)
+        {
+            move_line_gap_to(tail_length - 1);
+        }
+    }
+
+    ix_FORCE_INLINE void flatten_line()
+    {
+        if (ix_UNLIKELY(m_line_tail_length != 0))
+        {
+            move_line_gap_to(0);
+        }
+    }
+
+    ix_FORCE_INLINE char line_last_char() const
+    {
+        const size_t capacity = m_line_buffer.capacity();
+        return (m_line_tail_length == 0) ? m_line_buffer.data()[m_line_buffer.size() - 1]
+                                         : m_line_buffer.data()[capacity - 1];
+    }
+
+    void ensure_line_gap(size_t gap_length)
+    {
+        const size_t old_capacity = m_line_buffer.capacity();
+        const size_t used_length = m_line_buffer.size() + m_line_tail_length;
+        if (gap_length <= old_capacity - used_length)
+        {
+            return;
+        }
+
+        m_line_buffer.reserve_aggressively(used_length + gap_length); // May reallocate.
+        char *data = m_line_buffer.data();
+        const size_t new_capacity = m_line_buffer.capacity();
+        ix_memmove(data + new_capacity - m_line_tail_length, data + old_capacity - m_line_tail_length,
+                   m_line_tail_length);
+    }
+
+    ix_FORCE_INLINE bool uses_line_gap(const MacroCall &call) const
+    {
+        return (m_line_tail_length != 0) || (LINE_GAP_MIN_TAIL_LENGTH <= call.tail_length);
+    }
+
     void clear_call(const MacroCall &call)
     {
-        const size_t offset = call.offset;
-        ix_memmove(call.start - offset, call.end, call.tail_length);
-        m_line_buffer.pop_back(call.length() + offset);
+        const size_t removed_length = call.length() + call.offset;
+        if (ix_LIKELY(!uses_line_gap(call)))
+        {
+            char *dst = m_line_buffer.data() + call.head_length - call.offset;
+            ix_memmove(dst, dst + removed_length, call.tail_length);
+        }
+        else
+        {
+            move_line_gap_to(call.tail_length);
+        }
+        m_line_buffer.pop_back(removed_length);
+    }
+
+    ix_FORCE_INLINE void replace_call(const MacroCall &call, const char *str, size_t str_length)
+    {
+        if (ix_UNLIKELY(uses_line_gap(call)))
+        {
+            replace_call_at_line_gap(call, str, str_length);
+            return;
+        }
+
+        const size_t removed_length = call.length() + call.offset;
+        if (str_length <= removed_length)
+        {
+            char *dst = m_line_buffer.data() + call.head_length - call.offset;
+            ix_memcpy(dst, str, str_length);
+            ix_memmove(dst + str_length, dst + removed_length, call.tail_length);
+            m_line_buffer.pop_back(removed_length - str_length);
+        }
+        else
+        {
+            const size_t added_length = str_length - removed_length;
+            m_line_buffer.ensure(added_length); // May reallocate.
+            char *dst = m_line_buffer.data() + call.head_length - call.offset;
+            ix_memmove(dst + str_length, dst + removed_length, call.tail_length);
+            ix_memcpy(dst, str, str_length);
+            m_line_buffer.add_size(added_length);
+        }
+    }
+
+    void replace_call_at_line_gap(const MacroCall &call, const char *str, size_t str_length)
+    {
+        move_line_gap_to(call.tail_length);
+        m_line_buffer.pop_back(call.length() + call.offset);
+        ensure_line_gap(str_length);
+        ix_memcpy(m_line_buffer.data() + m_line_buffer.size(), str, str_length);
+        m_line_buffer.add_size(str_length);
     }
 
-    void replace_call(const MacroCall &call, const char *str, size_t str_length)
+    // The output of Lua code may span lines. The Lua stack is emptied afterwards.
+    void replace_call_with_lua_output(const MacroCall &call, const char *output, size_t output_length,
+                                      size_t *macro_free_suffix_length)
     {
-        const size_t offset = call.offset;
-        const size_t call_length = call.length();
-        if (str_length < call_length)
+        if (output_length == 0)
         {
-            ix_memcpy(call.start - offset, str, str_length);
-            ix_memmove(call.start - offset + str_length, call.end, call.tail_length);
-            m_line_buffer.pop_back(call_length + offset - str_length);
+            clear_call(call);
         }
         else
         {
-            const size_t required_additional_space = str_length - offset - call_length;
-            m_line_buffer.ensure(required_additional_space); // May reallocate.
-            char *line_start = m_line_buffer.data();
-            char *call_start = line_start + call.head_length;
-            ix_memmove(call_start - offset + str_length, call_start + call_length, call.tail_length);
-            ix_memcpy(call_start - offset, str, str_length);
-            m_line_buffer.add_size(required_additional_space);
+            const char *first_line_end_minus_one = ix_strchr(output, '\n');
+            const bool multiline_output = (first_line_end_minus_one != nullptr);
+            if (!multiline_output)
+            {
+                replace_call(call, output, output_length);
+            }
+            else
+            {
+                const char *first_line_end = first_line_end_minus_one + 1;
+                const size_t first_line_length = static_cast<size_t>(first_line_end - output);
+                replace_call_multiline(call, output, output_length, first_line_length, false);
+                restart_call_search(macro_free_suffix_length);
+            }
         }
+
+        lua_settop(m_lua_state, 0);
     }
 
-    void replace_call_multiline(const MacroCall &call, const char *str, size_t str_length, size_t first_line_length)
+    // If `str_is_in_arena` is true, the lines after the first one are read directly from `str` later.
+    void replace_call_multiline(const MacroCall &call, const char *str, size_t str_length, size_t first_line_length,
+                                bool str_is_in_arena)
     {
         ix_ASSERT(str[first_line_length - 1] == '\n');
         replace_call(call, str, first_line_length);
+        flatten_line();
         const size_t new_line_length = call.head_length - call.offset + first_line_length;
         ix_ASSERT(*(m_line_buffer.data() + new_line_length - 1) == '\n');
-        m_line_buffer.push(m_secondary_input_buffer.data() + m_secondary_input_offset,
-                           m_secondary_input_buffer.size() - m_secondary_input_offset);
-        m_secondary_input_buffer.clear();
-        m_secondary_input_buffer.push(str + first_line_length, str_length - first_line_length);
-        m_secondary_input_buffer.push(m_line_buffer.data() + new_line_length, m_line_buffer.size() - new_line_length);
+
+        // The rest of the line is read after the rest of `str`. Usually it is only the newline, which is not copied.
+        const size_t rest_length = m_line_buffer.size() - new_line_length;
+        if (rest_length == ix_strlen("\n"))
+        {
+            push_pending_input("\n", rest_length);
+        }
+        else
+        {
+            push_pending_input_copy(m_line_buffer.data() + new_line_length, rest_length);
+        }
         m_line_buffer.set_size(new_line_length);
-        m_secondary_input_offset = 0;
+        if (str_is_in_arena)
+        {
+            push_pending_input(str + first_line_length, str_length - first_line_length);
+        }
+        else
+        {
+            push_pending_input_copy(str + first_line_length, str_length - first_line_length);
+        }
     }
 
     ix_FORCE_INLINE void read_global_macro_definition()
     {
-        read_macro_definition(GLOBAL_MACRO_HEADER.length(), m_global_string_arena, m_global_macros);
+        read_macro_definition(GLOBAL_MACRO_HEADER.length(), m_global_string_arena, m_global_macros,
+                              m_global_macro_segments);
     }
 
     ix_FORCE_INLINE void read_local_macro_definition()
     {
-        read_macro_definition(LOCAL_MACRO_HEADER.length(), m_local_string_arena, m_local_macros);
+        read_macro_definition(LOCAL_MACRO_HEADER.length(), m_local_string_arena, m_local_macros,
+                              m_local_macro_segments);
     }
 
     void read_macro_definition(size_t header_length, ix_StringArena &arena,
-                               ix_HashMapSingleArray<ix_StringView, Macro> &macros)
+                               ix_HashMapSingleArray<ix_StringView, Macro> &macros,
+                               ix_Vector<MacroSegment> &segments)
     {
         const char *line_start = m_line_buffer.data();
         const char *line_end = m_line_buffer.data() + m_line_buffer.size();
@@ -1305,24 +3704,32 @@ class GokuraiContextImpl
         const char *body_end = line_end - 1;
         const size_t body_length = static_cast<size_t>(body_end - body_start);
         const char *body = arena.push(body_start, body_length);
-        macros.emplace(ix_StringView(name, name_length), Macro{body_length, 0, body});
+        drop_hidden_local_macros();
+        const size_t first_segment = segments.size();
+        compile_macro_body(body, body, body + body_length, segments);
+        const size_t num_segments = segments.size() - first_segment;
+        const Macro macro = {body_length, 0, body, first_segment, num_segments, num_segments};
+        macros.emplace(ix_StringView(name, name_length), macro);
+        on_macro_definition_change(ix_StringView(name, name_length));
     }
 
     ix_FORCE_INLINE void read_global_block_macro_definition()
     {
         read_block_macro_definition(GLOBAL_BLOCK_MACRO_HEADER, GLOBAL_BLOCK_MACRO_FOOTER, //
-                                    m_global_string_arena, m_global_macros);
+                                    m_global_string_arena, m_global_macros, m_global_macro_segments);
     }
 
     ix_FORCE_INLINE void read_local_block_macro_definition()
     {
         read_block_macro_definition(LOCAL_BLOCK_MACRO_HEADER, LOCAL_BLOCK_MACRO_FOOTER, //
-                                    m_local_string_arena, m_local_macros);
+                                    m_local_string_arena, m_local_macros, m_local_macro_segments);
     }
 
     void read_block_macro_definition(const ix_StringView &header, const ix_StringView &footer, //
-                                     ix_StringArena &arena, ix_HashMapSingleArray<ix_StringView, Macro> &macros)
+                                     ix_StringArena &arena, ix_HashMapSingleArray<ix_StringView, Macro> &macros,
+                                     ix_Vector<MacroSegment> &segments)
     {
+        const TraceSpan span = trace_span("read block macro");
         const char *name_start = m_line_buffer.data() + header.length();
         const char *name_end = ix_memnext(name_start, '\n');
         const size_t name_length = static_cast<size_t>(name_end - name_start);
@@ -1362,189 +3769,707 @@ class GokuraiContextImpl
                 const bool comment_block_start = (line_view == COMMENT_BLOCK_HEADER);
                 if (comment_block_start)
                 {
-                    skip_comment_block(false);
-                    continue;
+                    skip_comment_block(false);
+                    continue;
+                }
+            }
+
+            const bool second_line = (first_line_length == 0) && !m_block_buffer.empty();
+            if (second_line)
+            {
+                first_line_length = m_block_buffer.size();
+            }
+
+            if (ix_starts_with(m_line_buffer.data(), header.data()))
+            {
+                depth += 1;
+            }
+
+            m_block_buffer.push(m_line_buffer.data(), m_line_buffer.size());
+        }
+
+        if (!m_block_buffer.empty())
+        {
+            // Remove the last newline.
+            m_block_buffer.pop_back(1);
+        }
+
+        const size_t body_length = m_block_buffer.size();
+        const char *body = arena.push(m_block_buffer.data(), body_length);
+        const char *first_line_end = body + ((first_line_length == 0) ? body_length : first_line_length);
+        drop_hidden_local_macros();
+        const size_t first_segment = segments.size();
+        compile_macro_body(body, body, first_line_end, segments);
+        const size_t num_first_line_segments = segments.size() - first_segment;
+        compile_macro_body(body, first_line_end, body + body_length, segments);
+        const size_t num_segments = segments.size() - first_segment;
+        const Macro macro = {body_length, first_line_length, body, first_segment,
+                             num_segments, num_first_line_segments};
+        macros.emplace(ix_StringView{name, name_length}, macro);
+        on_macro_definition_change(ix_StringView(name, name_length));
+    }
+
+    void read_and_eval_lua_block()
+    {
+        m_block_buffer.clear();
+        m_block_buffer.push(LUA_RETURN.data(), LUA_RETURN.length());
+
+        while (true)
+        {
+            m_line_buffer.clear();
+            load_next_line(true);
+
+            if (m_line_buffer.empty())
+            {
+                return;
+            }
+
+            do
+            {
+                m_redo_macro_expansion = false;
+                expand_non_lazy_macros();
+                if (m_current_line_has_lazy_call && !m_input_starved)
+                {
+                    expand_lazy_macros();
+                }
+            } while (m_redo_macro_expansion);
+
+            if (ix_UNLIKELY(m_input_starved))
+            {
+                return;
+            }
+
+            const char *line_start = m_line_buffer.data();
+
+            if (*line_start == '#')
+            {
+                const ix_StringView line_view(line_start, m_line_buffer.size());
+
+                const bool block_end = (line_view == LUA_BLOCK_FOOTER);
+                if (block_end)
+                {
+                    break;
+                }
+
+                const bool comment_block_start = (line_view == COMMENT_BLOCK_HEADER);
+                if (comment_block_start)
+                {
+                    skip_comment_block(true);
+                    continue;
+                }
+            }
+
+            m_block_buffer.push(m_line_buffer.data(), m_line_buffer.size());
+        }
+
+        const char *output;
+        size_t output_length;
+        m_block_buffer.push_char('\0');
+        eval_lua_fragment(m_block_buffer.data(), m_block_buffer.size(), &output, &output_length);
+
+        if (output_length != 0)
+        {
+            constexpr ix_StringView NEWLINE("\n");
+            push_pending_input(NEWLINE.data(), NEWLINE.length());
+            push_pending_input_copy(output, output_length);
+        }
+
+        lua_settop(m_lua_state, 0);
+    }
+
+    void skip_comment_block(bool expand_lazy_calls)
+    {
+        size_t depth = 1;
+        m_lua_enabled = false;
+
+        while (true)
+        {
+            m_line_buffer.clear();
+            load_next_line(true);
+
+            if (m_line_buffer.empty())
+            {
+                break;
+            }
+
+            do
+            {
+                m_redo_macro_expansion = false;
+                expand_non_lazy_macros();
+                if (expand_lazy_calls && m_current_line_has_lazy_call && !m_input_starved)
+                {
+                    expand_lazy_macros();
+                }
+            } while (m_redo_macro_expansion);
+
+            if (ix_UNLIKELY(m_input_starved))
+            {
+                break;
+            }
+
+            const char *line_start = m_line_buffer.data();
+
+            if (*line_start != '#')
+            {
+                continue;
+            }
+
+            const ix_StringView line_view(line_start, m_line_buffer.size());
+            const bool block_end = (line_view == COMMENT_BLOCK_FOOTER);
+            if (block_end)
+            {
+                depth -= 1;
+                const bool comment_end = (depth == 0);
+                if (comment_end)
+                {
+                    break;
+                }
+            }
+
+            const bool block_begin = (line_view == COMMENT_BLOCK_HEADER);
+            if (block_begin)
+            {
+                depth += 1;
+            }
+        }
+
+        m_lua_enabled = true;
+    }
+
+    // Keeps the function on top of the stack as the compiled form of `statement`.
+    void cache_lua_chunk(const ix_StringView &statement)
+    {
+        if (m_lua_chunk_refs.size() == MAX_NUM_LUA_CHUNKS)
+        {
+            for (const auto &kv : m_lua_chunk_refs)
+            {
+                luaL_unref(m_lua_state, LUA_REGISTRYINDEX, kv.value);
+            }
+            m_lua_chunk_refs.clear();
+            m_lua_chunk_arena.clear();
+        }
+
+        lua_pushvalue(m_lua_state, -1);
+        const int chunk_ref = luaL_ref(m_lua_state, LUA_REGISTRYINDEX);
+        const char *key = m_lua_chunk_arena.push(statement.data(), statement.length());
+        m_lua_chunk_refs.emplace(ix_StringView(key, statement.length()), chunk_ref);
+    }
+
+    void ensure_lua_state()
+    {
+        if (ix_LIKELY(m_lua_state != nullptr))
+        {
+            return;
+        }
+
+        m_lua_state = lua_newstate(&LuaAllocator::alloc, &m_lua_allocator);
+        lua_atpanic(m_lua_state, &lua_panic);
+        *static_cast<GokuraiContextImpl **>(lua_getextraspace(m_lua_state)) = this;
+        luaL_checkversion(m_lua_state);
+        lua_gc(m_lua_state, LUA_GCGEN, 0, 0);
+        luaL_openlibs(m_lua_state);
+
+        lua_newtable(m_lua_state);
+        lua_rawsetp(m_lua_state, LUA_REGISTRYINDEX, &LUA_MACROS_KEY);
+        const luaL_Reg gokurai_functions[] = {
+            {"macro", &GokuraiContextImpl::lua_define_lua_macro},
+            {"define", &GokuraiContextImpl::lua_define_macro},
+            {"get", &GokuraiContextImpl::lua_get_macro},
+            {"undefine", &GokuraiContextImpl::lua_undefine_macro},
+            {nullptr, nullptr},
+        };
+        lua_newtable(m_lua_state);
+        lua_pushlightuserdata(m_lua_state, this);
+        luaL_setfuncs(m_lua_state, gokurai_functions, 1);
+        lua_setglobal(m_lua_state, "gokurai");
+
+        // Only the history inherited from a snapshot has been recorded before the state is made.
+        m_replaying_lua_history = true;
+        m_lua_history_result_index = 0;
+        for (const ix_StringView &program : m_lua_history)
+        {
+            if (load_lua_fragment_with_limits(program.data(), program.length() + 1, nullptr))
+            {
+                call_lua_function_with_limits(0, nullptr);
+            }
+            lua_settop(m_lua_state, 0);
+        }
+        m_replaying_lua_history = false;
+    }
+
+    // The `gokurai` table of the Lua state works on the macros directly, without a round trip through the text.
+    // When the Lua history is run again for a fork or a library, the macros are already as the history left them,
+    // so only the functions of the Lua macros are put back, and `get` and `undefine` return what they returned when
+    // the history was recorded rather than what the macros say now.
+
+    static GokuraiContextImpl *lua_context(lua_State *L)
+    {
+        return static_cast<GokuraiContextImpl *>(lua_touserdata(L, lua_upvalueindex(1)));
+    }
+
+    static ix_StringView lua_check_macro_name(lua_State *L)
+    {
+        size_t name_length;
+        const char *name = luaL_checklstring(L, 1, &name_length);
+        luaL_argcheck(L, name_length != 0, 1, "empty macro name");
+        return ix_StringView(name, name_length);
+    }
+
+    // `gokurai.macro(name, fn)` makes `[[[name(a,b)]]]` call `fn("a", "b")` and expand to its result, like `__LUA__`.
+    // The arguments are passed as strings, without being pasted into Lua code.
+    static int lua_define_lua_macro(lua_State *L)
+    {
+        const ix_StringView name = lua_check_macro_name(L);
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+        lua_context(L)->define_lua_macro(name);
+        return 0;
+    }
+
+    // `gokurai.define(name, body [, local])` is `#+MACRO` (or `#+LOCAL_MACRO`), or the block form if `body` spans
+    // lines. Calls in `body` are not expanded until the macro is.
+    static int lua_define_macro(lua_State *L)
+    {
+        const ix_StringView name = lua_check_macro_name(L);
+        size_t body_length;
+        const char *body = luaL_checklstring(L, 2, &body_length);
+        const bool local = lua_toboolean(L, 3);
+        lua_context(L)->define_macro(name, ix_StringView(body, body_length), local);
+        return 0;
+    }
+
+    // `gokurai.get(name)` returns the body of the macro that a call would expand, the function of a Lua macro, or nil.
+    static int lua_get_macro(lua_State *L)
+    {
+        const ix_StringView name = lua_check_macro_name(L);
+        GokuraiContextImpl *ctx = lua_context(L);
+        if (ix_UNLIKELY(ctx->m_replaying_lua_history))
+        {
+            ctx->push_lua_history_result(name);
+            return 1;
+        }
+
+        const Macro *macro = ctx->find_macro(name);
+        if (macro == nullptr)
+        {
+            lua_pushnil(L);
+            ctx->record_lua_history_result(LUA_HISTORY_RESULT_KIND_NIL, ix_StringView(""));
+        }
+        else if (macro->lua_function)
+        {
+            ctx->push_lua_macro_function(name);
+            ctx->record_lua_history_result(LUA_HISTORY_RESULT_KIND_FUNCTION, ix_StringView(""));
+        }
+        else
+        {
+            lua_pushlstring(L, macro->body, macro->body_length);
+            ctx->record_lua_history_result(LUA_HISTORY_RESULT_KIND_STRING,
+                                           ix_StringView(macro->body, macro->body_length));
+        }
+        return 1;
+    }
+
+    // `gokurai.undefine(name [, local])` returns whether the macro was defined.
+    static int lua_undefine_macro(lua_State *L)
+    {
+        const ix_StringView name = lua_check_macro_name(L);
+        const bool local = lua_toboolean(L, 2);
+        GokuraiContextImpl *ctx = lua_context(L);
+        if (ix_UNLIKELY(ctx->m_replaying_lua_history))
+        {
+            ctx->push_lua_history_result(name);
+            return 1;
+        }
+
+        const bool found = ctx->undefine_macro(name, local);
+        lua_pushboolean(L, found);
+        ctx->record_lua_history_result(found ? LUA_HISTORY_RESULT_KIND_TRUE : LUA_HISTORY_RESULT_KIND_FALSE,
+                                       ix_StringView(""));
+        return 1;
+    }
+
+    void push_lua_macro_function(const ix_StringView &name)
+    {
+        lua_rawgetp(m_lua_state, LUA_REGISTRYINDEX, &LUA_MACROS_KEY);
+        lua_pushlstring(m_lua_state, name.data(), name.length());
+        lua_rawget(m_lua_state, -2);
+        lua_remove(m_lua_state, -2);
+    }
+
+    // Only the calls made by code that goes to the Lua history are recorded, since only that code is run again.
+    void record_lua_history_result(LuaHistoryResultKind kind, const ix_StringView &string)
+    {
+        if (ix_LIKELY(!m_recording_lua_program))
+        {
+            return;
+        }
+
+        const char *string_copy = m_lua_history_arena.push(string.data(), string.length());
+        m_lua_history_results.push_back(LuaHistoryResult{ix_StringView(string_copy, string.length()), kind});
+    }
+
+    // The function of a Lua macro is the one that the history has defined so far, as it was when recorded.
+    // Code that does not run as it did (e.g. code that depends on the time) may run out of results, and gets nil.
+    void push_lua_history_result(const ix_StringView &name)
+    {
+        if (m_lua_history_result_index == m_lua_history_results.size())
+        {
+            lua_pushnil(m_lua_state);
+            return;
+        }
+
+        const LuaHistoryResult &result = m_lua_history_results[m_lua_history_result_index];
+        m_lua_history_result_index += 1;
+        switch (result.kind)
+        {
+        case LUA_HISTORY_RESULT_KIND_FALSE:
+        case LUA_HISTORY_RESULT_KIND_TRUE:
+            lua_pushboolean(m_lua_state, result.kind == LUA_HISTORY_RESULT_KIND_TRUE);
+            break;
+        case LUA_HISTORY_RESULT_KIND_STRING:
+            lua_pushlstring(m_lua_state, result.string.data(), result.string.length());
+            break;
+        case LUA_HISTORY_RESULT_KIND_FUNCTION:
+            push_lua_macro_function(name);
+            break;
+        case LUA_HISTORY_RESULT_KIND_NIL:
+        case NUM_LUA_HISTORY_RESULT_KINDS:
+            lua_pushnil(m_lua_state);
+            break;
+        }
+    }
+
+    // The function is at index 2.
+    void define_lua_macro(const ix_StringView &name)
+    {
+        lua_rawgetp(m_lua_state, LUA_REGISTRYINDEX, &LUA_MACROS_KEY);
+        lua_pushlstring(m_lua_state, name.data(), name.length());
+        lua_pushvalue(m_lua_state, 2);
+        lua_rawset(m_lua_state, -3);
+        lua_pop(m_lua_state, 1);
+
+        if (m_replaying_lua_history)
+        {
+            return;
+        }
+
+        const char *name_copy = m_global_string_arena.push(name.data(), name.length());
+        Macro macro = {0, 0, "", 0, 0, 0};
+        macro.lua_function = true;
+        m_global_macros.emplace(ix_StringView(name_copy, name.length()), macro);
+        on_macro_definition_change(name);
+    }
+
+    void define_macro(const ix_StringView &name, const ix_StringView &body, bool local)
+    {
+        if (m_replaying_lua_history)
+        {
+            return;
+        }
+
+        ix_StringArena &arena = local ? m_local_string_arena : m_global_string_arena;
+        ix_HashMapSingleArray<ix_StringView, Macro> &macros = local ? m_local_macros : m_global_macros;
+        ix_Vector<MacroSegment> &segments = local ? m_local_macro_segments : m_global_macro_segments;
+        if (local)
+        {
+            m_clear_local_macro_on_next_read = false;
+        }
+
+        const char *name_copy = arena.push(name.data(), name.length());
+        const char *body_copy = arena.push(body.data(), body.length());
+        const char *body_end = body_copy + body.length();
+        const char *first_line_end_minus_one = static_cast<const char *>(ix_memchr(body_copy, '\n', body.length()));
+        const char *first_line_end = (first_line_end_minus_one == nullptr) ? body_end : first_line_end_minus_one + 1;
+        const size_t first_line_length =
+            (first_line_end_minus_one == nullptr) ? 0 : static_cast<size_t>(first_line_end - body_copy);
+        drop_hidden_local_macros();
+        const size_t first_segment = segments.size();
+        compile_macro_body(body_copy, body_copy, first_line_end, segments);
+        const size_t num_first_line_segments = segments.size() - first_segment;
+        compile_macro_body(body_copy, first_line_end, body_end, segments);
+        const size_t num_segments = segments.size() - first_segment;
+        const Macro macro = {body.length(), first_line_length, body_copy, first_segment,
+                             num_segments,  num_first_line_segments};
+        macros.emplace(ix_StringView(name_copy, name.length()), macro);
+        on_macro_definition_change(name);
+    }
+
+    bool undefine_macro(const ix_StringView &name, bool local)
+    {
+        bool found = false;
+        if (local)
+        {
+            found = !m_local_macros_hidden && m_local_macros.contains(name);
+            if (found)
+            {
+                m_local_macros.erase(name);
+            }
+        }
+        else
+        {
+            const Macro *macro = m_global_macros.find(name);
+            if ((macro == nullptr) && (m_library != nullptr))
+            {
+                macro = import_library_macro(name);
+            }
+            found = (macro != nullptr);
+            if (found && (m_library != nullptr))
+            {
+                const LibraryEntry *entry = m_library->find(name);
+                if (entry != nullptr)
+                {
+                    const char *name_in_library = m_library->data + entry->name_offset;
+                    m_undefined_library_macros.insert(ix_StringView(name_in_library, name.length()));
                 }
             }
-
-            const bool second_line = (first_line_length == 0) && !m_block_buffer.empty();
-            if (second_line)
+            if (found && macro->lua_function)
             {
-                first_line_length = m_block_buffer.size();
+                lua_rawgetp(m_lua_state, LUA_REGISTRYINDEX, &LUA_MACROS_KEY);
+                lua_pushlstring(m_lua_state, name.data(), name.length());
+                lua_pushnil(m_lua_state);
+                lua_rawset(m_lua_state, -3);
+                lua_pop(m_lua_state, 1);
             }
-
-            if (ix_starts_with(m_line_buffer.data(), header.data()))
+            if (found)
             {
-                depth += 1;
+                m_global_macros.erase(name);
             }
-
-            m_block_buffer.push(m_line_buffer.data(), m_line_buffer.size());
         }
 
-        if (!m_block_buffer.empty())
+        if (found)
         {
-            // Remove the last newline.
-            m_block_buffer.pop_back(1);
+            on_macro_definition_change(name);
         }
+        return found;
+    }
 
-        const size_t body_length = m_block_buffer.size();
-        const char *body = arena.push(m_block_buffer.data(), body_length);
-        macros.emplace(ix_StringView{name, name_length}, Macro{body_length, first_line_length, body});
+    // The macro that a call of `name` would expand.
+    const Macro *find_macro(const ix_StringView &name)
+    {
+        const Macro *macro = m_local_macros_hidden ? nullptr : m_local_macros.find(name);
+        if (macro == nullptr)
+        {
+            macro = m_global_macros.find(name);
+        }
+        if ((macro == nullptr) && (m_library != nullptr))
+        {
+            macro = import_library_macro(name);
+        }
+        return macro;
     }
 
-    void read_and_eval_lua_block()
+    // While a unit is retried, Lua code is not run again. Its outputs recorded in the first try are used in order.
+    bool take_recorded_lua_output(const char **output, size_t *output_length)
     {
-        m_block_buffer.clear();
-        m_block_buffer.push(LUA_RETURN.data(), LUA_RETURN.length());
+        const bool retried = (m_unit_lua_output_index < m_unit_lua_outputs.size());
+        if (ix_LIKELY(!retried))
+        {
+            return false;
+        }
 
-        while (true)
+        const ix_StringView &recorded_output = m_unit_lua_outputs[m_unit_lua_output_index];
+        m_unit_lua_output_index += 1;
+        *output = recorded_output.data();
+        *output_length = recorded_output.length();
+        return true;
+    }
+
+    // Takes the result at index 1.
+    void take_lua_output(const char **output, size_t *output_length)
+    {
+        *output = lua_tolstring(m_lua_state, 1, output_length);
+        if (*output == nullptr)
         {
-            m_line_buffer.clear();
-            load_next_line(true);
+            // The program's return value is not an integer nor a string.
+            *output = "";
+            *output_length = 0;
+        }
 
-            if (m_line_buffer.empty())
-            {
-                return;
-            }
+        if (!m_input_ended)
+        {
+            // Including the null terminator.
+            const char *recorded_output = m_unit_lua_output_arena.push(*output, *output_length + 1);
+            m_unit_lua_outputs.emplace_back(recorded_output, *output_length);
+            m_unit_lua_output_index += 1;
+        }
+    }
 
-            do
-            {
-                m_redo_macro_expansion = false;
-                expand_non_lazy_macros();
-                if (m_current_line_has_lazy_call)
-                {
-                    expand_lazy_macros();
-                }
-            } while (m_redo_macro_expansion);
+    // `args` is what `parse_args()` made, or `nullptr` for a call without parentheses.
+    void call_lua_macro(const ix_StringView &name, const char *args[MAX_NUM_ARGS + 1], const char **output,
+                        size_t *output_length)
+    {
+        if (ix_UNLIKELY(take_recorded_lua_output(output, output_length)))
+        {
+            return;
+        }
 
-            const char *line_start = m_line_buffer.data();
+        ensure_lua_state(); // A fork or a library has the macro before the Lua history is run again.
+        lua_State *L = m_lua_state;
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &LUA_MACROS_KEY);
+        lua_pushlstring(L, name.data(), name.length());
+        lua_rawget(L, -2);
+        lua_remove(L, -2);
 
-            if (*line_start == '#')
+        int num_args = 0;
+        if (args != nullptr)
+        {
+            const char *sentinel = args[MAX_NUM_ARGS];
+            for (size_t i = 1; i <= MAX_NUM_ARGS; i++)
             {
-                const ix_StringView line_view(line_start, m_line_buffer.size());
-
-                const bool block_end = (line_view == LUA_BLOCK_FOOTER);
-                if (block_end)
+                m_temp_buffer.clear();
+                push_macro_argument(m_temp_buffer, args[i - 1], args[i] - ix_strlen(","));
+                lua_pushlstring(L, m_temp_buffer.data(), m_temp_buffer.size());
+                num_args += 1;
+                if (args[i] == sentinel)
                 {
                     break;
                 }
-
-                const bool comment_block_start = (line_view == COMMENT_BLOCK_HEADER);
-                if (comment_block_start)
-                {
-                    skip_comment_block(true);
-                    continue;
-                }
             }
-
-            m_block_buffer.push(m_line_buffer.data(), m_line_buffer.size());
         }
 
-        const char *output;
-        size_t output_length;
-        m_block_buffer.push_char('\0');
-        eval_lua_fragment(m_block_buffer.data(), m_block_buffer.size(), &output, &output_length);
-
-        if (output_length != 0)
+        if (ix_UNLIKELY(m_lua_history_enabled))
         {
-            m_block_buffer.clear();
-            m_block_buffer.push(output, output_length);
-            m_block_buffer.push_char('\n');
-            m_block_buffer.push(m_secondary_input_buffer.data() + m_secondary_input_offset,
-                                m_secondary_input_buffer.size() - m_secondary_input_offset);
-            m_secondary_input_buffer.clear();
-            m_secondary_input_buffer.push(m_block_buffer.data(), m_block_buffer.size());
-            m_secondary_input_offset = 0;
+            record_lua_macro_call(name, num_args);
         }
-
-        lua_settop(m_lua_state, 0);
+        m_recording_lua_program = m_lua_history_enabled;
+        call_lua_function_with_limits(num_args, m_err_handle);
+        m_recording_lua_program = false;
+        take_lua_output(output, output_length);
     }
 
-    void skip_comment_block(bool expand_lazy_calls)
+    // The call goes to the history as a program which gets the function through `gokurai.get()`. The function that
+    // `get` returns is recorded, so when the history is run again, it is the one that the history has defined so far.
+    // The arguments are on top of the stack.
+    void record_lua_macro_call(const ix_StringView &name, int num_args)
     {
-        size_t depth = 1;
-        m_lua_enabled = false;
-
-        while (true)
+        m_temp_buffer.clear();
+        m_temp_buffer.push(LUA_RETURN.data(), LUA_RETURN.length());
+        m_temp_buffer.push_str("gokurai.get(");
+        push_lua_string_literal(m_temp_buffer, name.data(), name.length());
+        m_temp_buffer.push_str(")(");
+        for (int i = 0; i < num_args; i++)
         {
-            m_line_buffer.clear();
-            load_next_line(true);
-
-            if (m_line_buffer.empty())
+            size_t arg_length;
+            const char *arg = lua_tolstring(m_lua_state, i - num_args, &arg_length);
+            if (i != 0)
             {
-                break;
+                m_temp_buffer.push_char(',');
             }
+            push_lua_string_literal(m_temp_buffer, arg, arg_length);
+        }
+        m_temp_buffer.push_char(')');
 
-            do
-            {
-                m_redo_macro_expansion = false;
-                expand_non_lazy_macros();
-                if (expand_lazy_calls && m_current_line_has_lazy_call)
-                {
-                    expand_lazy_macros();
-                }
-            } while (m_redo_macro_expansion);
+        const size_t program_length = m_temp_buffer.size();
+        m_lua_history.emplace_back(m_lua_history_arena.push(m_temp_buffer.data(), program_length), program_length);
+        m_recording_lua_program = true;
+        record_lua_history_result(LUA_HISTORY_RESULT_KIND_FUNCTION, ix_StringView(""));
+    }
 
-            const char *line_start = m_line_buffer.data();
+    // Code over a limit fails as if it raised an error. Only loads and protected calls are limited, because running
+    // out of memory anywhere else would be an unprotected error.
+    ix_FORCE_INLINE bool load_lua_fragment_with_limits(const char *fragment, size_t fragment_length,
+                                                       const ix_FileHandle *err_out)
+    {
+        const TraceSpan span = trace_span("lua compile");
+        m_lua_allocator.set_heap_limit(m_lua_heap_limit);
+        const bool loaded = load_lua_fragment(m_lua_state, fragment, fragment_length, err_out);
+        m_lua_allocator.set_heap_limit(0);
+        return loaded;
+    }
 
-            if (*line_start != '#')
-            {
-                continue;
-            }
+    void call_lua_function_with_limits(int num_args, const ix_FileHandle *err_out)
+    {
+        const TraceSpan span = trace_span("lua run");
+        const bool run_limited = (m_lua_instruction_limit != 0) || (m_lua_time_limit_sec > 0.0);
+        if (ix_UNLIKELY(run_limited))
+        {
+            m_lua_instructions_left = m_lua_instruction_limit;
+            m_lua_run_clock.capture();
+            set_lua_limit_hook(m_lua_state);
+        }
 
-            const ix_StringView line_view(line_start, m_line_buffer.size());
-            const bool block_end = (line_view == COMMENT_BLOCK_FOOTER);
-            if (block_end)
-            {
-                depth -= 1;
-                const bool comment_end = (depth == 0);
-                if (comment_end)
-                {
-                    break;
-                }
-            }
+        m_lua_allocator.set_heap_limit(m_lua_heap_limit);
+        call_lua_function(m_lua_state, num_args, err_out);
+        m_lua_allocator.set_heap_limit(0);
 
-            const bool block_begin = (line_view == COMMENT_BLOCK_HEADER);
-            if (block_begin)
+        if (ix_UNLIKELY(run_limited))
+        {
+            lua_sethook(m_lua_state, nullptr, 0, 0);
+        }
+    }
+
+    // The hook counts down to the instruction limit exactly, and checks the time limit on the way.
+    void set_lua_limit_hook(lua_State *L)
+    {
+        m_lua_hook_count = LUA_LIMIT_CHECK_INTERVAL;
+        if ((m_lua_instruction_limit != 0) && (m_lua_instructions_left < LUA_LIMIT_CHECK_INTERVAL))
+        {
+            m_lua_hook_count = static_cast<int>(m_lua_instructions_left);
+        }
+        lua_sethook(L, &GokuraiContextImpl::lua_limit_hook, LUA_MASKCOUNT, m_lua_hook_count);
+    }
+
+    static void lua_limit_hook(lua_State *L, lua_Debug *)
+    {
+        GokuraiContextImpl *ctx = *static_cast<GokuraiContextImpl **>(lua_getextraspace(L));
+        if (ctx->m_lua_instruction_limit != 0)
+        {
+            ctx->m_lua_instructions_left -= static_cast<uint64_t>(ctx->m_lua_hook_count);
+            if (ctx->m_lua_instructions_left == 0)
             {
-                depth += 1;
+                luaL_where(L, 0); // The hook runs in the interrupted function, not in a call of its own.
+                lua_pushfstring(L, "instruction limit (%I) exceeded",
+                                static_cast<lua_Integer>(ctx->m_lua_instruction_limit));
+                lua_concat(L, 2);
+                lua_error(L);
             }
+            ctx->set_lua_limit_hook(L);
         }
 
-        m_lua_enabled = true;
+        if ((ctx->m_lua_time_limit_sec > 0.0) && (ctx->m_lua_run_clock.elaplsed_sec() > ctx->m_lua_time_limit_sec))
+        {
+            luaL_where(L, 0);
+            lua_pushfstring(L, "time limit (%f s) exceeded", static_cast<lua_Number>(ctx->m_lua_time_limit_sec));
+            lua_concat(L, 2);
+            lua_error(L);
+        }
     }
 
     void eval_lua_fragment(const char *fragment, size_t fragment_length, const char **output, size_t *output_length)
     {
-        if (ix_UNLIKELY(m_lua_state == nullptr))
+        if (ix_UNLIKELY(take_recorded_lua_output(output, output_length)))
         {
-            m_lua_state = luaL_newstate();
-            luaL_checkversion(m_lua_state);
-            lua_gc(m_lua_state, LUA_GCGEN, 0, 0);
-            luaL_openlibs(m_lua_state);
+            return;
         }
 
-        ix_ASSERT(ix_memcmp(fragment, LUA_RETURN.data(), LUA_RETURN.length()) == 0);
-        ix_ASSERT(fragment[fragment_length - 1] == '\0');
+        ensure_lua_state();
 
-        // With "return".
-        const int result = eval_lua_program(m_lua_state, fragment, fragment_length - 1, nullptr);
-
-        if (result != LUA_OK)
+        m_recording_lua_program = m_lua_history_enabled;
+        const ix_StringView statement(fragment + LUA_RETURN.length(), fragment_length - 1 - LUA_RETURN.length());
+        const int *chunk_ref = m_lua_chunk_refs.find(statement);
+        if (ix_LIKELY(chunk_ref != nullptr))
         {
-            // Without "return".
-            lua_settop(m_lua_state, 0);
-            constexpr size_t OFFSET = LUA_RETURN.length();
-            eval_lua_program(m_lua_state, fragment + OFFSET, fragment_length - 1 - OFFSET, m_err_handle);
+            m_lua_chunk_cache_hits += 1;
+            lua_rawgeti(m_lua_state, LUA_REGISTRYINDEX, *chunk_ref);
+            call_lua_function_with_limits(0, m_err_handle);
+        }
+        else
+        {
+            m_lua_chunk_cache_misses += 1;
+            if (load_lua_fragment_with_limits(fragment, fragment_length, m_err_handle))
+            {
+                cache_lua_chunk(statement);
+                call_lua_function_with_limits(0, m_err_handle);
+            }
         }
+        m_recording_lua_program = false;
 
-        *output = lua_tolstring(m_lua_state, 1, output_length);
-        if (*output == nullptr)
+        if (ix_UNLIKELY(m_lua_history_enabled))
         {
-            // The program's return value is not an integer nor a string.
-            *output = "";
-            *output_length = 0;
+            const size_t program_length = fragment_length - 1;
+            m_lua_history.emplace_back(m_lua_history_arena.push(fragment, program_length), program_length);
         }
+
+        take_lua_output(output, output_length);
     }
 };
 
@@ -1583,6 +4508,156 @@ void gokurai_context_end_input(GokuraiContext ctx, GokuraiResult result)
     ctx_impl->end_input(result_impl);
 }
 
+void gokurai_context_set_output_handle(GokuraiContext ctx, const ix_FileHandle *out_handle)
+{
+    auto *impl = static_cast<GokuraiContextImpl *>(ctx);
+    impl->set_output_handle(out_handle);
+}
+
+void gokurai_context_set_output_high_water_mark(GokuraiContext ctx, size_t size)
+{
+    auto *impl = static_cast<GokuraiContextImpl *>(ctx);
+    impl->set_output_high_water_mark(size);
+}
+
+void gokurai_context_set_macro_cache_enabled(GokuraiContext ctx, bool enabled)
+{
+    auto *impl = static_cast<GokuraiContextImpl *>(ctx);
+    impl->set_macro_cache_enabled(enabled);
+}
+
+uint64_t gokurai_context_get_macro_cache_hits(GokuraiContext ctx)
+{
+    const auto *impl = static_cast<const GokuraiContextImpl *>(ctx);
+    return impl->macro_cache_hits();
+}
+
+uint64_t gokurai_context_get_macro_cache_misses(GokuraiContext ctx)
+{
+    const auto *impl = static_cast<const GokuraiContextImpl *>(ctx);
+    return impl->macro_cache_misses();
+}
+
+uint64_t gokurai_context_get_lua_chunk_cache_hits(GokuraiContext ctx)
+{
+    const auto *impl = static_cast<const GokuraiContextImpl *>(ctx);
+    return impl->lua_chunk_cache_hits();
+}
+
+uint64_t gokurai_context_get_lua_chunk_cache_misses(GokuraiContext ctx)
+{
+    const auto *impl = static_cast<const GokuraiContextImpl *>(ctx);
+    return impl->lua_chunk_cache_misses();
+}
+
+size_t gokurai_context_get_lua_heap_size(GokuraiContext ctx)
+{
+    const auto *impl = static_cast<const GokuraiContextImpl *>(ctx);
+    return impl->lua_heap_size();
+}
+
+size_t gokurai_context_get_lua_peak_heap_size(GokuraiContext ctx)
+{
+    const auto *impl = static_cast<const GokuraiContextImpl *>(ctx);
+    return impl->lua_peak_heap_size();
+}
+
+void gokurai_context_set_lua_limits(GokuraiContext ctx, uint64_t instruction_limit, double time_limit_sec,
+                                    size_t heap_limit)
+{
+    auto *impl = static_cast<GokuraiContextImpl *>(ctx);
+    impl->set_lua_limits(instruction_limit, time_limit_sec, heap_limit);
+}
+
+bool gokurai_context_set_trace_handle(GokuraiContext ctx, const ix_FileHandle *file)
+{
+    auto *impl = static_cast<GokuraiContextImpl *>(ctx);
+    return impl->set_trace_handle(file);
+}
+
+bool gokurai_context_set_profile_enabled(GokuraiContext ctx, bool enabled)
+{
+    auto *impl = static_cast<GokuraiContextImpl *>(ctx);
+    return impl->set_profile_enabled(enabled);
+}
+
+bool gokurai_context_write_profile(GokuraiContext ctx, const ix_FileHandle *file, bool json)
+{
+    const auto *impl = static_cast<const GokuraiContextImpl *>(ctx);
+    return impl->write_profile(*file, json);
+}
+
+GokuraiSnapshot gokurai_context_snapshot(GokuraiContext ctx)
+{
+    auto *impl = static_cast<GokuraiContextImpl *>(ctx);
+    auto *snapshot = ix_new<GokuraiSnapshotImpl>();
+    impl->take_snapshot(*snapshot);
+    return snapshot;
+}
+
+GokuraiContext gokurai_context_fork(GokuraiSnapshot snapshot, const ix_FileHandle *out_handle,
+                                    const ix_FileHandle *err_handle)
+{
+    const auto *snapshot_impl = static_cast<const GokuraiSnapshotImpl *>(snapshot);
+    auto *impl = ix_new<GokuraiContextImpl>(out_handle, err_handle);
+    impl->restore_snapshot(*snapshot_impl);
+    return impl;
+}
+
+void gokurai_snapshot_destroy(GokuraiSnapshot snapshot)
+{
+    auto *impl = static_cast<GokuraiSnapshotImpl *>(snapshot);
+    ix_delete(impl);
+}
+
+void gokurai_context_set_lua_history_enabled(GokuraiContext ctx, bool enabled)
+{
+    auto *impl = static_cast<GokuraiContextImpl *>(ctx);
+    impl->set_lua_history_enabled(enabled);
+}
+
+bool gokurai_context_save_library(GokuraiContext ctx, const ix_FileHandle *file)
+{
+    auto *impl = static_cast<GokuraiContextImpl *>(ctx);
+    return impl->save_library(*file);
+}
+
+GokuraiLibrary gokurai_library_load(const ix_FileHandle *file)
+{
+    auto *impl = ix_new<GokuraiLibraryImpl>();
+    impl->mapped = ix_MappedFile(*file);
+    bool ok;
+    if (impl->mapped.is_valid())
+    {
+        ok = impl->bind(impl->mapped.data(), impl->mapped.size());
+    }
+    else
+    {
+        size_t size = 0;
+        impl->loaded = file->read_all(&size);
+        ok = (impl->loaded.get() != nullptr) && impl->bind(impl->loaded.get(), size);
+    }
+
+    if (!ok)
+    {
+        ix_delete(impl);
+        return nullptr;
+    }
+    return impl;
+}
+
+void gokurai_library_destroy(GokuraiLibrary library)
+{
+    auto *impl = static_cast<GokuraiLibraryImpl *>(library);
+    ix_delete(impl);
+}
+
+void gokurai_context_use_library(GokuraiContext ctx, GokuraiLibrary library)
+{
+    auto *impl = static_cast<GokuraiContextImpl *>(ctx);
+    impl->use_library(static_cast<const GokuraiLibraryImpl *>(library));
+}
+
 GokuraiResult gokurai_result_create()
 {
     return ix_new<GokuraiResultImpl>();
@@ -1817,6 +4892,18 @@ ix_TEST_CASE("gokurai: macro with arguments")
     test_gokurai("#+MACRO foo $1-$2\n"
                  "[[[foo(11,22,33,44)]]]",
                  "11-22");
+
+    test_gokurai("#+MACRO foo $a $1$ $\n"
+                 "[[[foo(x)]]]",
+                 "$a x$ $");
+
+    test_gokurai("#+MACRO_BEGIN foo\n"
+                 "<$1$\n"
+                 "$2>$0\n"
+                 "#+MACRO_END\n"
+                 "[[[foo(a,b)]]]\n",
+                 "<a$\n"
+                 "b>a,b\n");
 }
 
 ix_TEST_CASE("gokurai: local macro")
@@ -2830,6 +5917,15 @@ ix_TEST_CASE("gokurai: quoted macro calls")
     test_gokurai("#+MACRO foo '[[[bar]]]\n"
                  "[[[foo]]]\n",
                  "[[[bar]]]\n");
+
+    // Quotes next to quotes.
+    test_gokurai("''[[[x]]]", "'[[[x]]]");
+    test_gokurai("'^'[[[x']]]", "^[[[x]]]");
+    test_gokurai("'^''[[[x]]]", "'^'[[[x]]]");
+    test_gokurai("'^'^[[[x']]]", "'^^[[[x]]]");
+    test_gokurai("a''']]]b'''[[[c'^^[[[", "a'']]]b''[[[c'^^[[[");
+    test_gokurai("x'\n'''\n", "x'\n'''\n");
+    test_gokurai("'^['[[[x']]]", "^[[[[x]]]");
 }
 
 ix_TEST_CASE("gokurai: quoted directives")
@@ -3054,6 +6150,37 @@ end
                  "FOOFOO\n");
 }
 
+ix_TEST_CASE("gokurai: multiline macros inside multiline macro")
+{
+    test_gokurai(R"(#+MACRO_BEGIN inner
+<$1
+$1>
+#+MACRO_END
+#+MACRO_BEGIN outer
+^[[[inner(a)]]] x
+^[[[inner(b)]]]^[[[inner(c)]]] y
+#+MACRO_END
+[[[outer]]] tail
+#+LUA_BEGIN
+return "l1\n[" .. "[[outer]]] z"
+#+LUA_END
+end
+)",
+                 R"(<a
+a> x
+<b
+b><c
+c> y tail
+l1
+<a
+a> x
+<b
+b><c
+c> y z
+end
+)");
+}
+
 ix_TEST_CASE("gokurai: lazy macro call")
 {
     // Short lazy macro.
@@ -3496,6 +6623,26 @@ ix_TEST_CASE("gokurai: not a directive")
 )");
 }
 
+ix_TEST_CASE("gokurai: find_directive")
+{
+    for (const DirectiveEntry &entry : DIRECTIVES)
+    {
+        ix_Buffer line(64);
+        line.push(entry.text.data(), entry.text.length());
+        line.push_str("foo\n");
+        ix_EXPECT(find_directive(line.data()) == entry.directive);
+    }
+
+    ix_EXPECT(find_directive("\n") == DIRECTIVE_NONE);
+    ix_EXPECT(find_directive("#\n") == DIRECTIVE_NONE);
+    ix_EXPECT(find_directive("#+MACRO\n") == DIRECTIVE_NONE);
+    ix_EXPECT(find_directive("#+MACRO_BEGIN\n") == DIRECTIVE_NONE);
+    ix_EXPECT(find_directive("#+MACRO_END \n") == DIRECTIVE_NONE);
+    ix_EXPECT(find_directive("#+LUA_BEGIN foo\n") == DIRECTIVE_NONE);
+    ix_EXPECT(find_directive("#+LOCAL_MACRO_ENDX\n") == DIRECTIVE_NONE);
+    ix_EXPECT(find_directive("#+COMMENT\n") == DIRECTIVE_NONE);
+}
+
 ix_TEST_CASE("gokurai: INPUT_LINE_NUMBER")
 {
     test_gokurai(R"([[[__INPUT_LINE_NUMBER__]]]
@@ -3588,6 +6735,31 @@ o
 )");
 }
 
+ix_TEST_CASE("gokurai: builtin macro lookup")
+{
+    for (const BuiltinMacroEntry &entry : BUILTIN_MACROS)
+    {
+        ix_EXPECT(find_builtin_macro(entry.name) == entry.builtin);
+    }
+    ix_EXPECT(find_builtin_macro(ix_StringView("_")) == BUILTIN_MACRO_NONE);
+    ix_EXPECT(find_builtin_macro(ix_StringView("__LUA_")) == BUILTIN_MACRO_NONE);
+    ix_EXPECT(find_builtin_macro(ix_StringView("__LUB__")) == BUILTIN_MACRO_NONE);
+    ix_EXPECT(find_builtin_macro(ix_StringView("__ENABLE_LUB__")) == BUILTIN_MACRO_NONE);
+    ix_EXPECT(find_builtin_macro(ix_StringView("_private")) == BUILTIN_MACRO_NONE);
+
+    test_gokurai("#+MACRO _private PRIVATE\n"
+                 "#+MACRO __ENABLE_LUB__ LUB\n"
+                 "#+MACRO __LUA__ NOT_LUA\n"
+                 "[[[_private]]] [[[__ENABLE_LUB__]]] [[[__LUA__(1 + 1)]]]\n"
+                 "[[[__DISABLE_LUA__]]]\n"
+                 "[[[__LUA__]]] [[[__NO_NEWLINE__]]] x\n"
+                 "[[[__ENABLE_LUA__]]][[[__LUA__(3)]]]\n",
+                 "PRIVATE LUB 2\n"
+                 "\n"
+                 "NOT_LUA  x\n"
+                 "NOT_LUA\n");
+}
+
 ix_TEST_CASE("gokurai: lua code inside a comment block")
 {
     test_gokurai(R"(
@@ -3940,3 +7112,1126 @@ ix_TEST_CASE("gokurai: teasing string")
     test_gokurai("#+FOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOO", "#+FOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOO");
     test_gokurai("'#+FOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOO", "'#+FOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOO");
 }
+
+ix_TEST_CASE("gokurai: long line with many calls")
+{
+    // Calls are placed at every offset modulo 32 so that they straddle the chunks of the bracket scanner.
+    ix_Buffer input(4096);
+    ix_Buffer expected(4096);
+    input.push_str("#+MACRO foo FOO\n"
+                   "#+MACRO bar <$1|$2>\n");
+    for (size_t i = 0; i < 64; i++)
+    {
+        input.push_char_repeat('-', i % 37);
+        expected.push_char_repeat('-', i % 37);
+        if ((i % 3) == 0)
+        {
+            input.push_str("[[[foo]]]");
+            expected.push_str("FOO");
+        }
+        else if ((i % 3) == 1)
+        {
+            input.push_str("[[[bar([[[foo]]],'[[[x']]])]]]");
+            expected.push_str("<FOO|[[[x]]]>");
+        }
+        else
+        {
+            input.push_str("^[[[bar(]],[)]]][");
+            expected.push_str("<]]|[>[");
+        }
+    }
+    input.push_char('\n');
+    expected.push_char('\n');
+    input.push_char('\0');
+    expected.push_char('\0');
+    test_gokurai(input.data(), expected.data());
+}
+
+ix_TEST_CASE("gokurai: many calls in arguments")
+{
+    test_gokurai("#+MACRO c C\n"
+                 "#+MACRO row <$0>\n"
+                 "[[[row([[[c]]],[[[c]]],[[[c]]],[[[c]]],[[[c]]],[[[c]]],[[[c]]],[[[c]]],[[[c]]],[[[c]]])]]]\n",
+                 "<C,C,C,C,C,C,C,C,C,C>\n");
+
+    test_gokurai("#+MACRO c C\n"
+                 "#+MACRO row <$1|$2>\n"
+                 "[[[row([[[row([[[c]]],[[[c]]])]]],[[[row([[[c]]],[[[row(c,[[[c]]])]]])]]])]]]\n",
+                 "<<C|C>|<C|<c|C>>>\n");
+
+    test_gokurai("#+MACRO c C\n"
+                 "#+MACRO row <$0>\n"
+                 "#+MACRO l [\n"
+                 "#+MACRO r ]\n"
+                 "[[[row([[[l]]][[[l]]][[[l]]]c[[[r]]][[[r]]][[[r]]],[[[c]]])]]]\n",
+                 "<C,C>\n");
+}
+
+ix_TEST_CASE("gokurai: calls before a long tail")
+{
+    // The replacements are longer than the calls, so the line buffer grows while the tail is kept apart.
+    ix_Buffer input(4096);
+    ix_Buffer expected(4096);
+    input.push_str("#+MACRO long 0123456789012345678901234567890123456789\n"
+                   "#+MACRO_BEGIN two\n"
+                   "A\n"
+                   "B\n"
+                   "#+MACRO_END\n");
+    for (size_t i = 0; i < 100; i++)
+    {
+        input.push_str("[[[long]]]-");
+        expected.push_str("0123456789012345678901234567890123456789-");
+    }
+    input.push_str("^[[[long]]][[[two]]]");
+    expected.push_str("0123456789012345678901234567890123456789A\nB");
+    for (size_t i = 0; i < 1100; i++)
+    {
+        input.push_str("tail");
+        expected.push_str("tail");
+    }
+    input.push_str("[[[__NO_NEWLINE__]]]\n"
+                   "[[[long]]]\n");
+    expected.push_str("0123456789012345678901234567890123456789\n");
+    input.push_char('\0');
+    expected.push_char('\0');
+    test_gokurai(input.data(), expected.data());
+}
+
+ix_TEST_CASE("gokurai: lazy calls before a long tail")
+{
+    // The lazy calls are skipped while the tail is kept apart.
+    ix_Buffer input(8192);
+    ix_Buffer expected(8192);
+    input.push_str("#+MACRO a A\n"
+                   "#+MACRO pair <$1|$2>\n"
+                   "[[[pair(^[[[a]]],[[[a]]])]]] ^[[[a]]] [[[pair([[[a]]],^[[[pair(^[[[a]]],b)]]])]]] [[[a]]]");
+    expected.push_str("<A|A> A <A|<A|b>> A");
+    for (size_t i = 0; i < 1100; i++)
+    {
+        input.push_str("tail");
+        expected.push_str("tail");
+    }
+    input.push_str("[[[a]]] ^[[[a]]]\n");
+    expected.push_str("A A\n");
+    input.push_char('\0');
+    expected.push_char('\0');
+    test_gokurai(input.data(), expected.data());
+}
+
+ix_TEST_CASE("gokurai: lazy calls with unmatched ends before a call")
+{
+    test_gokurai("[[[^[[[]]][]]][[[^[[[]]]'^[[[]]]\n", "[\n");
+    test_gokurai("#+MACRO foo FOO\n"
+                 "[[[foo]]][[[^[[[foo]]][]]][[[foo]]][[[^[[[foo]]]'^[[[foo]]]\n",
+                 "FOOFOO\n");
+}
+
+ix_TEST_CASE("gokurai: Lua chunk cache")
+{
+    const ix_FileHandle null = ix_FileHandle::null();
+    GokuraiContext ctx = gokurai_context_create(nullptr, &null);
+    GokuraiResult result = gokurai_result_create();
+
+    gokurai_context_feed_str(ctx, "#+LUA_BEGIN\n"
+                                  "n = 0\n"
+                                  "function fail() n = n + 1; error('failed', 0) end\n"
+                                  "#+LUA_END\n"
+                                  "#+MACRO twice ^[[[__LUA__('$1' .. '$1')]]]\n"
+                                  "#+MACRO count ^[[[__LUA__(n = n + 1)]]]^[[[__LUA__(n)]]]\n"
+                                  "[[[twice(a)]]] [[[twice(a)]]] [[[twice(b)]]]\n"
+                                  "[[[count]]] [[[count]]] [[[count]]]\n"
+                                  "[[[__LUA__(fail())]]]\n"
+                                  "[[[__LUA__(n)]]]\n"
+                                  "[[[__LUA__(syntax error)]]] [[[__LUA__(syntax error)]]]\n");
+    gokurai_context_end_input(ctx, result);
+    // Calls on a line are expanded from the last one. A fragment that fails at run time is run once, and its error
+    // message is the output as before.
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "aa aa bb\n"
+                                                       "2 1 0\n"
+                                                       "failed\n"
+                                                       "4\n"
+                                                       "[string \"syntax error\"]:1: syntax error near 'error' "
+                                                       "[string \"syntax error\"]:1: syntax error near 'error'\n");
+    // The block and the fragments for 'a', 'b', `n = n + 1`, `n` and `fail()` are compiled once each. Fragments that
+    // do not compile are not cached.
+    ix_EXPECT(gokurai_context_get_lua_chunk_cache_misses(ctx) == 8);
+    ix_EXPECT(gokurai_context_get_lua_chunk_cache_hits(ctx) == 6);
+
+    // Many distinct fragments empty the cache rather than grow it.
+    gokurai_context_clear(ctx);
+    ix_Buffer input(64 * 1024);
+    for (size_t i = 0; i < 3 * MAX_NUM_LUA_CHUNKS; i++)
+    {
+        char line[64];
+        const int length = ix_snprintf(line, sizeof(line), "[[[__LUA__(%zu)]]]\n", i % (2 * MAX_NUM_LUA_CHUNKS));
+        input.push(line, static_cast<size_t>(length));
+    }
+    input.push_char('\0');
+    gokurai_context_feed_str(ctx, input.data());
+    gokurai_context_end_input(ctx, result);
+    ix_EXPECT(ix_strstr(gokurai_result_get_output(result), "\n2047\n0\n1\n") != nullptr);
+    ix_EXPECT(gokurai_context_get_lua_chunk_cache_misses(ctx) == 3 * MAX_NUM_LUA_CHUNKS);
+
+    gokurai_context_destroy(ctx);
+    gokurai_result_destroy(result);
+}
+
+ix_TEST_CASE("gokurai: Lua heap")
+{
+    GokuraiContext ctx = gokurai_context_create(nullptr, nullptr);
+    GokuraiResult result = gokurai_result_create();
+    ix_EXPECT(gokurai_context_get_lua_heap_size(ctx) == 0);
+    ix_EXPECT(gokurai_context_get_lua_peak_heap_size(ctx) == 0);
+
+    gokurai_context_feed_str(ctx, "[[[__LUA__(1)]]]\n");
+    gokurai_context_end_input(ctx, result);
+    const size_t initial_size = gokurai_context_get_lua_heap_size(ctx);
+    ix_EXPECT(initial_size > 0);
+
+    // Small strings and tables come from the pools, and the array part of `big` is reallocated as it grows.
+    gokurai_context_feed_str(ctx, "#+LUA_BEGIN\n"
+                                  "big = {}\n"
+                                  "for i = 1, 100000 do big[i] = {tostring(i), string.rep('x', i % 300)} end\n"
+                                  "#+LUA_END\n"
+                                  "[[[__LUA__(#big[99999][2] + #big[299][2])]]]\n");
+    gokurai_context_end_input(ctx, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "398\n");
+    ix_EXPECT(gokurai_context_get_lua_heap_size(ctx) > initial_size + 10 * 1000 * 1000);
+
+    gokurai_context_feed_str(ctx, "[[[__LUA__(big = nil; collectgarbage())]]]\n");
+    gokurai_context_end_input(ctx, result);
+    // Lua shrinks its string table gradually, so not all of it comes back at once.
+    const size_t peak_size = gokurai_context_get_lua_peak_heap_size(ctx);
+    ix_EXPECT(peak_size > initial_size + 10 * 1000 * 1000);
+    ix_EXPECT(gokurai_context_get_lua_heap_size(ctx) < peak_size / 10);
+
+    gokurai_context_clear(ctx);
+    ix_EXPECT(gokurai_context_get_lua_heap_size(ctx) == 0);
+    ix_EXPECT(gokurai_context_get_lua_peak_heap_size(ctx) == 0);
+
+    gokurai_context_destroy(ctx);
+    gokurai_result_destroy(result);
+}
+
+ix_TEST_CASE("gokurai: Lua limits")
+{
+    ix_TempFileW err;
+    GokuraiContext ctx = gokurai_context_create(nullptr, &err.file_handle());
+    GokuraiResult result = gokurai_result_create();
+
+    // The limits apply to each run, so the context goes on after one fails.
+    gokurai_context_set_lua_limits(ctx, 10000, 0.0, 0);
+    gokurai_context_feed_str(ctx, "[[[__LUA__(gokurai.macro('spin', function() while true do end end))]]]\n"
+                                  "[[[__LUA__(n = 0; while true do n = n + 1 end)]]]\n"
+                                  "[[[spin]]]\n"
+                                  "#+LUA_BEGIN\n"
+                                  "for i = 1, 1000 do end\n"
+                                  "return n > 1000 and n < 10000\n"
+                                  "#+LUA_END\n"
+                                  "[[[__LUA__(tostring(n > 1000 and n < 10000))]]]\n");
+    gokurai_context_end_input(ctx, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result),
+                    "\n"
+                    "[string \"n = 0; while true do n = n + 1 end\"]:1: instruction limit (10000) exceeded\n"
+                    "[string \"gokurai.macro('spin', function() while true d...\"]:1: "
+                    "instruction limit (10000) exceeded\n"
+                    "true\n");
+    err.close();
+    ix_EXPECT(ix_strstr(err.data(), "Lua evaluation failed: [string \"n = 0; while") != nullptr);
+
+    gokurai_context_set_lua_limits(ctx, 0, 0.01, 0);
+    gokurai_context_feed_str(ctx, "[[[__LUA__(while true do end)]]]\n");
+    gokurai_context_end_input(ctx, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result),
+                    "[string \"while true do end\"]:1: time limit (0.01 s) exceeded\n");
+
+    // An allocation past the heap limit fails, even after a full collection.
+    const size_t heap_limit = gokurai_context_get_lua_heap_size(ctx) + 1000 * 1000;
+    gokurai_context_set_lua_limits(ctx, 0, 0.0, heap_limit);
+    gokurai_context_feed_str(ctx, "[[[__LUA__(#string.rep('x', 100 * 1000))]]]\n"
+                                  "[[[__LUA__(#string.rep('x', 1000 * 1000))]]]\n"
+                                  "[[[__LUA__(t = {} for i = 1, 1000 * 1000 do t[i] = i end)]]]\n"
+                                  "[[[__LUA__(t = nil; return #string.rep('x', 100 * 1000))]]]\n");
+    gokurai_context_end_input(ctx, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "100000\n"
+                                                       "not enough memory\n"
+                                                       "not enough memory\n"
+                                                       "100000\n");
+    ix_EXPECT(gokurai_context_get_lua_peak_heap_size(ctx) <= heap_limit);
+
+    gokurai_context_clear(ctx);
+    gokurai_context_feed_str(ctx, "[[[__LUA__(n = 0; for i = 1, 100000 do n = n + 1 end; return n)]]]\n");
+    gokurai_context_end_input(ctx, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "100000\n");
+
+    gokurai_context_destroy(ctx);
+    gokurai_result_destroy(result);
+}
+
+ix_TEST_CASE("gokurai: Lua macros")
+{
+    const ix_FileHandle null = ix_FileHandle::null();
+    GokuraiContext ctx = gokurai_context_create(nullptr, &null);
+    GokuraiResult result = gokurai_result_create();
+
+    gokurai_context_set_lua_history_enabled(ctx, true);
+    gokurai_context_feed_str(ctx, "#+LUA_BEGIN\n"
+                                  "gokurai.macro('join', function(...) return table.concat({...}, '|') end)\n"
+                                  "gokurai.macro('lines', function(a) return a .. '\\n' .. a end)\n"
+                                  "gokurai.macro('none', function() end)\n"
+                                  "gokurai.macro('text', function() return 'lua' end)\n"
+                                  "#+LUA_END\n"
+                                  "[[[join(a,b\\,c, d )]]] [[[join()]]] [[[join]]] [[[none]]]\n"
+                                  "<[[[lines(x)]]]>\n"
+                                  "#+LOCAL_MACRO join local\n"
+                                  "[[[join(a)]]]\n"
+                                  "[[[join(\"'\")]]]\n");
+    gokurai_context_end_input(ctx, result);
+    // The arguments are passed as they are, without being pasted into Lua code.
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "a|b,c| d    \n"
+                                                       "<x\n"
+                                                       "x>\n"
+                                                       "local\n"
+                                                       "\"'\"\n");
+    // Calling a Lua macro compiles nothing.
+    ix_EXPECT(gokurai_context_get_lua_chunk_cache_misses(ctx) == 1);
+    ix_EXPECT(gokurai_context_get_lua_chunk_cache_hits(ctx) == 0);
+
+    // A text macro and a Lua macro redefine each other.
+    gokurai_context_feed_str(ctx, "#+MACRO join text\n"
+                                  "[[[join(a)]]]\n"
+                                  "[[[__LUA__(gokurai.macro('join', function() return 'lua' end))]]]\n"
+                                  "[[[join(a)]]]\n"
+                                  "#+MACRO wrap <^[[[text]]]>\n"
+                                  "[[[wrap]]] [[[wrap]]]\n"
+                                  "#+MACRO text doc\n");
+    gokurai_context_end_input(ctx, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "text\n"
+                                                       "\n"
+                                                       "lua\n"
+                                                       "<lua> <lua>\n");
+
+    // A fork has the macros as they are. The functions of its Lua macros come from running the Lua history again.
+    GokuraiSnapshot snapshot = gokurai_context_snapshot(ctx);
+    GokuraiContext fork = gokurai_context_fork(snapshot, nullptr, &null);
+    gokurai_context_feed_str(fork, "[[[text]]] [[[lines(y)]]]\n");
+    gokurai_context_end_input(fork, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "doc y\n"
+                                                       "y\n");
+
+    // A unit retried for want of input does not call the functions again.
+    const char *counted = "[[[__LUA__(n = 0; gokurai.macro('count', function() n = n + 1; return n end))]]]\n"
+                          "[[[count]]] [[[count]]]\n"
+                          "#+MACRO_BEGIN block\n"
+                          "[[[count]]]\n"
+                          "#+MACRO_END\n"
+                          "[[[block]]]\n";
+    for (size_t i = 0; counted[i] != '\0'; i++)
+    {
+        gokurai_context_feed_input(ctx, &counted[i], 1);
+    }
+    gokurai_context_end_input(ctx, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "\n"
+                                                       "2 1\n"
+                                                       "3\n");
+
+    // Lua macros are not called while Lua is disabled.
+    gokurai_context_feed_str(fork, "[[[__DISABLE_LUA__]]]\n"
+                                   "<[[[none]]][[[join(a)]]]>\n");
+    gokurai_context_end_input(fork, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "\n"
+                                                       "<>\n");
+
+    gokurai_context_destroy(fork);
+    gokurai_snapshot_destroy(snapshot);
+    gokurai_context_destroy(ctx);
+    gokurai_result_destroy(result);
+}
+
+ix_TEST_CASE("gokurai: Lua macro API")
+{
+    const ix_FileHandle null = ix_FileHandle::null();
+    GokuraiContext ctx = gokurai_context_create(nullptr, &null);
+    GokuraiResult result = gokurai_result_create();
+
+    gokurai_context_set_lua_history_enabled(ctx, true);
+    // The lines of a Lua block are expanded like any other, so the calls in bodies are made up in Lua. As in a
+    // definition, those left in a body are lazy ones.
+    gokurai_context_feed_str(ctx, "#+LUA_BEGIN\n"
+                                  "function call(s) return '^[' .. '[[' .. s .. ']]]' end\n"
+                                  "for i, name in ipairs({'one', 'two', 'three'}) do\n"
+                                  "  gokurai.define(name, name .. '=' .. i .. '$1')\n"
+                                  "end\n"
+                                  "gokurai.define('block', '<$1\\n' .. call('one(!)') .. '>')\n"
+                                  "gokurai.define('twice', call('$1') .. call('$1'))\n"
+                                  "gokurai.macro('upper', string.upper)\n"
+                                  "#+LUA_END\n"
+                                  "[[[one]]] [[[two(,)]]] [[[three(x)]]] [[[twice(two)]]]\n"
+                                  "[[[block(b)]]]\n"
+                                  "[[[__LUA__(gokurai.get('two'))]]] [[[__LUA__(gokurai.get('upper')('u'))]]]\n"
+                                  "[[[__LUA__(tostring(gokurai.get('none')))]]]\n"
+                                  "[[[__LUA__(gokurai.define('one', 'local', true))]]]\n"
+                                  "[[[one]]] [[[__LUA__(gokurai.get('one'))]]]\n"
+                                  "[[[one]]]\n"
+                                  "[[[__LUA__(tostring(gokurai.undefine('two')))]]]\n"
+                                  "[[[two]]] [[[__LUA__(tostring(gokurai.undefine('two')))]]]\n"
+                                  "[[[__LUA__(gokurai.undefine('upper'))]]]\n"
+                                  "[[[upper(x)]]]\n"
+                                  "[[[__LUA__(gokurai.define('', ''))]]]\n");
+    gokurai_context_end_input(ctx, result);
+    // A call without parentheses expands the body as it is.
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "one=1$1 two=2 three=3x two=2$1two=2$1\n"
+                                                       "<b\n"
+                                                       "one=1!>\n"
+                                                       "two=2$1 U\n"
+                                                       "nil\n"
+                                                       "\n"
+                                                       "local local\n"
+                                                       "one=1$1\n"
+                                                       "true\n"
+                                                       " false\n"
+                                                       "\n"
+                                                       "\n"
+                                                       "[string \"gokurai.define('', '')\"]:1: "
+                                                       "bad argument #1 to 'define' (empty macro name)\n");
+
+    // A fork and a library start with the macros as the history left them, not as it defines them on the way.
+    gokurai_context_feed_str(ctx, "[[[__LUA__(gokurai.macro('lower', string.lower); gokurai.undefine('three'))]]]\n"
+                                  "#+MACRO one text\n");
+    gokurai_context_end_input(ctx, result);
+    GokuraiSnapshot snapshot = gokurai_context_snapshot(ctx);
+    ix_TempFileW library_file;
+    ix_EXPECT(gokurai_context_save_library(ctx, &library_file.file_handle()));
+    library_file.close();
+    const ix_FileHandle library_handle(library_file.filename(), ix_READ_ONLY);
+    GokuraiLibrary library = gokurai_library_load(&library_handle);
+    ix_ASSERT_FATAL(library != nullptr);
+
+    const char *input = "[[[one]]] [[[two]]] [[[three]]] [[[lower(A)]]] [[[upper(a)]]] [[[block(b)]]]\n";
+    const char *expected = "text   a  <b\n"
+                           "text>\n";
+    GokuraiContext fork = gokurai_context_fork(snapshot, nullptr, &null);
+    gokurai_context_feed_str(fork, input);
+    gokurai_context_end_input(fork, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), expected);
+
+    GokuraiContext library_user = gokurai_context_create(nullptr, &null);
+    gokurai_context_use_library(library_user, library);
+    gokurai_context_feed_str(library_user, input);
+    gokurai_context_end_input(library_user, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), expected);
+
+    // A macro of the library can be undefined, also in a library made from it.
+    gokurai_context_feed_str(library_user, "[[[__LUA__(gokurai.undefine('one'))]]]\n"
+                                           "<[[[one]]]>\n");
+    gokurai_context_end_input(library_user, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "\n"
+                                                       "<>\n");
+    ix_TempFileW second_library_file;
+    ix_EXPECT(gokurai_context_save_library(library_user, &second_library_file.file_handle()));
+    second_library_file.close();
+    const ix_FileHandle second_library_handle(second_library_file.filename(), ix_READ_ONLY);
+    GokuraiLibrary second_library = gokurai_library_load(&second_library_handle);
+    ix_ASSERT_FATAL(second_library != nullptr);
+    gokurai_context_clear(library_user);
+    gokurai_context_use_library(library_user, second_library);
+    gokurai_context_feed_str(library_user, "<[[[one]]]> [[[lower(A)]]]\n");
+    gokurai_context_end_input(library_user, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "<> a\n");
+
+    gokurai_context_destroy(library_user);
+    gokurai_library_destroy(second_library);
+    gokurai_library_destroy(library);
+    gokurai_context_destroy(fork);
+    gokurai_snapshot_destroy(snapshot);
+    gokurai_context_destroy(ctx);
+    gokurai_result_destroy(result);
+}
+
+ix_TEST_CASE("gokurai: profile")
+{
+    const ix_FileHandle null = ix_FileHandle::null();
+    GokuraiContext ctx = gokurai_context_create(nullptr, &null);
+    GokuraiResult result = gokurai_result_create();
+
+#if gokurai_PROFILE
+    ix_EXPECT(gokurai_context_set_profile_enabled(ctx, true));
+    gokurai_context_feed_str(ctx, "#+MACRO one 1\n"
+                                  "#+MACRO pair <$1|$2>\n"
+                                  "#+MACRO_BEGIN block\n"
+                                  "a\n"
+                                  "b\n"
+                                  "#+MACRO_END\n"
+                                  "[[[pair([[[one]]],^[[[one]]])]]] [[[undefined]]] [[[__INPUT_LINE_NUMBER__]]]\n"
+                                  "[[[block]]]\n"
+                                  "[[[__LUA__(gokurai.macro('lua', function() return 'xyz' end))]]]\n"
+                                  "[[[__LUA__(1)]]] [[[lua]]] [[[__LUA__(22)]]]\n");
+    gokurai_context_end_input(ctx, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "<1|1>  7\n"
+                                                       "a\n"
+                                                       "b\n"
+                                                       "\n"
+                                                       "1 xyz 22\n");
+
+    ix_TempFileW report;
+    ix_EXPECT(gokurai_context_write_profile(ctx, &report.file_handle(), true));
+    report.close();
+    // The lazy call is a part of the output of `pair`. Undefined macros are not listed. Fragments are listed by line.
+    const char *entries[] = {
+        "{\"name\": \"one\", \"kind\": \"macro\", \"calls\": 2, \"bytes\": 2, ",
+        "{\"name\": \"pair\", \"kind\": \"macro\", \"calls\": 1, \"bytes\": 14, ",
+        "{\"name\": \"block\", \"kind\": \"macro\", \"calls\": 1, \"bytes\": 3, ",
+        "{\"name\": \"__INPUT_LINE_NUMBER__\", \"kind\": \"builtin\", \"calls\": 1, \"bytes\": 1, ",
+        "{\"name\": \"__LUA__:9\", \"kind\": \"lua\", \"calls\": 1, \"bytes\": 0, ",
+        "{\"name\": \"__LUA__:10\", \"kind\": \"lua\", \"calls\": 2, \"bytes\": 3, ",
+        "{\"name\": \"lua\", \"kind\": \"lua macro\", \"calls\": 1, \"bytes\": 3, ",
+    };
+    for (const char *entry : entries)
+    {
+        ix_EXPECT(ix_strstr(report.data(), entry) != nullptr);
+    }
+    ix_EXPECT(ix_strstr(report.data(), "undefined") == nullptr);
+
+    // Clearing the context drops the counts and disables profiling.
+    gokurai_context_clear(ctx);
+    gokurai_context_feed_str(ctx, "#+MACRO one 1\n"
+                                  "[[[one]]]\n");
+    gokurai_context_end_input(ctx, result);
+    ix_TempFileW empty_report;
+    ix_EXPECT(gokurai_context_write_profile(ctx, &empty_report.file_handle(), false));
+    empty_report.close();
+    ix_EXPECT_EQSTR(empty_report.data(), "       calls          bytes           ms  kind       name\n"
+                                         "           0              0        0.000  total     \n");
+#else
+    ix_EXPECT(!gokurai_context_set_profile_enabled(ctx, true));
+    ix_EXPECT(!gokurai_context_write_profile(ctx, &null, false));
+#endif
+
+    gokurai_context_destroy(ctx);
+    gokurai_result_destroy(result);
+}
+
+ix_TEST_CASE("gokurai: trace")
+{
+    const ix_FileHandle null = ix_FileHandle::null();
+    GokuraiContext ctx = gokurai_context_create(nullptr, &null);
+    GokuraiResult result = gokurai_result_create();
+    ix_TempFileW trace;
+
+#if gokurai_TRACE
+    ix_EXPECT(gokurai_context_set_trace_handle(ctx, &trace.file_handle()));
+    gokurai_context_feed_str(ctx, "#+MACRO_BEGIN block\n"
+                                  "[[[__LUA__(1)]]]\n"
+                                  "#+MACRO_END\n"
+                                  "[[[block]]] ^[[[block]]]\n");
+    gokurai_context_end_input(ctx, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "1 1\n");
+    ix_EXPECT(gokurai_context_set_trace_handle(ctx, nullptr));
+
+    // Nothing is written once the trace has ended.
+    gokurai_context_feed_str(ctx, "[[[__LUA__(2)]]]\n");
+    gokurai_context_end_input(ctx, result);
+    trace.close();
+
+    const char *data = trace.data();
+    const size_t length = ix_strlen(data);
+    ix_EXPECT(ix_strstr(data, "[\n{\"name\": \"load line\", \"cat\": \"gokurai\", \"ph\": \"X\", \"ts\": ") == data);
+    ix_EXPECT_EQSTR(data + length - ix_strlen("}}\n]\n"), "}}\n]\n");
+    const char *spans[] = {
+        "{\"name\": \"directive\", ",   "{\"name\": \"read block macro\", ", "{\"name\": \"expand\", ",
+        "{\"name\": \"expand lazy\", ", "{\"name\": \"lua compile\", ",      "{\"name\": \"lua run\", ",
+    };
+    for (const char *span : spans)
+    {
+        ix_EXPECT(ix_strstr(data, span) != nullptr);
+    }
+    ix_EXPECT(ix_strstr(data, "\"args\": {\"line\": 4}}") != nullptr);
+    ix_EXPECT(ix_strstr(data, "\"args\": {\"line\": 5}}") == nullptr);
+#else
+    ix_EXPECT(!gokurai_context_set_trace_handle(ctx, &trace.file_handle()));
+#endif
+
+    gokurai_context_destroy(ctx);
+    gokurai_result_destroy(result);
+}
+
+ix_TEST_CASE("gokurai: macro cache")
+{
+    // Calls in a definition are expanded when it is read, so the bodies below call other macros lazily.
+    const char *input = "#+MACRO a A\n"
+                        "#+MACRO b <^[[[a]]]>\n"
+                        "#+MACRO c ^[[[b]]]^[[[b]]]\n"
+                        "[[[c]]] [[[b]]]\n"
+                        "#+MACRO a Z\n"
+                        "[[[c]]]\n"
+                        "#+LOCAL_MACRO a L\n"
+                        "[[[c]]]\n"
+                        "[[[c]]]\n"
+                        "#+MACRO n <^[[[__INPUT_LINE_NUMBER__]]]>\n"
+                        "#+MACRO m ^[[[n]]]^[[[n]]]\n"
+                        "[[[m]]]\n"
+                        "[[[m]]]\n"
+                        "#+MACRO brackets '[[[x']]]\n"
+                        "#+MACRO q <^[[[brackets]]]>\n"
+                        "#+MACRO r ^[[[q]]]\n"
+                        "[[[r]]] [[[r]]]\n";
+    const char *expected = "<A><A> <A>\n"
+                           "<Z><Z>\n"
+                           "<L><L>\n"
+                           "<Z><Z>\n"
+                           "<12><12>\n"
+                           "<13><13>\n"
+                           "<[[[x]]]> <[[[x]]]>\n";
+
+    GokuraiContext ctx = gokurai_context_create(nullptr, &ix_FileHandle::of_stderr());
+    GokuraiResult result = gokurai_result_create();
+
+    gokurai_context_feed_str(ctx, input);
+    gokurai_context_end_input(ctx, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), expected);
+    ix_EXPECT(gokurai_context_get_macro_cache_hits(ctx) > 0);
+
+    gokurai_context_clear(ctx);
+    ix_EXPECT(gokurai_context_get_macro_cache_hits(ctx) == 0);
+    ix_EXPECT(gokurai_context_get_macro_cache_misses(ctx) == 0);
+    gokurai_context_feed_str(ctx, "#+MACRO a A\n"
+                                  "#+MACRO b <^[[[a]]]>\n"
+                                  "#+MACRO c ^[[[b]]]^[[[b]]]\n"
+                                  "[[[c]]]\n");
+    gokurai_context_end_input(ctx, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "<A><A>\n");
+    ix_EXPECT(gokurai_context_get_macro_cache_hits(ctx) == 1);
+
+    gokurai_context_clear(ctx);
+    gokurai_context_set_macro_cache_enabled(ctx, false);
+    gokurai_context_feed_str(ctx, input);
+    gokurai_context_end_input(ctx, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), expected);
+    ix_EXPECT(gokurai_context_get_macro_cache_hits(ctx) == 0);
+    ix_EXPECT(gokurai_context_get_macro_cache_misses(ctx) == 0);
+
+    gokurai_context_destroy(ctx);
+    gokurai_result_destroy(result);
+}
+
+ix_BENCHMARK_CASE("gokurai: many calls in arguments")
+{
+    ix_Buffer input(1024 * 1024);
+    input.push_str("#+MACRO c C\n"
+                   "#+MACRO row <$0>\n");
+    for (size_t line = 0; line < 64; line++)
+    {
+        input.push_str("[[[row(");
+        for (size_t call = 0; call < 500; call++)
+        {
+            input.push_str("[[[c]]],");
+        }
+        input.push_str(")]]]\n");
+    }
+
+    volatile size_t sink = 0;
+    ix_Clock clock;
+    clock.benchmark(
+        "gokurai: 64 lines x 500 calls in arguments",
+        [&]() {
+            const GokuraiResultImpl result = gokurai(input.data(), input.size(), nullptr, nullptr);
+            sink = result.size();
+        },
+        ix_Clock::BenchmarkOption(), &ix_FileHandle::of_stdout());
+
+    ix_UNUSED(sink);
+}
+
+ix_BENCHMARK_CASE("gokurai: long lines")
+{
+    // Generated translation sources have lines of several KB with dozens of calls each.
+    ix_Buffer input(1024 * 1024);
+    input.push_str("#+MACRO foo FOO\n"
+                   "#+MACRO bar <$1|$2>\n");
+    for (size_t line = 0; line < 256; line++)
+    {
+        for (size_t call = 0; call < 48; call++)
+        {
+            input.push_char_repeat('x', 128);
+            input.push_str(((call % 2) == 0) ? "[[[foo]]]" : "[[[bar(a,b)]]]");
+        }
+        input.push_char('\n');
+    }
+
+    const char *line_start = ix_memnext(ix_memnext(input.data(), '\n') + 1, '\n') + 1;
+    const size_t line_length = static_cast<size_t>(ix_memnext(line_start, '\n') - line_start);
+    volatile size_t sink = 0;
+
+    ix_Clock clock;
+    const ix_FileHandle &out = ix_FileHandle::of_stdout();
+    ix_Clock::BenchmarkOption option;
+    option.num_iterations = 0; // A scan takes microseconds, so time many of them per trial.
+
+    clock.benchmark(
+        "backward bracket scan of a long line (byte by byte)",
+        [&]() {
+            size_t num_brackets = 0;
+            const char *p = line_start + line_length - 1;
+            while (line_start <= p)
+            {
+                if ((*p != '[') && (*p != ']'))
+                {
+                    p -= 1;
+                    continue;
+                }
+                num_brackets += 1;
+                p -= 1;
+            }
+            sink = num_brackets;
+        },
+        option, &out);
+
+    clock.benchmark(
+        "backward bracket scan of a long line (ix_memrchr2)",
+        [&]() {
+            size_t num_brackets = 0;
+            size_t length = line_length;
+            const char *found = ix_memrchr2(line_start, '[', ']', length);
+            while (found != nullptr)
+            {
+                num_brackets += 1;
+                length = static_cast<size_t>(found - line_start);
+                found = ix_memrchr2(line_start, '[', ']', length);
+            }
+            sink = num_brackets;
+        },
+        option, &out);
+
+    option.num_iterations = 1;
+    clock.benchmark(
+        "gokurai: 256 lines x 48 calls",
+        [&]() {
+            const GokuraiResultImpl result = gokurai(input.data(), input.size(), nullptr, nullptr);
+            sink = result.size();
+        },
+        option, &out);
+
+    ix_UNUSED(sink);
+}
+
+ix_BENCHMARK_CASE("gokurai: dense short calls")
+{
+    // Lines packed with short calls, where the special characters are only a few bytes apart.
+    ix_Buffer lazy_input(1024 * 1024);
+    ix_Buffer input(1024 * 1024);
+    lazy_input.push_str("#+MACRO a A\n");
+    input.push_str("#+MACRO a A\n");
+    for (size_t line = 0; line < 1000; line++)
+    {
+        for (size_t call = 0; call < 100; call++)
+        {
+            lazy_input.push_str("^[[[a]]] ");
+            input.push_str("[[[a]]] ");
+        }
+        lazy_input.push_char('\n');
+        input.push_char('\n');
+    }
+
+    volatile size_t sink = 0;
+    ix_Clock clock;
+    const ix_FileHandle &out = ix_FileHandle::of_stdout();
+    const ix_Clock::BenchmarkOption option;
+
+    clock.benchmark(
+        "gokurai: 1000 lines x 100 lazy calls",
+        [&]() {
+            const GokuraiResultImpl result = gokurai(lazy_input.data(), lazy_input.size(), nullptr, nullptr);
+            sink = result.size();
+        },
+        option, &out);
+
+    clock.benchmark(
+        "gokurai: 1000 lines x 100 short calls",
+        [&]() {
+            const GokuraiResultImpl result = gokurai(input.data(), input.size(), nullptr, nullptr);
+            sink = result.size();
+        },
+        option, &out);
+
+    ix_UNUSED(sink);
+}
+
+ix_TEST_CASE("gokurai: input fed in chunks")
+{
+    const char *inputs[] = {
+        "hello\nworld",
+        "#+MACRO foo FOO\n[[[foo]]] [[[foo]]]\n",
+        "#+MACRO_BEGIN foo\nFOO\n#+MACRO_BEGIN bar\nBAR\n#+MACRO_END\n[[[bar]]]\n#+MACRO_END\n[[[foo]]]\n[[[bar]]]",
+        "foo[[[__NO_NEWLINE__]]]\nbar[[[__NO_NEWLINE__]]]\n[[[__INPUT_LINE_NUMBER__]]]\n",
+        "#+LOCAL_MACRO foo L\n[[[foo]]][[[__NO_NEWLINE__]]]\n[[[foo]]]\n[[[foo]]]\n",
+        "#+LOCAL_MACRO foo L\n#+LOCAL_MACRO_BEGIN bar\n<[[[foo]]]>\n#+LOCAL_MACRO_END\n[[[bar]]][[[foo]]]\n",
+        "#+COMMENT_BEGIN\n[[[__LUA__(1)]]]\n#+COMMENT_END\n[[[__LUA__(2)]]]\n",
+        "[[[__LUA__((function() n = (n or 0) + 1 return n end)())]]][[[__NO_NEWLINE__]]]\n"
+        "#+LUA_BEGIN\nn = n + 1\nreturn n\n#+LUA_END\n[[[__LUA__(n)]]]\n",
+        "#+MACRO_BEGIN foo\nunterminated\n",
+        "#+MACRO NL ^[[[__NO_NEWLINE__]]]\n#+MACRO_BEGIN m\na[[[NL]]]\nb\n#+MACRO_END\n[[[m]]]\nc\n",
+    };
+
+    const size_t chunk_sizes[] = {1, 2, 3, 7, 64};
+    for (const char *input : inputs)
+    {
+        const GokuraiResultImpl expected = gokurai_str(input);
+        const size_t input_length = ix_strlen(input);
+        for (const size_t chunk_size : chunk_sizes)
+        {
+            GokuraiContextImpl ctx(nullptr, &ix_FileHandle::of_stderr());
+            for (size_t i = 0; i < input_length; i += chunk_size)
+            {
+                ctx.feed_input(input + i, ix_min(chunk_size, input_length - i));
+            }
+            GokuraiResultImpl result;
+            ctx.end_input(&result);
+            ix_EXPECT(result.size() == expected.size());
+            ix_EXPECT_EQSTR(result.data().get(), expected.data().get());
+        }
+    }
+}
+
+ix_TEST_CASE("gokurai: context reused for another output handle")
+{
+    ix_TempFileW out_a;
+    ix_TempFileW out_b;
+    GokuraiContext ctx = gokurai_context_create(&out_a.file_handle(), nullptr);
+
+    gokurai_context_feed_str(ctx, "#+MACRO foo FOO\n[[[foo]]] a\n");
+    gokurai_context_end_input(ctx, nullptr);
+
+    gokurai_context_clear(ctx);
+    gokurai_context_set_output_handle(ctx, &out_b.file_handle());
+    gokurai_context_feed_str(ctx, "[[[foo]]] b\n[[[__LUA__(1 + 1)]]]\n");
+    gokurai_context_end_input(ctx, nullptr);
+
+    gokurai_context_clear(ctx);
+    gokurai_context_set_output_handle(ctx, nullptr);
+    gokurai_context_feed_str(ctx, "c\n");
+    GokuraiResult result = gokurai_result_create();
+    gokurai_context_end_input(ctx, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "c\n");
+    gokurai_result_destroy(result);
+
+    gokurai_context_destroy(ctx);
+    ix_EXPECT_EQSTR(out_a.data(), "FOO a\n");
+    ix_EXPECT_EQSTR(out_b.data(), " b\n2\n"); // `foo` is gone with the clear.
+}
+
+ix_TEST_CASE("gokurai: prelude")
+{
+    const char *preludes[] = {
+        "#+MACRO foo FOO\n"
+        "#+MACRO bar <$1>\n",
+        "#+LUA_BEGIN\n"
+        "function twice(x) return x .. x end\n"
+        "n = 0\n"
+        "#+LUA_END\n"
+        "#+MACRO_BEGIN block\n"
+        "[[[__LUA__(twice('$1'))]]]\n"
+        "#+MACRO_END\n",
+        "header [[[__INPUT_LINE_NUMBER__]]]\n"
+        "#+LOCAL_MACRO foo local\n",
+        "#+MACRO foo [[[__LUA__(n = (n or 0) + 1; return n)]]]\n",
+        "#+MACRO lazy ^[[[foo]]]\n"
+        "[[[__DISABLE_LUA__]]]\n",
+        // The history sees the macros as they were when it ran, not as the prelude left them.
+        "#+LUA_BEGIN\n"
+        "before = gokurai.get('foo') or 'nil'\n"
+        "gokurai.define('foo', 'F1')\n"
+        "seen = gokurai.get('foo')\n"
+        "gokurai.macro('m', function(x) return '<' .. x .. '>' end)\n"
+        "m = gokurai.get('m')\n"
+        "gokurai.macro('count', function(x) calls = (calls or '') .. x .. (gokurai.get('foo') or '-'); return '' end)\n"
+        "#+LUA_END\n"
+        "#+MACRO foo F2\n"
+        "[[[count(a\"\\)]]][[[count(b)]]]\n"
+        "#+LUA_BEGIN\n"
+        "ok = tostring(gokurai.undefine('foo')) .. tostring(gokurai.undefine('foo'))\n"
+        "ok = ok .. tostring(gokurai.undefine('m'))\n"
+        "#+LUA_END\n"
+        "[[[count(c)]]]\n",
+    };
+    const char *inputs[] = {
+        "[[[foo]]] [[[bar(x)]]] [[[lazy]]]\n",
+        "[[[__LUA__(tostring(before) .. tostring(seen) .. tostring(ok) .. (m and m('y') or ''))]]] [[[foo]]]\n"
+        "[[[__LUA__(tostring(calls))]]]\n",
+        "[[[block(ab)]]]\n"
+        "[[[__LUA__(twice('c'))]]]\n",
+        "#+MACRO foo redefined\n"
+        "[[[foo]]][[[foo]]] [[[__OUTPUT_LINE_NUMBER__]]]\n",
+        "[[[__LUA__(n)]]] [[[foo]]]",
+    };
+
+    for (const char *prelude_input : preludes)
+    {
+        GokuraiContext prelude_ctx = gokurai_context_create(nullptr, nullptr);
+        GokuraiResult prelude_output = gokurai_result_create();
+        gokurai_context_set_lua_history_enabled(prelude_ctx, true);
+        gokurai_context_feed_str(prelude_ctx, prelude_input);
+        gokurai_context_end_input(prelude_ctx, prelude_output);
+        gokurai_context_set_lua_history_enabled(prelude_ctx, false); // Only the prelude's own Lua code is run again.
+        GokuraiSnapshot snapshot = gokurai_context_snapshot(prelude_ctx);
+        gokurai_context_destroy(prelude_ctx);
+
+        GokuraiResult result = gokurai_result_create();
+        for (const char *input : inputs)
+        {
+            ix_Buffer concatenated(256);
+            concatenated.push_str(prelude_input);
+            concatenated.push_str(input);
+            concatenated.push_char('\0');
+            const GokuraiResultImpl expected = gokurai_str(concatenated.data());
+
+            for (size_t round = 0; round < 2; round++) // The snapshot is not changed by its forks.
+            {
+                GokuraiContext ctx = gokurai_context_fork(snapshot, nullptr, nullptr);
+                gokurai_context_feed_str(ctx, input);
+                gokurai_context_end_input(ctx, result);
+                ix_Buffer actual(256);
+                actual.push_str(gokurai_result_get_output(prelude_output));
+                actual.push_str(gokurai_result_get_output(result));
+                actual.push_char('\0');
+                ix_EXPECT_EQSTR(actual.data(), expected.data().get());
+                gokurai_context_destroy(ctx);
+            }
+        }
+        gokurai_result_destroy(result);
+        gokurai_result_destroy(prelude_output);
+        gokurai_snapshot_destroy(snapshot);
+    }
+}
+
+ix_TEST_CASE("gokurai: snapshot and fork")
+{
+    const char *first = "#+LUA_BEGIN\n"
+                        "function twice(x) return x .. x end\n"
+                        "n = 0\n"
+                        "#+LUA_END\n"
+                        "#+MACRO foo [[[__LUA__(n = n + 1; return n)]]]\n"
+                        "#+MACRO bar <$1>\n"
+                        "#+LOCAL_MACRO baz local\n";
+    const char *second = "#+MACRO qux [[[__LUA__(twice('q'))]]]\n"
+                         "#+LUA_BEGIN\n"
+                         "n = 10\n"
+                         "#+LUA_END\n";
+    const char *input = "[[[foo]]] [[[bar(x)]]] [[[baz]]] [[[__INPUT_LINE_NUMBER__]]] [[[__OUTPUT_LINE_NUMBER__]]]\n";
+    const char *input_after_second = "[[[foo]]] [[[qux]]] [[[__INPUT_LINE_NUMBER__]]]\n";
+
+    const auto concatenated_output = [](const char *a, const char *b, const char *c, const char *d) {
+        ix_Buffer buffer(256);
+        buffer.push_str(a);
+        buffer.push_str(b);
+        buffer.push_str(c);
+        buffer.push_str(d);
+        buffer.push_char('\0');
+        return gokurai_str(buffer.data());
+    };
+
+    GokuraiResult result = gokurai_result_create();
+    GokuraiContext ctx = gokurai_context_create(nullptr, nullptr);
+    gokurai_context_set_lua_history_enabled(ctx, true);
+    gokurai_context_feed_str(ctx, first);
+    gokurai_context_end_input(ctx, result);
+    GokuraiSnapshot snapshot = gokurai_context_snapshot(ctx);
+
+    // The outputs of the context before the snapshot are not repeated by the forks.
+    const GokuraiResultImpl first_output = gokurai_str(first);
+    const GokuraiResultImpl expected = concatenated_output(first, input, "", "");
+    const char *expected_tail = expected.data().get() + first_output.size();
+
+    GokuraiContext forks[3];
+    for (GokuraiContext &fork : forks)
+    {
+        fork = gokurai_context_fork(snapshot, nullptr, nullptr);
+    }
+
+    // The context goes on after the snapshot without affecting it.
+    gokurai_context_feed_str(ctx, "#+MACRO foo changed\n#+LUA_BEGIN\nn = 100\n#+LUA_END\n");
+    gokurai_context_end_input(ctx, result);
+    gokurai_context_feed_str(ctx, "[[[foo]]] [[[bar(y)]]]\n");
+    gokurai_context_end_input(ctx, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "changed <y>\n");
+
+    gokurai_snapshot_destroy(snapshot); // The forks keep what they share with it.
+    gokurai_context_destroy(ctx);
+
+    for (GokuraiContext fork : forks)
+    {
+        gokurai_context_feed_str(fork, input);
+        gokurai_context_end_input(fork, result);
+        ix_EXPECT_EQSTR(gokurai_result_get_output(result), expected_tail);
+    }
+
+    // A fork of a fork.
+    gokurai_context_feed_str(forks[0], second);
+    gokurai_context_end_input(forks[0], result);
+    GokuraiSnapshot nested_snapshot = gokurai_context_snapshot(forks[0]);
+    GokuraiContext nested_fork = gokurai_context_fork(nested_snapshot, nullptr, nullptr);
+    gokurai_snapshot_destroy(nested_snapshot);
+    for (GokuraiContext fork : forks)
+    {
+        gokurai_context_destroy(fork);
+    }
+
+    const GokuraiResultImpl nested_expected = concatenated_output(first, input, second, input_after_second);
+    const GokuraiResultImpl nested_head = concatenated_output(first, input, second, "");
+    gokurai_context_feed_str(nested_fork, input_after_second);
+    gokurai_context_end_input(nested_fork, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), nested_expected.data().get() + nested_head.size());
+
+    gokurai_context_destroy(nested_fork);
+    gokurai_result_destroy(result);
+}
+
+ix_TEST_CASE("gokurai: library")
+{
+    const char *prelude = "#+LUA_BEGIN\n"
+                          "function twice(x) return x .. x end\n"
+                          "before = gokurai.get('foo') or 'nil'\n"
+                          "#+LUA_END\n"
+                          "#+MACRO foo FOO\n"
+                          "#+LUA_BEGIN\n"
+                          "gokurai.define('tmp', 'T')\n"
+                          "seen = gokurai.get('foo') .. gokurai.get('tmp') .. tostring(gokurai.undefine('tmp'))\n"
+                          "gokurai.macro('note', function(x) notes = (notes or '') .. x .. gokurai.get('foo') end)\n"
+                          "#+LUA_END\n"
+                          "[[[note(1)]]]\n"
+                          "#+MACRO bar <$1|$2>\n"
+                          "#+MACRO lazy ^[[[foo]]]\n"
+                          "#+MACRO cached ^[[[lazy]]]-[[[bar(a,b)]]]\n"
+                          "#+MACRO_BEGIN block\n"
+                          "$1 [[[__LUA__(twice('$1'))]]]\n"
+                          "second $0\n"
+                          "#+MACRO_END\n";
+    const char *inputs[] = {
+        "[[[foo]]] [[[bar(x,y)]]] [[[lazy]]] [[[cached]]] [[[cached]]]\n",
+        "[[[block(ab)]]]\n",
+        "#+MACRO foo redefined\n"
+        "[[[foo]]] [[[lazy]]] [[[cached]]]\n",
+        "[[[unknown]]]x",
+        "[[[__LUA__(before .. seen .. notes)]]] [[[tmp]]]\n", // As the history saw the macros when it was recorded.
+        "#+MACRO foo again\n"
+        "[[[note(2)]]] [[[__LUA__(notes)]]]\n",
+    };
+
+    GokuraiResult result = gokurai_result_create();
+    GokuraiContext ctx = gokurai_context_create(nullptr, nullptr);
+    gokurai_context_set_lua_history_enabled(ctx, true);
+    gokurai_context_feed_str(ctx, prelude);
+    gokurai_context_end_input(ctx, result);
+    ix_TempFileW library_file;
+    ix_EXPECT(gokurai_context_save_library(ctx, &library_file.file_handle()));
+    library_file.close();
+    gokurai_context_destroy(ctx);
+
+    const ix_FileHandle library_handle(library_file.filename(), ix_READ_ONLY);
+    GokuraiLibrary library = gokurai_library_load(&library_handle);
+    ix_ASSERT_FATAL(library != nullptr);
+
+    // The library is used as the prelude would be, except for line numbers.
+    const GokuraiResultImpl prelude_output = gokurai_str(prelude);
+    ctx = gokurai_context_create(nullptr, nullptr);
+    for (const char *input : inputs)
+    {
+        ix_Buffer concatenated(256);
+        concatenated.push_str(prelude);
+        concatenated.push_str(input);
+        concatenated.push_char('\0');
+        const GokuraiResultImpl expected = gokurai_str(concatenated.data());
+
+        for (size_t round = 0; round < 2; round++)
+        {
+            gokurai_context_clear(ctx);
+            gokurai_context_use_library(ctx, library);
+            gokurai_context_feed_str(ctx, input);
+            gokurai_context_end_input(ctx, result);
+            ix_EXPECT_EQSTR(gokurai_result_get_output(result), expected.data().get() + prelude_output.size());
+        }
+    }
+
+    // A context using a library saves the macros of the library along with its own.
+    gokurai_context_clear(ctx);
+    gokurai_context_use_library(ctx, library);
+    gokurai_context_feed_str(ctx, "#+MACRO extra E\n#+MACRO bar [$1]\n[[[foo]]]\n");
+    gokurai_context_end_input(ctx, result);
+    ix_TempFileW extended_library_file;
+    ix_EXPECT(gokurai_context_save_library(ctx, &extended_library_file.file_handle()));
+    extended_library_file.close();
+    gokurai_library_destroy(library);
+
+    const ix_FileHandle extended_library_handle(extended_library_file.filename(), ix_READ_ONLY);
+    library = gokurai_library_load(&extended_library_handle);
+    ix_ASSERT_FATAL(library != nullptr);
+    gokurai_context_clear(ctx);
+    gokurai_context_use_library(ctx, library);
+    gokurai_context_feed_str(ctx, "[[[extra]]] [[[bar(x)]]] [[[cached]]] [[[block(z)]]]\n");
+    gokurai_context_end_input(ctx, result);
+    ix_EXPECT_EQSTR(gokurai_result_get_output(result), "E [x] FOO-<a|b> z zz\nsecond z\n");
+    gokurai_context_destroy(ctx);
+    gokurai_library_destroy(library);
+
+    // Anything that is not a library is rejected, and a broken one is never read out of bounds.
+    {
+        const ix_TempFileR not_library("#+MACRO foo FOO\n");
+        ix_EXPECT(gokurai_library_load(&not_library.file_handle()) == nullptr);
+    }
+
+    size_t library_size = 0;
+    ix_UniquePointer<char[]> library_data = ix_load_file(library_file.filename(), &library_size);
+    {
+        const ix_TempFileR truncated(library_data.get(), library_size - 1);
+        ix_EXPECT(gokurai_library_load(&truncated.file_handle()) == nullptr);
+    }
+
+    for (size_t i = 0; i < library_size; i++)
+    {
+        library_data[i] = static_cast<char>(library_data[i] ^ 0x5a);
+        const ix_TempFileR broken(library_data.get(), library_size);
+        library = gokurai_library_load(&broken.file_handle());
+        if (library != nullptr)
+        {
+            ctx = gokurai_context_create(nullptr, nullptr);
+            gokurai_context_use_library(ctx, library);
+            gokurai_context_feed_str(ctx, inputs[0]);
+            gokurai_context_feed_str(ctx, inputs[1]);
+            gokurai_context_end_input(ctx, result);
+            gokurai_context_destroy(ctx);
+            gokurai_library_destroy(library);
+        }
+        library_data[i] = static_cast<char>(library_data[i] ^ 0x5a);
+    }
+
+    gokurai_result_destroy(result);
+}
+
+ix_TEST_CASE("gokurai: output to a file handle does not grow with the input")
+{
+    if (!ix_reset_peak_resident_set_size() || ix_is_valgrind_active())
+    {
+        return;
+    }
+
+    const ix_FileHandle null_handle = ix_FileHandle::null();
+    const size_t input_sizes[] = {2 * 1024 * 1024, 16 * 1024 * 1024};
+    for (const size_t input_size : input_sizes)
+    {
+        ix_Buffer input(input_size + 64);
+        input.push_str("#+MACRO foo FOO\n");
+        while (input.size() < input_size)
+        {
+            input.push_str("hello [[[foo]]] world\n");
+        }
+
+        ix_reset_peak_resident_set_size();
+        const size_t peak_before = ix_peak_resident_set_size();
+        {
+            GokuraiContextImpl ctx(&null_handle, nullptr);
+            ctx.feed_input(input.data(), input.size());
+            ctx.end_input(nullptr);
+        }
+        const size_t peak_after = ix_peak_resident_set_size();
+        ix_EXPECT(peak_after - peak_before < 1024 * 1024);
+    }
+}
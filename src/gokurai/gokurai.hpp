@@ -8,9 +8,22 @@
 #define EMSCRIPTEN_KEEPALIVE
 #endif
 
+// The macro profiler (`gokurai_context_set_profile_enabled()`) costs a branch per call even when it is disabled, so
+// builds that never profile may leave it out.
+#if !defined(gokurai_PROFILE)
+#define gokurai_PROFILE 1
+#endif
+
+// So does the tracer (`gokurai_context_set_trace_handle()`).
+#if !defined(gokurai_TRACE)
+#define gokurai_TRACE 1
+#endif
+
 class ix_FileHandle;
 using GokuraiContext = void *;
 using GokuraiResult = void *;
+using GokuraiSnapshot = void *;
+using GokuraiLibrary = void *;
 
 extern "C"
 {
@@ -18,10 +31,79 @@ EMSCRIPTEN_KEEPALIVE GokuraiContext gokurai_context_create(const ix_FileHandle *
                                                            const ix_FileHandle *err_handle);
 EMSCRIPTEN_KEEPALIVE void gokurai_context_clear(GokuraiContext ctx);
 EMSCRIPTEN_KEEPALIVE void gokurai_context_destroy(GokuraiContext ctx);
+// Input may be fed in chunks of any size. Lines and blocks may span chunks. `end_input()` processes the rest.
 EMSCRIPTEN_KEEPALIVE void gokurai_context_feed_input(GokuraiContext ctx, const char *input, size_t input_length);
 EMSCRIPTEN_KEEPALIVE void gokurai_context_feed_str(GokuraiContext ctx, const char *str);
 EMSCRIPTEN_KEEPALIVE void gokurai_context_end_input(GokuraiContext ctx, GokuraiResult result);
 
+// Redirects the output, e.g. to reuse a context for another document after `gokurai_context_clear()`.
+// `nullptr` keeps the output in memory for `gokurai_context_end_input()` to return.
+EMSCRIPTEN_KEEPALIVE void gokurai_context_set_output_handle(GokuraiContext ctx, const ix_FileHandle *out_handle);
+
+// Captures the macros and line numbers of a context between inputs (i.e. after `gokurai_context_end_input()`).
+// A fork continues from there with its own output and Lua state. The strings of the macros are not copied: the
+// context, the snapshot and the forks share them, and they are freed once all of them are destroyed or cleared.
+// Lua globals cannot be shared, so a fork runs again the Lua code that the context ran with Lua history enabled:
+// `__LUA__` fragments, Lua blocks and calls of Lua macros. `gokurai.get()` and `gokurai.undefine()` return to that code
+// what they returned when it first ran, not what the macros say at the snapshot. A fork thus processes an input as the
+// context would have, provided that all the Lua code of the context ran with the history enabled and does the same
+// when run again (e.g. reads no clock, file or random numbers). Forks may be made from several threads at once.
+// To share a prelude among documents, feed it to a context with Lua history enabled, disable the history and take a
+// snapshot, then fork a context for each document. The output of the prelude is not in the snapshot.
+EMSCRIPTEN_KEEPALIVE GokuraiSnapshot gokurai_context_snapshot(GokuraiContext ctx);
+EMSCRIPTEN_KEEPALIVE GokuraiContext gokurai_context_fork(GokuraiSnapshot snapshot, const ix_FileHandle *out_handle,
+                                                         const ix_FileHandle *err_handle);
+EMSCRIPTEN_KEEPALIVE void gokurai_snapshot_destroy(GokuraiSnapshot snapshot);
+EMSCRIPTEN_KEEPALIVE void gokurai_context_set_lua_history_enabled(GokuraiContext ctx, bool enabled);
+
+// Output to a file handle is flushed whenever this many bytes are buffered (64 KiB by default).
+EMSCRIPTEN_KEEPALIVE void gokurai_context_set_output_high_water_mark(GokuraiContext ctx, size_t size);
+
+// Lazy expansions of constant global macros are cached by default.
+EMSCRIPTEN_KEEPALIVE void gokurai_context_set_macro_cache_enabled(GokuraiContext ctx, bool enabled);
+EMSCRIPTEN_KEEPALIVE uint64_t gokurai_context_get_macro_cache_hits(GokuraiContext ctx);
+EMSCRIPTEN_KEEPALIVE uint64_t gokurai_context_get_macro_cache_misses(GokuraiContext ctx);
+
+// Lua fragments and blocks are compiled once per context for each distinct text.
+EMSCRIPTEN_KEEPALIVE uint64_t gokurai_context_get_lua_chunk_cache_hits(GokuraiContext ctx);
+EMSCRIPTEN_KEEPALIVE uint64_t gokurai_context_get_lua_chunk_cache_misses(GokuraiContext ctx);
+
+// The bytes held by the Lua state of the context, and the most held since it was created or last cleared.
+EMSCRIPTEN_KEEPALIVE size_t gokurai_context_get_lua_heap_size(GokuraiContext ctx);
+EMSCRIPTEN_KEEPALIVE size_t gokurai_context_get_lua_peak_heap_size(GokuraiContext ctx);
+
+// Limits the VM instructions and the seconds of each run of Lua code (a fragment, a block or a call of a Lua macro),
+// and the bytes of the Lua heap. Code over a limit fails with an error as if it raised one. Zero means no limit, which
+// is the default. Clearing the context removes the limits.
+EMSCRIPTEN_KEEPALIVE void gokurai_context_set_lua_limits(GokuraiContext ctx, uint64_t instruction_limit,
+                                                         double time_limit_sec, size_t heap_limit);
+
+// Writes Chrome trace events (JSON) to `file` for spans of work: line loads, directives, expansion passes, block macro
+// definitions, Lua compiles and runs, and output flushes, each with its input line number. Open it in Perfetto.
+// `nullptr` ends the trace, as do clearing and destroying the context. The file must stay open until then.
+// Returns false if the tracer was compiled out (gokurai_TRACE=0).
+EMSCRIPTEN_KEEPALIVE bool gokurai_context_set_trace_handle(GokuraiContext ctx, const ix_FileHandle *file);
+
+// Counts the calls, output bytes and time of each macro, builtin and `__LUA__` fragment (by input line) expanded while
+// profiling is enabled. The report lists the slowest first, as a table or as JSON. Clearing the context disables
+// profiling and drops what was counted. Both return false if the profiler was compiled out (gokurai_PROFILE=0).
+EMSCRIPTEN_KEEPALIVE bool gokurai_context_set_profile_enabled(GokuraiContext ctx, bool enabled);
+EMSCRIPTEN_KEEPALIVE bool gokurai_context_write_profile(GokuraiContext ctx, const ix_FileHandle *file, bool json);
+
+// A library (.gkc) holds the global macros and the Lua history of a context in a binary form that is used in place:
+// loading maps the file and checks its header, and macros are looked up in its on-disk hash index as they are called.
+// Saving is done between inputs, and Lua code is saved only if Lua history was enabled when it ran.
+// Local macros, line numbers and the output are not saved. Returns false if writing fails.
+// A context using a library runs its Lua code again as a fork does (see `gokurai_context_snapshot()`), so the code
+// gets what `gokurai.get()` and `gokurai.undefine()` returned when it was saved.
+EMSCRIPTEN_KEEPALIVE bool gokurai_context_save_library(GokuraiContext ctx, const ix_FileHandle *file);
+// Returns `nullptr` if the file is not a library saved on a machine of the same kind.
+EMSCRIPTEN_KEEPALIVE GokuraiLibrary gokurai_library_load(const ix_FileHandle *file);
+EMSCRIPTEN_KEEPALIVE void gokurai_library_destroy(GokuraiLibrary library);
+// Makes a fresh (or just cleared) context start with the macros of `library`, which must outlive the context.
+// Contexts may use a library from several threads at once.
+EMSCRIPTEN_KEEPALIVE void gokurai_context_use_library(GokuraiContext ctx, GokuraiLibrary library);
+
 EMSCRIPTEN_KEEPALIVE GokuraiResult gokurai_result_create();
 EMSCRIPTEN_KEEPALIVE void gokurai_result_destroy(GokuraiResult result);
 EMSCRIPTEN_KEEPALIVE const char *gokurai_result_get_output(GokuraiResult result);
@@ -0,0 +1,286 @@
+#include "gokurai.hpp"
+
+#include <ix.hpp>
+#include <ix_Buffer.hpp>
+#include <ix_Clock.hpp>
+#include <ix_CmdArgsEater.hpp>
+#include <ix_SystemManager.hpp>
+#include <ix_defer.hpp>
+#include <ix_file.hpp>
+#include <ix_printf.hpp>
+#include <ix_scanf.hpp>
+#include <ix_string.hpp>
+
+#include <stdarg.h>
+
+static constexpr const char *HELP_TEXT = R"(
+gokurai_bench
+
+USAGE:
+  gokurai_bench [OPTIONS] [SCENARIO...]
+
+Runs synthetic documents through the engine and reports the throughput of each scenario (all by default).
+
+OPTIONS:
+  -h, --help: Show help.
+  --size BYTES: Make each document about this large (default: 4194304).
+  --warmups N: Process each document N times before timing it (default: 1).
+  --trials N: Time N runs of each document and report the median (default: 10).
+  --json: Write a line of JSON per scenario to stdout instead of the table.
+
+SCENARIOS:
+  prose, constant, args, nesting, lazy, block, quoted, lua
+
+)";
+
+static constexpr const char *ERROR_TEXT_INVALID_OPTION = "Invalid %s: %s\n";
+static constexpr const char *ERROR_TEXT_UNKNOWN_SCENARIO = "Unknown scenario: %s\n";
+
+static constexpr const char *REPORT_TEXT_HEADER = "%-10s %10s %10s %14s %12s %10s\n";
+static constexpr const char *REPORT_TEXT_SCENARIO = "%-10s %10.3f %10.2f %14.0f %12zu %10zu\n";
+
+static constexpr size_t DEFAULT_DOCUMENT_SIZE = 4 * 1024 * 1024;
+
+// Each document starts with the definitions of its scenario, followed by lines made by `push_line()` until it
+// reaches the requested size. The lines differ only in a counter, so that they are not all the same text.
+struct Scenario
+{
+    const char *name;
+    const char *definitions;
+    void (*push_line)(ix_Buffer &document, size_t i);
+};
+
+ix_PRINTF_FORMAT(2, 3) static void push_stringf(ix_Buffer &document, ix_FORMAT_ARG const char *format, ...)
+{
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    const int length = ix_vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    document.push(line, static_cast<size_t>(length));
+}
+
+// Plain text, which is scanned for calls and copied to the output.
+static void push_prose_line(ix_Buffer &document, size_t i)
+{
+    push_stringf(document,
+                 "Paragraph %zu goes on about nothing in particular, with [brackets] and 'quotes' here and there.\n",
+                 i);
+}
+
+// One-line constant macros, several per line.
+static void push_constant_line(ix_Buffer &document, size_t i)
+{
+    push_stringf(document, "[[[c%zu]]] and [[[c%zu]]], then [[[c%zu]]] or [[[c%zu]]] before [[[c%zu]]].\n", i % 16,
+                 (i + 3) % 16, (i + 7) % 16, (i + 11) % 16, (i + 13) % 16);
+}
+
+static void push_args_line(ix_Buffer &document, size_t i)
+{
+    push_stringf(document, "See [[[link(page %zu,https://example.com/%zu)]]] and [[[pair(%zu,b)]]] [[[pair(c,d)]]].\n",
+                 i, i, i);
+}
+
+// Calls in the arguments of calls, eight deep.
+static void push_nesting_line(ix_Buffer &document, size_t i)
+{
+    push_stringf(document,
+                 "[[[wrap([[[wrap([[[wrap([[[wrap([[[wrap([[[wrap([[[wrap([[[wrap("
+                 "%zu"
+                 ")]]])]]])]]])]]])]]])]]])]]])]]]\n",
+                 i);
+}
+
+// Lazy calls, which are left for the lazy pass and expanded from the macro cache.
+static void push_lazy_line(ix_Buffer &document, size_t i)
+{
+    push_stringf(document, "Lazy ^[[[c%zu]]] and ^[[[c%zu]]], and [[[deferred]]] for line %zu.\n", i % 16, (i + 5) % 16,
+                 i);
+}
+
+// Multiline macros, which push their lines back as pending input.
+static void push_block_line(ix_Buffer &document, size_t i)
+{
+    if ((i % 2) == 0)
+    {
+        document.push_str("[[[block]]]\n");
+    }
+    else
+    {
+        push_stringf(document, "[[[item(%zu,text of the item)]]]\n", i);
+    }
+}
+
+// Quoted calls, which are not expanded but unquoted on output.
+static void push_quoted_line(ix_Buffer &document, size_t i)
+{
+    push_stringf(document, "Write '[[[c1']]] or '[[[pair(a,b)']]], or '^[[[c2']]] for line %zu.\n", i);
+}
+
+// Fragments that are the same on every line, fragments that are not, and a Lua macro.
+static void push_lua_line(ix_Buffer &document, size_t i)
+{
+    push_stringf(document, "[[[__LUA__(string.upper('abc'))]]] [[[__LUA__(%zu * 2)]]] [[[twice(%zu)]]]\n", i % 1000,
+                 i);
+}
+
+static const Scenario SCENARIOS[] = {
+    {"prose", "", push_prose_line},
+    {"constant",
+     "#+MACRO c0 zero\n#+MACRO c1 one\n#+MACRO c2 two\n#+MACRO c3 three\n#+MACRO c4 four\n#+MACRO c5 five\n"
+     "#+MACRO c6 six\n#+MACRO c7 seven\n#+MACRO c8 eight\n#+MACRO c9 nine\n#+MACRO c10 ten\n#+MACRO c11 eleven\n"
+     "#+MACRO c12 twelve\n#+MACRO c13 thirteen\n#+MACRO c14 fourteen\n#+MACRO c15 fifteen\n",
+     push_constant_line},
+    {"args", "#+MACRO link [$1]($2)\n#+MACRO pair <$1|$2>\n", push_args_line},
+    {"nesting", "#+MACRO wrap ($1)\n", push_nesting_line},
+    {"lazy",
+     "#+MACRO c0 zero\n#+MACRO c1 one\n#+MACRO c2 two\n#+MACRO c3 three\n#+MACRO c4 four\n#+MACRO c5 five\n"
+     "#+MACRO c6 six\n#+MACRO c7 seven\n#+MACRO c8 eight\n#+MACRO c9 nine\n#+MACRO c10 ten\n#+MACRO c11 eleven\n"
+     "#+MACRO c12 twelve\n#+MACRO c13 thirteen\n#+MACRO c14 fourteen\n#+MACRO c15 fifteen\n"
+     "#+MACRO deferred <^[[[c1]]]|^[[[c2]]]>\n",
+     push_lazy_line},
+    {"block",
+     "#+MACRO a A\n"
+     "#+MACRO_BEGIN block\n<div>\n  [[[a]]]\n</div>\n#+MACRO_END\n"
+     "#+MACRO_BEGIN item\n- $1\n  $2\n#+MACRO_END\n",
+     push_block_line},
+    {"quoted", "#+MACRO c1 one\n#+MACRO c2 two\n#+MACRO pair <$1|$2>\n", push_quoted_line},
+    {"lua", "#+LUA_BEGIN\ngokurai.macro('twice', function(x) return x .. x end)\n#+LUA_END\n", push_lua_line},
+};
+
+static size_t make_document(const Scenario &scenario, size_t size, ix_Buffer &document)
+{
+    document.clear();
+    document.push_str(scenario.definitions);
+    size_t num_lines = 0;
+    while (document.size() < size)
+    {
+        scenario.push_line(document, num_lines);
+        num_lines += 1;
+    }
+    return num_lines;
+}
+
+// Processes the whole document in a fresh context, keeping the output in memory.
+static size_t process_document(const ix_Buffer &document, const ix_FileHandle &err_handle)
+{
+    GokuraiContext ctx = gokurai_context_create(nullptr, &err_handle);
+    GokuraiResult result = gokurai_result_create();
+    gokurai_context_feed_input(ctx, document.data(), document.size());
+    gokurai_context_end_input(ctx, result);
+    const size_t output_length = gokurai_result_get_output_length(result);
+    gokurai_result_destroy(result);
+    gokurai_context_destroy(ctx);
+    return output_length;
+}
+
+static bool eat_count(const ix_FileHandle &stderr_handle, ix_CmdArgsEater &args, const char *key, size_t *count)
+{
+    const char *text = args.eat_kv(key);
+    if (text == nullptr)
+    {
+        return true;
+    }
+
+    unsigned long long value = 0;
+    const ix_Result result = ix_string_convert(text, &value);
+    if (result.is_error() || (value == 0))
+    {
+        stderr_handle.write_stringf(ERROR_TEXT_INVALID_OPTION, key, text);
+        return false;
+    }
+    *count = static_cast<size_t>(value);
+    return true;
+}
+
+static int gokurai_bench_main(const ix_FileHandle &stdout_handle, const ix_FileHandle &stderr_handle,
+                              ix_CmdArgsEater args)
+{
+    const bool show_help = args.eat_boolean({"-h", "--help"});
+    if (show_help)
+    {
+        stdout_handle.write_string(HELP_TEXT);
+        return 0;
+    }
+
+    size_t size = DEFAULT_DOCUMENT_SIZE;
+    ix_Clock::BenchmarkOption option;
+    option.num_warmups = 1;
+    option.num_trials = 10;
+    option.json = args.eat_boolean({"--json"});
+    if (!eat_count(stderr_handle, args, "--size", &size) ||
+        !eat_count(stderr_handle, args, "--warmups", &option.num_warmups) ||
+        !eat_count(stderr_handle, args, "--trials", &option.num_trials))
+    {
+        return 1;
+    }
+
+    bool selected[ix_LENGTH_OF(SCENARIOS)] = {};
+    const bool select_all = (args.size() <= 1);
+    for (size_t i = 1; i < args.size(); i++)
+    {
+        bool found = false;
+        for (size_t j = 0; j < ix_LENGTH_OF(SCENARIOS); j++)
+        {
+            if (ix_strcmp(args[i], SCENARIOS[j].name) == 0)
+            {
+                selected[j] = true;
+                found = true;
+            }
+        }
+        if (!found)
+        {
+            stderr_handle.write_stringf(ERROR_TEXT_UNKNOWN_SCENARIO, args[i]);
+            return 1;
+        }
+    }
+
+    // The lines of ix_Clock and any errors in the documents go to stderr, and the table to stdout.
+    // With --json, the lines of ix_Clock go to stdout instead of the table, so that runs can be diffed.
+    ix_Buffer document(size + 1024);
+    ix_Clock clock;
+    const ix_FileHandle &clock_handle = option.json ? stdout_handle : stderr_handle;
+    if (!option.json)
+    {
+        stdout_handle.write_stringf(REPORT_TEXT_HEADER, "scenario", "ms", "MB/s", "lines/s", "bytes", "lines");
+    }
+    for (size_t i = 0; i < ix_LENGTH_OF(SCENARIOS); i++)
+    {
+        if (!select_all && !selected[i])
+        {
+            continue;
+        }
+
+        const Scenario &scenario = SCENARIOS[i];
+        const size_t num_lines = make_document(scenario, size, document);
+        volatile size_t sink = 0;
+        const ix_Clock::BenchmarkResult result = clock.benchmark(
+            scenario.name, [&]() { sink = process_document(document, stderr_handle); }, option, &clock_handle);
+        ix_UNUSED(sink);
+        if (option.json)
+        {
+            continue;
+        }
+
+        const double elapsed_sec = result.median_sec;
+        const double mb_per_sec = static_cast<double>(document.size()) / (1000.0 * 1000.0) / elapsed_sec;
+        const double lines_per_sec = static_cast<double>(num_lines) / elapsed_sec;
+        stdout_handle.write_stringf(REPORT_TEXT_SCENARIO, scenario.name, elapsed_sec * 1000.0, mb_per_sec,
+                                    lines_per_sec, document.size(), num_lines);
+    }
+
+    return 0;
+}
+
+int main(int argc, const char **argv)
+{
+    auto &sm = ix_SystemManager::init();
+    auto _ = ix_defer(&ix_SystemManager::deinit);
+    sm.init_stdio().assert_ok();
+    sm.init_sokol_time().assert_ok();
+    sm.init_logger().assert_ok();
+
+    const int ret = gokurai_bench_main(ix_FileHandle::of_stdout(), ix_FileHandle::of_stderr(),
+                                       ix_CmdArgsEater(argc, argv));
+    return ret;
+}
@@ -2,14 +2,28 @@
 
 #include <ix.hpp>
 #include <ix_Buffer.hpp>
+#include <ix_Clock.hpp>
 #include <ix_CmdArgsEater.hpp>
+#include <ix_HashMapSingleArray.hpp>
+#include <ix_HashSet.hpp>
+#include <ix_MappedFile.hpp>
+#include <ix_Mutex.hpp>
+#include <ix_StringArena.hpp>
+#include <ix_StringView.hpp>
 #include <ix_SystemManager.hpp>
 #include <ix_TempFile.hpp>
+#include <ix_ThreadPool.hpp>
+#include <ix_UniquePointer.hpp>
+#include <ix_Vector.hpp>
 #include <ix_assert.hpp>
 #include <ix_defer.hpp>
 #include <ix_doctest.hpp>
+#include <ix_environment.hpp>
 #include <ix_file.hpp>
+#include <ix_filepath.hpp>
 #include <ix_memory.hpp>
+#include <ix_min_max.hpp>
+#include <ix_scanf.hpp>
 #include <ix_string.hpp>
 
 #include <fcntl.h>
@@ -22,6 +36,24 @@ USAGE:
 
 OPTIONS:
   -h, --help: Show help.
+  --no-macro-cache: Expand constant macros every time instead of caching them.
+  --output-buffer-size BYTES: Flush the output whenever this much is buffered (default: 65536).
+  --lua-instruction-limit N: Fail each run of Lua code after N VM instructions.
+  --lua-time-limit SECONDS: Fail each run of Lua code after SECONDS.
+  --lua-heap-limit BYTES: Fail Lua code that would grow the Lua heap of a document past BYTES.
+  --profile, --profile=json: Report the calls, output bytes and time of each macro to stderr, slowest first.
+  --trace FILE: Write the spans of work (line loads, expansion passes, Lua runs, ...) to FILE as Chrome trace events,
+                to be opened in Perfetto.
+  -o, --output-dir DIR: Process each file as a separate document and write it to DIR.
+                        The files under a directory are written to the same relative paths under DIR.
+  --batch MANIFEST: Process the jobs listed in MANIFEST and report their timing to stderr.
+                    Each line is "PRELUDE INPUT OUTPUT" ("-" for no prelude). A prelude is processed once,
+                    and the input is processed as if the prelude came first. A prelude may also be a library.
+                    With --library, a prelude starts with the library, and cannot be a library itself.
+  --compile-library FILE: Save the global macros and Lua code defined by the input to FILE as a library,
+                          instead of writing the output.
+  --library FILE: Start each document with the macros and Lua code of a library, which is mapped, not parsed.
+  -j, --jobs N: Process up to N documents at once with --output-dir or --batch (default: number of hardware threads).
 
 )";
 
@@ -29,6 +61,568 @@ static constexpr const char *ERROR_TEXT_INVALID_INVOCATION = "Invalid invocation
 static constexpr const char *ERROR_TEXT_STDIN_LOAD_FAILED = "Failed to read from stdin.\n";
 static constexpr const char *ERROR_TEXT_FILE_NOT_FOUND = "File not found: %s\n";
 static constexpr const char *ERROR_TEXT_FILE_LOAD_FAILED = "File load failed: %s\n";
+static constexpr const char *ERROR_TEXT_INVALID_OUTPUT_BUFFER_SIZE = "Invalid output buffer size: %s\n";
+static constexpr const char *ERROR_TEXT_INVALID_NUM_JOBS = "Invalid number of jobs: %s\n";
+static constexpr const char *ERROR_TEXT_INVALID_LUA_LIMIT = "Invalid Lua limit: %s\n";
+static constexpr const char *ERROR_TEXT_STDIN_WITH_OUTPUT_DIR = "stdin cannot be read with --output-dir.\n";
+static constexpr const char *ERROR_TEXT_PROFILE_OR_TRACE_WITH_MANY_DOCUMENTS =
+    "--profile and --trace cannot be used with --output-dir or --batch.\n";
+static constexpr const char *ERROR_TEXT_PROFILE_UNAVAILABLE = "This build has no profiler (gokurai_PROFILE=0).\n";
+static constexpr const char *ERROR_TEXT_TRACE_UNAVAILABLE = "This build has no tracer (gokurai_TRACE=0).\n";
+static constexpr const char *ERROR_TEXT_DIRECTORY_LOAD_FAILED = "Directory load failed: %s\n";
+static constexpr const char *ERROR_TEXT_FILE_CREATION_FAILED = "File creation failed: %s\n";
+static constexpr const char *ERROR_TEXT_PATH_RESOLUTION_FAILED = "Path resolution failed: %s\n";
+static constexpr const char *ERROR_TEXT_OUTPUT_IS_INPUT = "Output is also an input: %s\n";
+static constexpr const char *ERROR_TEXT_OUTPUT_OF_MANY_DOCUMENTS = "Output of more than one document: %s\n";
+static constexpr const char *ERROR_TEXT_INVALID_MANIFEST_LINE = "Invalid manifest line: %s:%zu\n";
+static constexpr const char *ERROR_TEXT_LIBRARY_LOAD_FAILED = "Library load failed: %s\n";
+static constexpr const char *ERROR_TEXT_LIBRARY_SAVE_FAILED = "Library save failed: %s\n";
+static constexpr const char *ERROR_TEXT_LIBRARY_PRELUDE_WITH_LIBRARY =
+    "A library prelude cannot be used with --library: %s\n";
+
+static constexpr const char *REPORT_TEXT_PRELUDE = "prelude %10.3f ms  %s\n";
+static constexpr const char *REPORT_TEXT_JOB = "job     %10.3f ms  %s -> %s\n";
+static constexpr const char *REPORT_TEXT_TOTAL = "total   %10.3f ms  %zu jobs, %zu preludes\n";
+
+static constexpr size_t INPUT_CHUNK_SIZE = 64 * 1024;
+static constexpr size_t MAPPED_INPUT_SLICE_SIZE = 1024 * 1024;
+
+// Regular files are mapped and fed as they are. Pipes and the like are read in chunks.
+static bool feed_file_handle(GokuraiContext ctx, const ix_FileHandle &file, ix_UniquePointer<char[]> &chunk)
+{
+    const ix_MappedFile mapped(file);
+    if (mapped.is_valid())
+    {
+        // Slices end at a newline where possible, so that they are processed in place rather than carried over.
+        // The pages behind the last slice are dropped to keep the resident set small.
+        const char *data = mapped.data();
+        const size_t size = mapped.size();
+        size_t offset = 0;
+        while (offset < size)
+        {
+            size_t slice_size = ix_min(MAPPED_INPUT_SLICE_SIZE, size - offset);
+            const char *last_newline = ix_memrchr(data + offset, '\n', slice_size);
+            if (last_newline != nullptr)
+            {
+                slice_size = static_cast<size_t>(last_newline + 1 - (data + offset));
+            }
+            gokurai_context_feed_input(ctx, data + offset, slice_size);
+            offset += slice_size;
+            mapped.drop_pages_before(offset);
+        }
+        return true;
+    }
+
+    if (chunk.get() == nullptr)
+    {
+        chunk = ix_make_unique_array<char>(INPUT_CHUNK_SIZE);
+    }
+
+    while (true)
+    {
+        const size_t bytes_read = file.read(chunk.get(), INPUT_CHUNK_SIZE);
+        if (bytes_read == ix_SIZE_MAX)
+        {
+            return false;
+        }
+        if (bytes_read == 0)
+        {
+            return true;
+        }
+        gokurai_context_feed_input(ctx, chunk.get(), bytes_read);
+    }
+}
+
+struct ContextOptions
+{
+    bool no_macro_cache;
+    size_t output_buffer_size;
+    uint64_t lua_instruction_limit;
+    double lua_time_limit_sec;
+    size_t lua_heap_limit;
+    GokuraiLibrary library;
+};
+
+static void configure_context(GokuraiContext ctx, const ContextOptions &options)
+{
+    gokurai_context_set_macro_cache_enabled(ctx, !options.no_macro_cache);
+    if (options.output_buffer_size != 0)
+    {
+        gokurai_context_set_output_high_water_mark(ctx, options.output_buffer_size);
+    }
+    gokurai_context_set_lua_limits(ctx, options.lua_instruction_limit, options.lua_time_limit_sec,
+                                   options.lua_heap_limit);
+}
+
+struct Document
+{
+    const char *input_path;
+    const char *output_path;
+    GokuraiSnapshot prelude_snapshot;
+    GokuraiResult prelude_output;
+    GokuraiLibrary library;
+    double elapsed_ms;
+};
+
+struct DocumentList
+{
+    ix_Vector<Document> documents;
+    ix_StringArena paths{4096};
+    ix_Buffer path_buffer{256};
+    const char *output_dirname;
+    GokuraiLibrary library;
+
+    const char *push_joined_path(const char *dirname, const char *filename)
+    {
+        path_buffer.clear();
+        path_buffer.push_str(dirname);
+        const bool needs_separator = !path_buffer.empty() && !ix_is_path_separator(*(path_buffer.end() - 1));
+        if (needs_separator)
+        {
+            path_buffer.push_char('/');
+        }
+        path_buffer.push_str(filename);
+        return paths.push(path_buffer.data(), path_buffer.size());
+    }
+
+    // A file is written under its basename. The files under a directory keep their paths relative to it.
+    void add(const char *input_dirname, const char *relative_path)
+    {
+        const char *input_path = push_joined_path(input_dirname, relative_path);
+        const char *output_path = push_joined_path(output_dirname, relative_path);
+        documents.push_back({input_path, output_path, nullptr, nullptr, library, 0.0});
+    }
+};
+
+// Each worker has a context (and hence a Lua state) of its own, which is cleared between documents.
+// A document with a prelude is processed by a fork of the prelude's snapshot instead.
+struct DocumentQueue
+{
+    ix_Vector<Document> *documents;
+    const ContextOptions *options;
+    const ix_FileHandle *err_handle;
+    ix_Mutex mutex;
+    size_t next_index = 0;
+    size_t num_failures = 0;
+
+    Document *pop()
+    {
+        mutex.lock();
+        Document *document = (next_index < documents->size()) ? &(*documents)[next_index] : nullptr;
+        next_index += 1;
+        mutex.unlock();
+        return document;
+    }
+
+    void fail(const char *format, const char *path)
+    {
+        mutex.lock();
+        err_handle->write_stringf(format, path);
+        num_failures += 1;
+        mutex.unlock();
+    }
+
+    void run_worker()
+    {
+        GokuraiContext ctx = gokurai_context_create(nullptr, err_handle);
+        ix_UniquePointer<char[]> chunk(nullptr);
+        Document *document;
+        while ((document = pop()) != nullptr)
+        {
+            const ix_Clock clock;
+            const ix_FileHandle in(document->input_path, ix_READ_ONLY);
+            if (!in.is_valid())
+            {
+                fail(ERROR_TEXT_FILE_NOT_FOUND, document->input_path);
+                continue;
+            }
+
+            const ix_FileHandle out = ix_create_directories_and_file(document->output_path);
+            if (!out.is_valid())
+            {
+                fail(ERROR_TEXT_FILE_CREATION_FAILED, document->output_path);
+                continue;
+            }
+
+            GokuraiContext document_ctx = ctx;
+            if (document->prelude_snapshot != nullptr)
+            {
+                document_ctx = gokurai_context_fork(document->prelude_snapshot, &out, err_handle);
+                out.write(gokurai_result_get_output(document->prelude_output),
+                          gokurai_result_get_output_length(document->prelude_output));
+            }
+            else
+            {
+                gokurai_context_clear(ctx);
+                gokurai_context_set_output_handle(ctx, &out);
+                if (document->library != nullptr)
+                {
+                    gokurai_context_use_library(ctx, document->library);
+                }
+            }
+            configure_context(document_ctx, *options);
+            const bool ok = feed_file_handle(document_ctx, in, chunk);
+            gokurai_context_end_input(document_ctx, nullptr);
+            if (document_ctx != ctx)
+            {
+                gokurai_context_destroy(document_ctx);
+            }
+            else
+            {
+                gokurai_context_set_output_handle(ctx, nullptr);
+            }
+            document->elapsed_ms = clock.elaplsed_ms();
+            if (!ok)
+            {
+                fail(ERROR_TEXT_FILE_LOAD_FAILED, document->input_path);
+            }
+        }
+        gokurai_context_destroy(ctx);
+    }
+};
+
+static int run_documents(const ix_FileHandle &stderr_handle, ix_Vector<Document> &documents, size_t num_jobs,
+                         const ContextOptions &options);
+
+static int process_documents(const ix_FileHandle &stderr_handle, const ix_CmdArgsEater &args,
+                             const char *output_dirname, size_t num_jobs, const ContextOptions &options)
+{
+    DocumentList list;
+    list.output_dirname = output_dirname;
+    list.library = options.library;
+    const size_t num_args = args.size();
+    for (size_t i = 1; i < num_args; i++)
+    {
+        const char *path = args[i];
+        if (ix_strcmp(path, "-") == 0)
+        {
+            stderr_handle.write_string(ERROR_TEXT_STDIN_WITH_OUTPUT_DIR);
+            return 1;
+        }
+
+        if (ix_is_directory(path))
+        {
+            DocumentList *list_pointer = &list;
+            const char *dirname = path;
+            const ix_Result result = ix_walk_directory(path, [list_pointer, dirname](const char *relative_path) {
+                list_pointer->add(dirname, relative_path);
+            });
+            if (result.is_error())
+            {
+                stderr_handle.write_stringf(ERROR_TEXT_DIRECTORY_LOAD_FAILED, path);
+                return 1;
+            }
+            continue;
+        }
+
+        if (!ix_is_file(path))
+        {
+            stderr_handle.write_stringf(ERROR_TEXT_FILE_NOT_FOUND, path);
+            return 1;
+        }
+
+        const size_t dirname_length = ix_dirname_length(path);
+        const char *dirname = list.paths.push(path, dirname_length);
+        list.add(dirname, path + dirname_length);
+    }
+
+    return run_documents(stderr_handle, list.documents, num_jobs, options);
+}
+
+// Creating an output truncates it, so no output may be an input or the output of another document. The paths are
+// compared once resolved, e.g. "out/a.gk" and "./out/../out/a.gk" are the same file.
+static bool check_document_paths(const ix_FileHandle &stderr_handle, const ix_Vector<Document> &documents)
+{
+    ix_StringArena resolved_paths(4096);
+    const auto push_resolved_path = [&](const char *path) -> const char * {
+        const ix_UniquePointer<char[]> resolved = ix_resolve_path(path);
+        if (resolved.get() == nullptr)
+        {
+            stderr_handle.write_stringf(ERROR_TEXT_PATH_RESOLUTION_FAILED, path);
+            return nullptr;
+        }
+        return resolved_paths.push_str(resolved.get());
+    };
+
+    ix_HashSet<ix_StringView> inputs;
+    for (const Document &document : documents)
+    {
+        const char *input = push_resolved_path(document.input_path);
+        if (input == nullptr)
+        {
+            return false;
+        }
+        inputs.emplace(ix_StringView(input));
+    }
+
+    ix_HashSet<ix_StringView> outputs;
+    for (const Document &document : documents)
+    {
+        const char *output = push_resolved_path(document.output_path);
+        if (output == nullptr)
+        {
+            return false;
+        }
+        const ix_StringView output_view(output);
+        if (inputs.contains(output_view))
+        {
+            stderr_handle.write_stringf(ERROR_TEXT_OUTPUT_IS_INPUT, document.output_path);
+            return false;
+        }
+        if (outputs.contains(output_view))
+        {
+            stderr_handle.write_stringf(ERROR_TEXT_OUTPUT_OF_MANY_DOCUMENTS, document.output_path);
+            return false;
+        }
+        outputs.emplace(output_view);
+    }
+
+    return true;
+}
+
+static int run_documents(const ix_FileHandle &stderr_handle, ix_Vector<Document> &documents, size_t num_jobs,
+                         const ContextOptions &options)
+{
+    if (!check_document_paths(stderr_handle, documents))
+    {
+        return 1;
+    }
+
+    DocumentQueue queue;
+    queue.documents = &documents;
+    queue.options = &options;
+    queue.err_handle = &stderr_handle;
+
+    const size_t num_workers = ix_min(num_jobs, documents.size());
+    if (num_workers <= 1)
+    {
+        queue.run_worker();
+    }
+    else
+    {
+        ix_ThreadPool pool(num_workers);
+        DocumentQueue *queue_pointer = &queue;
+        for (size_t i = 0; i < num_workers; i++)
+        {
+            pool.add_task([queue_pointer]() { queue_pointer->run_worker(); });
+        }
+        pool.wait();
+    }
+
+    return (queue.num_failures == 0) ? 0 : 1;
+}
+
+// Fields are separated by spaces or tabs. Blank lines and lines starting with '#' are skipped.
+static bool split_manifest_line(char *line, char *fields[3])
+{
+    size_t num_fields = 0;
+    char *p = line;
+    while (true)
+    {
+        while ((*p == ' ') || (*p == '\t'))
+        {
+            *p = '\0';
+            p += 1;
+        }
+        if ((*p == '\0') || ((num_fields == 0) && (*p == '#')))
+        {
+            break;
+        }
+        if (num_fields == 3)
+        {
+            return false;
+        }
+        fields[num_fields] = p;
+        num_fields += 1;
+        while ((*p != ' ') && (*p != '\t') && (*p != '\0'))
+        {
+            p += 1;
+        }
+    }
+    return (num_fields == 3) || (num_fields == 0);
+}
+
+static GokuraiLibrary load_library(const char *path)
+{
+    const ix_FileHandle file(path, ix_READ_ONLY);
+    return file.is_valid() ? gokurai_library_load(&file) : nullptr;
+}
+
+// A prelude is either processed from text, once, into a snapshot and its output, or mapped from a library.
+struct BatchPrelude
+{
+    GokuraiSnapshot snapshot;
+    GokuraiResult output;
+    GokuraiLibrary library;
+};
+
+// The Lua code of the prelude is recorded so that the forks of its snapshot can run it again.
+// The snapshot keeps `library`, if any, so the forks start with it too.
+static BatchPrelude process_prelude(const ix_FileHandle &stderr_handle, const char *input, size_t input_length,
+                                    GokuraiLibrary library)
+{
+    GokuraiContext ctx = gokurai_context_create(nullptr, &stderr_handle);
+    BatchPrelude prelude = {nullptr, gokurai_result_create(), nullptr};
+    if (library != nullptr)
+    {
+        gokurai_context_use_library(ctx, library);
+    }
+    gokurai_context_set_lua_history_enabled(ctx, true);
+    gokurai_context_feed_input(ctx, input, input_length);
+    gokurai_context_end_input(ctx, prelude.output);
+    gokurai_context_set_lua_history_enabled(ctx, false);
+    prelude.snapshot = gokurai_context_snapshot(ctx);
+    gokurai_context_destroy(ctx);
+    return prelude;
+}
+
+static int process_batch(const ix_FileHandle &stderr_handle, const char *manifest_path, size_t num_jobs,
+                         const ContextOptions &options)
+{
+    const ix_Clock total_clock;
+
+    size_t manifest_length = 0;
+    ix_UniquePointer<char[]> manifest = ix_load_file(manifest_path, &manifest_length);
+    if (manifest.get() == nullptr)
+    {
+        stderr_handle.write_stringf(ERROR_TEXT_FILE_NOT_FOUND, manifest_path);
+        return 1;
+    }
+
+    ix_Vector<Document> documents;
+    ix_HashMapSingleArray<ix_StringView, BatchPrelude> preludes;
+    const auto destroy_preludes = ix_defer([&]() {
+        for (const auto &kv : preludes)
+        {
+            if (kv.value.snapshot != nullptr)
+            {
+                gokurai_snapshot_destroy(kv.value.snapshot);
+                gokurai_result_destroy(kv.value.output);
+            }
+            if (kv.value.library != nullptr)
+            {
+                gokurai_library_destroy(kv.value.library);
+            }
+        }
+    });
+
+    char *line = manifest.get();
+    const char *manifest_end = manifest.get() + manifest_length;
+    size_t line_number = 0;
+    while (line < manifest_end)
+    {
+        line_number += 1;
+        char *line_end = ix_memnext2(line, '\n', '\0');
+        *line_end = '\0';
+        if ((line_end != line) && (*(line_end - 1) == '\r'))
+        {
+            *(line_end - 1) = '\0';
+        }
+
+        char *fields[3] = {};
+        if (!split_manifest_line(line, fields))
+        {
+            stderr_handle.write_stringf(ERROR_TEXT_INVALID_MANIFEST_LINE, manifest_path, line_number);
+            return 1;
+        }
+        line = line_end + 1;
+        if (fields[0] == nullptr)
+        {
+            continue;
+        }
+
+        const char *prelude_path = fields[0];
+        BatchPrelude prelude = {nullptr, nullptr, options.library};
+        if (ix_strcmp(prelude_path, "-") != 0)
+        {
+            const ix_StringView prelude_path_view(prelude_path, ix_strlen(prelude_path));
+            const BatchPrelude *found = preludes.find(prelude_path_view);
+            if (found != nullptr)
+            {
+                prelude = *found;
+            }
+            else
+            {
+                const ix_Clock prelude_clock;
+                prelude.library = load_library(prelude_path);
+                if ((prelude.library != nullptr) && (options.library != nullptr))
+                {
+                    gokurai_library_destroy(prelude.library);
+                    stderr_handle.write_stringf(ERROR_TEXT_LIBRARY_PRELUDE_WITH_LIBRARY, prelude_path);
+                    return 1;
+                }
+                if (prelude.library == nullptr)
+                {
+                    size_t prelude_length = 0;
+                    const ix_UniquePointer<char[]> prelude_input = ix_load_file(prelude_path, &prelude_length);
+                    if (prelude_input.get() == nullptr)
+                    {
+                        stderr_handle.write_stringf(ERROR_TEXT_FILE_NOT_FOUND, prelude_path);
+                        return 1;
+                    }
+                    prelude = process_prelude(stderr_handle, prelude_input.get(), prelude_length, options.library);
+                }
+                preludes.emplace(prelude_path_view, prelude);
+                stderr_handle.write_stringf(REPORT_TEXT_PRELUDE, prelude_clock.elaplsed_ms(), prelude_path);
+            }
+        }
+
+        documents.push_back({fields[1], fields[2], prelude.snapshot, prelude.output, prelude.library, 0.0});
+    }
+
+    const int ret = run_documents(stderr_handle, documents, num_jobs, options);
+
+    for (const Document &document : documents)
+    {
+        stderr_handle.write_stringf(REPORT_TEXT_JOB, document.elapsed_ms, document.input_path, document.output_path);
+    }
+    stderr_handle.write_stringf(REPORT_TEXT_TOTAL, total_clock.elaplsed_ms(), documents.size(), preludes.size());
+
+    return ret;
+}
+
+// The files are fed one after another without being copied into a single buffer. stdin is read if there are none.
+static bool feed_input_files(GokuraiContext ctx, const ix_FileHandle &stdin_handle, const ix_FileHandle &stderr_handle,
+                             const ix_CmdArgsEater &args)
+{
+    ix_UniquePointer<char[]> chunk(nullptr);
+    const size_t num_args = args.size();
+    const bool read_from_stdin = (num_args == 1);
+    if (read_from_stdin)
+    {
+        if (!feed_file_handle(ctx, stdin_handle, chunk))
+        {
+            stderr_handle.write_string(ERROR_TEXT_STDIN_LOAD_FAILED);
+            return false;
+        }
+    }
+    for (size_t i = 1; i < num_args; i++)
+    {
+        const char *filename = args[i];
+        if (ix_strcmp(filename, "-") == 0)
+        {
+            if (!feed_file_handle(ctx, stdin_handle, chunk))
+            {
+                stderr_handle.write_string(ERROR_TEXT_STDIN_LOAD_FAILED);
+                return false;
+            }
+            continue;
+        }
+
+        const ix_FileHandle file(filename, ix_READ_ONLY);
+        if (!file.is_valid())
+        {
+            stderr_handle.write_stringf(ERROR_TEXT_FILE_NOT_FOUND, filename);
+            return false;
+        }
+        if (!feed_file_handle(ctx, file, chunk))
+        {
+            stderr_handle.write_stringf(ERROR_TEXT_FILE_LOAD_FAILED, filename);
+            return false;
+        }
+    }
+    return true;
+}
 
 static int gokurai_main(const ix_FileHandle &stdin_handle, const ix_FileHandle &stdout_handle,
                         const ix_FileHandle &stderr_handle, ix_CmdArgsEater args)
@@ -53,65 +647,201 @@ static int gokurai_main(const ix_FileHandle &stdin_handle, const ix_FileHandle &
         ix_do_doctest(static_cast<int>(args.size()), &args[0]);
         return 0;
     }
+
+    const bool do_benchmark = args.eat_boolean("--benchmark");
+    if (do_benchmark)
+    {
+        ix_do_doctest_benchmark(static_cast<int>(args.size()), &args[0]);
+        return 0;
+    }
 #endif
 
     const bool quiet = args.eat_boolean({"-q", "--quiet"});
+    const bool no_macro_cache = args.eat_boolean("--no-macro-cache");
+    const char *output_buffer_size_text = args.eat_kv("--output-buffer-size");
+    unsigned long long output_buffer_size = 0;
+    if (output_buffer_size_text != nullptr)
+    {
+        const ix_Result result = ix_string_convert(output_buffer_size_text, &output_buffer_size);
+        if (result.is_error() || (output_buffer_size == 0))
+        {
+            stderr_handle.write_stringf(ERROR_TEXT_INVALID_OUTPUT_BUFFER_SIZE, output_buffer_size_text);
+            return 1;
+        }
+    }
 
-    const bool read_from_stdin = (args.size() == 1);
-    ix_Buffer input_buffer(4096);
-    if (read_from_stdin)
+    const char *num_jobs_text = args.eat_kv({"-j", "--jobs"});
+    unsigned long long num_jobs = ix_hardware_concurrency();
+    if (num_jobs_text != nullptr)
     {
-        const size_t bytes_read = input_buffer.load_file_handle(stdin_handle);
-        if (bytes_read == ix_SIZE_MAX)
+        const ix_Result result = ix_string_convert(num_jobs_text, &num_jobs);
+        if (result.is_error() || (num_jobs == 0))
         {
-            stderr_handle.write_string(ERROR_TEXT_STDIN_LOAD_FAILED);
+            stderr_handle.write_stringf(ERROR_TEXT_INVALID_NUM_JOBS, num_jobs_text);
             return 1;
         }
-        input_buffer.push_char('\0');
     }
-    else
+
+    unsigned long long lua_instruction_limit = 0;
+    const char *lua_instruction_limit_text = args.eat_kv("--lua-instruction-limit");
+    if (lua_instruction_limit_text != nullptr)
     {
-        const size_t num_args = args.size();
-        for (size_t i = 1; i < num_args; i++)
+        const ix_Result result = ix_string_convert(lua_instruction_limit_text, &lua_instruction_limit);
+        if (result.is_error() || (lua_instruction_limit == 0))
         {
-            const char *filename = args[i];
-            if (ix_strcmp(filename, "-") == 0)
-            {
-                const size_t bytes_read = input_buffer.load_file_handle(stdin_handle);
-                if (bytes_read == ix_SIZE_MAX)
-                {
-                    stderr_handle.write_string(ERROR_TEXT_STDIN_LOAD_FAILED);
-                    return 1;
-                }
-            }
-            else
-            {
-                const ix_FileHandle file(filename, ix_READ_ONLY);
-                if (!file.is_valid())
-                {
-                    stderr_handle.write_stringf(ERROR_TEXT_FILE_NOT_FOUND, filename);
-                    return 1;
-                }
-                const size_t bytes_read = input_buffer.load_file_handle(file);
-                if (bytes_read == ix_SIZE_MAX)
-                {
-                    stderr_handle.write_stringf(ERROR_TEXT_FILE_LOAD_FAILED, filename);
-                    return 1;
-                }
-            }
+            stderr_handle.write_stringf(ERROR_TEXT_INVALID_LUA_LIMIT, lua_instruction_limit_text);
+            return 1;
+        }
+    }
+
+    double lua_time_limit_sec = 0.0;
+    const char *lua_time_limit_text = args.eat_kv("--lua-time-limit");
+    if (lua_time_limit_text != nullptr)
+    {
+        const ix_Result result = ix_string_convert(lua_time_limit_text, &lua_time_limit_sec);
+        if (result.is_error() || !(lua_time_limit_sec > 0.0))
+        {
+            stderr_handle.write_stringf(ERROR_TEXT_INVALID_LUA_LIMIT, lua_time_limit_text);
+            return 1;
         }
+    }
 
-        input_buffer.push_char('\0');
+    unsigned long long lua_heap_limit = 0;
+    const char *lua_heap_limit_text = args.eat_kv("--lua-heap-limit");
+    if (lua_heap_limit_text != nullptr)
+    {
+        const ix_Result result = ix_string_convert(lua_heap_limit_text, &lua_heap_limit);
+        if (result.is_error() || (lua_heap_limit == 0))
+        {
+            stderr_handle.write_stringf(ERROR_TEXT_INVALID_LUA_LIMIT, lua_heap_limit_text);
+            return 1;
+        }
     }
 
-    ix_ASSERT(!input_buffer.empty());
-    const size_t input_length = input_buffer.size() - 1;
-    ix_UniquePointer<char[]> input = input_buffer.detach();
+    ContextOptions options;
+    options.no_macro_cache = no_macro_cache;
+    options.output_buffer_size = static_cast<size_t>(output_buffer_size);
+    options.lua_instruction_limit = static_cast<uint64_t>(lua_instruction_limit);
+    options.lua_time_limit_sec = lua_time_limit_sec;
+    options.lua_heap_limit = static_cast<size_t>(lua_heap_limit);
+    options.library = nullptr;
+
+    const char *library_path = args.eat_kv("--library");
+    if (library_path != nullptr)
+    {
+        options.library = load_library(library_path);
+        if (options.library == nullptr)
+        {
+            stderr_handle.write_stringf(ERROR_TEXT_LIBRARY_LOAD_FAILED, library_path);
+            return 1;
+        }
+    }
+    const auto destroy_library = ix_defer([&]() {
+        if (options.library != nullptr)
+        {
+            gokurai_library_destroy(options.library);
+        }
+    });
+
+    const char *compile_library_path = args.eat_kv("--compile-library");
+    const bool profile_json = args.eat_boolean("--profile=json");
+    const bool profile = args.eat_boolean("--profile") || profile_json;
+    const char *trace_path = args.eat_kv("--trace");
+
+    const char *manifest_path = args.eat_kv("--batch");
+    const char *output_dirname = args.eat_kv({"-o", "--output-dir"});
+    const bool many_documents = (manifest_path != nullptr) || (output_dirname != nullptr);
+    if ((profile || (trace_path != nullptr)) && many_documents)
+    {
+        stderr_handle.write_string(ERROR_TEXT_PROFILE_OR_TRACE_WITH_MANY_DOCUMENTS);
+        return 1;
+    }
+
+    if (manifest_path != nullptr)
+    {
+        return process_batch(stderr_handle, manifest_path, static_cast<size_t>(num_jobs), options);
+    }
+
+    if (output_dirname != nullptr)
+    {
+        return process_documents(stderr_handle, args, output_dirname, static_cast<size_t>(num_jobs), options);
+    }
+
+    const size_t num_args = args.size();
+    for (size_t i = 1; i < num_args; i++)
+    {
+        const char *filename = args[i];
+        const bool file_not_found = (ix_strcmp(filename, "-") != 0) && !ix_is_file(filename);
+        if (file_not_found)
+        {
+            stderr_handle.write_stringf(ERROR_TEXT_FILE_NOT_FOUND, filename);
+            return 1;
+        }
+    }
+
+    // The trace is ended when the context is destroyed, so the file is opened first.
+    ix_FileHandle trace_file;
+    if (trace_path != nullptr)
+    {
+        trace_file = ix_create_directories_and_file(trace_path);
+        if (!trace_file.is_valid())
+        {
+            stderr_handle.write_stringf(ERROR_TEXT_FILE_CREATION_FAILED, trace_path);
+            return 1;
+        }
+    }
+
+    // Quiet output goes to a null handle, so it is not kept in memory either.
+    // So does the output of the input to a library, which keeps only the macros and the Lua code.
+    const ix_FileHandle null_handle = ix_FileHandle::null();
+    const bool discard_output = quiet || (compile_library_path != nullptr);
+    GokuraiContext ctx = gokurai_context_create(discard_output ? &null_handle : &stdout_handle, &stderr_handle);
+    const auto destroy_ctx = ix_defer([&]() { gokurai_context_destroy(ctx); });
+    configure_context(ctx, options);
+    if (options.library != nullptr)
+    {
+        gokurai_context_use_library(ctx, options.library);
+    }
+    if (compile_library_path != nullptr)
+    {
+        gokurai_context_set_lua_history_enabled(ctx, true);
+    }
+    if (profile && !gokurai_context_set_profile_enabled(ctx, true))
+    {
+        stderr_handle.write_string(ERROR_TEXT_PROFILE_UNAVAILABLE);
+        return 1;
+    }
+    if ((trace_path != nullptr) && !gokurai_context_set_trace_handle(ctx, &trace_file))
+    {
+        stderr_handle.write_string(ERROR_TEXT_TRACE_UNAVAILABLE);
+        return 1;
+    }
+
+    if (!feed_input_files(ctx, stdin_handle, stderr_handle, args))
+    {
+        return 1;
+    }
 
-    GokuraiContext ctx = gokurai_context_create(quiet ? nullptr : &stdout_handle, &stderr_handle);
-    gokurai_context_feed_input(ctx, input.get(), input_length);
     gokurai_context_end_input(ctx, nullptr);
-    gokurai_context_destroy(ctx);
+    if (profile)
+    {
+        gokurai_context_write_profile(ctx, &stderr_handle, profile_json);
+    }
+
+    if (compile_library_path != nullptr)
+    {
+        const ix_FileHandle library_file = ix_create_directories_and_file(compile_library_path);
+        if (!library_file.is_valid())
+        {
+            stderr_handle.write_stringf(ERROR_TEXT_FILE_CREATION_FAILED, compile_library_path);
+            return 1;
+        }
+        if (!gokurai_context_save_library(ctx, &library_file))
+        {
+            stderr_handle.write_stringf(ERROR_TEXT_LIBRARY_SAVE_FAILED, compile_library_path);
+            return 1;
+        }
+    }
 
     return 0;
 }
@@ -246,6 +976,397 @@ ix_TEST_CASE("gokurai: CUI")
         ix_EXPECT_EQSTR(err.data(), "");
     }
 
+    { // Small output buffer.
+        ix_TempFileW out;
+        ix_TempFileW err;
+        const ix_TempFileR in("#+MACRO foo FOO\nhello [[[foo]]]\nbye [[[foo]]]\n");
+        gokurai_main(in.file_handle(), out.file_handle(), err.file_handle(),
+                     {"gokurai", "--output-buffer-size", "1"});
+        ix_EXPECT_EQSTR(out.data(), "hello FOO\n"
+                                    "bye FOO\n");
+        ix_EXPECT_EQSTR(err.data(), "");
+    }
+
+    { // Invalid output buffer size.
+        ix_TempFileW out;
+        ix_TempFileW err;
+        gokurai_main(null, out.file_handle(), err.file_handle(), {"gokurai", "--output-buffer-size", "0", "-"});
+        ix_EXPECT_EQSTR(out.data(), "");
+        ix_EXPECT_EQSTR(err.data(), "Invalid output buffer size: 0\n");
+    }
+
+    { // Lua limits.
+        ix_TempFileW out;
+        ix_TempFileW err;
+        const ix_TempFileR in("[[[__LUA__(while true do end)]]]\n"
+                              "[[[__LUA__(1 + 1)]]]\n");
+        gokurai_main(in.file_handle(), out.file_handle(), err.file_handle(),
+                     {"gokurai", "--lua-instruction-limit", "1000", "--lua-heap-limit", "10000000", "-"});
+        ix_EXPECT_EQSTR(out.data(), "[string \"while true do end\"]:1: instruction limit (1000) exceeded\n"
+                                    "2\n");
+        ix_EXPECT_EQSTR(err.data(),
+                        "Lua evaluation failed: [string \"while true do end\"]:1: instruction limit (1000) exceeded\n");
+    }
+
+    { // Invalid Lua limit.
+        ix_TempFileW out;
+        ix_TempFileW err;
+        gokurai_main(null, out.file_handle(), err.file_handle(), {"gokurai", "--lua-time-limit", "-1", "-"});
+        ix_EXPECT_EQSTR(out.data(), "");
+        ix_EXPECT_EQSTR(err.data(), "Invalid Lua limit: -1\n");
+    }
+
+    { // Profile.
+        ix_TempFileW out;
+        ix_TempFileW err;
+        const ix_TempFileR in("#+MACRO x FOO\n"
+                              "[[[x]]] [[[x]]]\n");
+        gokurai_main(in.file_handle(), out.file_handle(), err.file_handle(), {"gokurai", "--profile=json", "-"});
+#if gokurai_PROFILE
+        ix_EXPECT_EQSTR(out.data(), "FOO FOO\n");
+        ix_EXPECT(ix_strstr(err.data(), "{\"macros\": [\n  {\"name\": \"x\", \"kind\": \"macro\", \"calls\": 2, "
+                                        "\"bytes\": 6, \"time_ms\": ") == err.data());
+#else
+        ix_EXPECT_EQSTR(out.data(), "");
+        ix_EXPECT_EQSTR(err.data(), ERROR_TEXT_PROFILE_UNAVAILABLE);
+#endif
+    }
+
+    { // Trace.
+        char trace_path[ix_MAX_PATH + 1];
+        ix_snprintf(trace_path, sizeof(trace_path), "%s", ix_temp_filename("gokurai_"));
+        ix_TempFileW out;
+        ix_TempFileW err;
+        const ix_TempFileR in("#+MACRO x FOO\n"
+                              "[[[x]]]\n");
+        gokurai_main(in.file_handle(), out.file_handle(), err.file_handle(), {"gokurai", "--trace", trace_path, "-"});
+#if gokurai_TRACE
+        ix_EXPECT_EQSTR(out.data(), "FOO\n");
+        ix_EXPECT_EQSTR(err.data(), "");
+        const ix_UniquePointer<char[]> trace = ix_load_file(trace_path);
+        ix_EXPECT(ix_strstr(trace.get(), "[\n{\"name\": \"load line\", ") == trace.get());
+        ix_EXPECT(ix_strstr(trace.get(), "\"args\": {\"line\": 2}}\n]\n") != nullptr);
+#else
+        ix_EXPECT_EQSTR(out.data(), "");
+        ix_EXPECT_EQSTR(err.data(), ERROR_TEXT_TRACE_UNAVAILABLE);
+#endif
+        ix_EXPECT(ix_remove_file(trace_path).is_ok());
+    }
+
+    { // Profile many documents.
+        ix_TempFileW out;
+        ix_TempFileW err;
+        gokurai_main(null, out.file_handle(), err.file_handle(), {"gokurai", "--trace", "foo", "-o", "foo", "foo"});
+        ix_EXPECT_EQSTR(out.data(), "");
+        ix_EXPECT_EQSTR(err.data(), ERROR_TEXT_PROFILE_OR_TRACE_WITH_MANY_DOCUMENTS);
+    }
+
+    { // Process files separately into an output directory.
+        char output_dirname[ix_MAX_PATH + 1];
+        ix_snprintf(output_dirname, sizeof(output_dirname), "%s", ix_temp_filename("gokurai_"));
+        const ix_TempFileR foo("#+MACRO x FOO\n[[[x]]]\n");
+        const ix_TempFileR bar("[[[x]]]bar\n");
+        for (const char *num_jobs : {"1", "2"})
+        {
+            ix_TempFileW out;
+            ix_TempFileW err;
+            const int ret =
+                gokurai_main(null, out.file_handle(), err.file_handle(),
+                             {"gokurai", "-j", num_jobs, "-o", output_dirname, foo.filename(), bar.filename()});
+            ix_EXPECT(ret == 0);
+            ix_EXPECT_EQSTR(out.data(), "");
+            ix_EXPECT_EQSTR(err.data(), "");
+
+            for (const ix_TempFileR *in : {&foo, &bar})
+            {
+                char output_path[ix_MAX_PATH * 2];
+                const char *basename = in->filename() + ix_dirname_length(in->filename());
+                ix_snprintf(output_path, sizeof(output_path), "%s/%s", output_dirname, basename);
+                const ix_UniquePointer<char[]> output = ix_load_file(output_path);
+                ix_EXPECT_EQSTR(output.get(), (in == &foo) ? "FOO\n" : "bar\n"); // No macros leak across documents.
+                ix_EXPECT(ix_remove_file(output_path).is_ok());
+            }
+        }
+        ix_EXPECT(ix_remove_directory(output_dirname).is_ok());
+    }
+
+    { // Mirror a directory into an output directory.
+        char input_dirname[ix_MAX_PATH + 1];
+        char output_dirname[ix_MAX_PATH + 1];
+        ix_snprintf(input_dirname, sizeof(input_dirname), "%s", ix_temp_filename("gokurai_"));
+        ix_snprintf(output_dirname, sizeof(output_dirname), "%s", ix_temp_filename("gokurai_"));
+        char path[ix_MAX_PATH * 2];
+        ix_snprintf(path, sizeof(path), "%s/sub", input_dirname);
+        ix_EXPECT(ix_ensure_directories(path).is_ok());
+        ix_snprintf(path, sizeof(path), "%s/a.gk", input_dirname);
+        ix_EXPECT(ix_write_string_to_file(path, "[[[__LUA__(1 + 1)]]]\n").is_ok());
+        ix_snprintf(path, sizeof(path), "%s/sub/b.gk", input_dirname);
+        ix_EXPECT(ix_write_string_to_file(path, "b\n").is_ok());
+
+        ix_TempFileW out;
+        ix_TempFileW err;
+        const int ret = gokurai_main(null, out.file_handle(), err.file_handle(),
+                                     {"gokurai", "--output-dir", output_dirname, input_dirname});
+        ix_EXPECT(ret == 0);
+        ix_EXPECT_EQSTR(err.data(), "");
+
+        ix_snprintf(path, sizeof(path), "%s/a.gk", output_dirname);
+        ix_EXPECT_EQSTR(ix_load_file(path).get(), "2\n");
+        ix_EXPECT(ix_remove_file(path).is_ok());
+        ix_snprintf(path, sizeof(path), "%s/sub/b.gk", output_dirname);
+        ix_EXPECT_EQSTR(ix_load_file(path).get(), "b\n");
+        ix_EXPECT(ix_remove_file(path).is_ok());
+        ix_snprintf(path, sizeof(path), "%s/sub", output_dirname);
+        ix_EXPECT(ix_remove_directory(path).is_ok());
+        ix_EXPECT(ix_remove_directory(output_dirname).is_ok());
+
+        ix_snprintf(path, sizeof(path), "%s/a.gk", input_dirname);
+        ix_EXPECT(ix_remove_file(path).is_ok());
+        ix_snprintf(path, sizeof(path), "%s/sub/b.gk", input_dirname);
+        ix_EXPECT(ix_remove_file(path).is_ok());
+        ix_snprintf(path, sizeof(path), "%s/sub", input_dirname);
+        ix_EXPECT(ix_remove_directory(path).is_ok());
+        ix_EXPECT(ix_remove_directory(input_dirname).is_ok());
+    }
+
+    { // Outputs that would overwrite an input or each other are rejected before anything is written.
+        char input_dirname[ix_MAX_PATH + 1];
+        char output_dirname[ix_MAX_PATH + 1];
+        ix_snprintf(input_dirname, sizeof(input_dirname), "%s", ix_temp_filename("gokurai_"));
+        ix_snprintf(output_dirname, sizeof(output_dirname), "%s", ix_temp_filename("gokurai_"));
+        char a_dirname[ix_MAX_PATH * 2];
+        char a_path[ix_MAX_PATH * 2];
+        char b_dirname[ix_MAX_PATH * 2];
+        char b_path[ix_MAX_PATH * 2];
+        ix_snprintf(a_dirname, sizeof(a_dirname), "%s/a", input_dirname);
+        ix_snprintf(a_path, sizeof(a_path), "%s/a/x.gk", input_dirname);
+        ix_snprintf(b_dirname, sizeof(b_dirname), "%s/b", input_dirname);
+        ix_snprintf(b_path, sizeof(b_path), "%s/b/x.gk", input_dirname);
+        ix_EXPECT(ix_ensure_directories(a_dirname).is_ok());
+        ix_EXPECT(ix_ensure_directories(b_dirname).is_ok());
+        ix_EXPECT(ix_write_string_to_file(a_path, "a\n").is_ok());
+        ix_EXPECT(ix_write_string_to_file(b_path, "b\n").is_ok());
+
+        char expected[ix_MAX_PATH * 4];
+        { // The output of a file is the file itself.
+            ix_TempFileW out;
+            ix_TempFileW err;
+            const int ret =
+                gokurai_main(null, out.file_handle(), err.file_handle(), {"gokurai", "-o", a_dirname, a_path});
+            ix_EXPECT(ret == 1);
+            ix_snprintf(expected, sizeof(expected), ERROR_TEXT_OUTPUT_IS_INPUT, a_path);
+            ix_EXPECT_EQSTR(err.data(), expected);
+        }
+        for (const char *num_jobs : {"1", "2"})
+        { // The outputs of a directory are its own files.
+            ix_TempFileW out;
+            ix_TempFileW err;
+            const int ret = gokurai_main(null, out.file_handle(), err.file_handle(),
+                                         {"gokurai", "-j", num_jobs, "-o", input_dirname, input_dirname});
+            ix_EXPECT(ret == 1);
+            ix_EXPECT(ix_starts_with(err.data(), "Output is also an input: "));
+        }
+        { // Files with the same basename in different directories.
+            ix_TempFileW out;
+            ix_TempFileW err;
+            const int ret = gokurai_main(null, out.file_handle(), err.file_handle(),
+                                         {"gokurai", "-o", output_dirname, a_path, b_path});
+            ix_EXPECT(ret == 1);
+            char output_path[ix_MAX_PATH * 2];
+            ix_snprintf(output_path, sizeof(output_path), "%s/x.gk", output_dirname);
+            ix_snprintf(expected, sizeof(expected), ERROR_TEXT_OUTPUT_OF_MANY_DOCUMENTS, output_path);
+            ix_EXPECT_EQSTR(err.data(), expected);
+            ix_EXPECT(!ix_is_directory(output_dirname));
+        }
+        ix_EXPECT_EQSTR(ix_load_file(a_path).get(), "a\n");
+        ix_EXPECT_EQSTR(ix_load_file(b_path).get(), "b\n");
+
+        ix_EXPECT(ix_remove_file(a_path).is_ok());
+        ix_EXPECT(ix_remove_file(b_path).is_ok());
+        ix_EXPECT(ix_remove_directory(a_dirname).is_ok());
+        ix_EXPECT(ix_remove_directory(b_dirname).is_ok());
+        ix_EXPECT(ix_remove_directory(input_dirname).is_ok());
+    }
+
+    { // Batch with a shared prelude.
+        const ix_TempFileR prelude("#+MACRO x X\n#+LUA_BEGIN\nfunction f() return 'F' end\n#+LUA_END\n");
+        const ix_TempFileR foo("[[[x]]] [[[__LUA__(f())]]]\n#+MACRO x Y\n[[[x]]]\n");
+        const ix_TempFileR bar("[[[x]]]bar\n");
+        char output_dirname[ix_MAX_PATH + 1];
+        ix_snprintf(output_dirname, sizeof(output_dirname), "%s", ix_temp_filename("gokurai_"));
+        char manifest_text[ix_MAX_PATH * 8];
+        ix_snprintf(manifest_text, sizeof(manifest_text),
+                    "# PRELUDE INPUT OUTPUT\n"
+                    "%s %s %s/foo\n"
+                    "\n"
+                    "%s\t%s %s/bar\n"
+                    "- %s %s/baz\n",
+                    prelude.filename(), foo.filename(), output_dirname, //
+                    prelude.filename(), bar.filename(), output_dirname, //
+                    bar.filename(), output_dirname);
+        const ix_TempFileR manifest(manifest_text);
+
+        ix_TempFileW out;
+        ix_TempFileW err;
+        const int ret = gokurai_main(null, out.file_handle(), err.file_handle(),
+                                     {"gokurai", "-j", "2", "--batch", manifest.filename()});
+        ix_EXPECT(ret == 0);
+        ix_EXPECT_EQSTR(out.data(), "");
+        ix_EXPECT(ix_strstr(err.data(), "total ") != nullptr);
+        ix_EXPECT(ix_strstr(err.data(), "3 jobs, 1 preludes") != nullptr);
+
+        const char *names[] = {"foo", "bar", "baz"};
+        const char *expected[] = {"X F\nY\n", "Xbar\n", "bar\n"};
+        for (size_t i = 0; i < 3; i++)
+        {
+            char output_path[ix_MAX_PATH * 2];
+            ix_snprintf(output_path, sizeof(output_path), "%s/%s", output_dirname, names[i]);
+            ix_EXPECT_EQSTR(ix_load_file(output_path).get(), expected[i]);
+            ix_EXPECT(ix_remove_file(output_path).is_ok());
+        }
+        ix_EXPECT(ix_remove_directory(output_dirname).is_ok());
+    }
+
+    { // Batch with a prelude whose Lua code looks at the macros, as they were when it ran.
+        const ix_TempFileR prelude("#+LUA_BEGIN\n"
+                                   "v = gokurai.get('foo') or 'nil'\n"
+                                   "gokurai.define('a', 'A'); t = gokurai.get('a')\n"
+                                   "#+LUA_END\n"
+                                   "#+MACRO foo new\n"
+                                   "#+LUA_BEGIN\n"
+                                   "ok = tostring(gokurai.undefine('foo'))\n"
+                                   "#+LUA_END\n"
+                                   "#+MACRO a B\n");
+        const ix_TempFileR foo("[[[__LUA__(v .. ' ' .. t .. ' ' .. ok)]]] [[[a]]]\n");
+        char output_path[ix_MAX_PATH + 1];
+        ix_snprintf(output_path, sizeof(output_path), "%s", ix_temp_filename("gokurai_"));
+        char manifest_text[ix_MAX_PATH * 4];
+        ix_snprintf(manifest_text, sizeof(manifest_text), "%s %s %s\n", prelude.filename(), foo.filename(),
+                    output_path);
+        const ix_TempFileR manifest(manifest_text);
+        ix_TempFileW out;
+        ix_TempFileW err;
+        const int ret =
+            gokurai_main(null, out.file_handle(), err.file_handle(), {"gokurai", "--batch", manifest.filename()});
+        ix_EXPECT(ret == 0);
+        ix_EXPECT_EQSTR(ix_load_file(output_path).get(), "nil A true B\n");
+        ix_EXPECT(ix_remove_file(output_path).is_ok());
+    }
+
+    { // Library.
+        const ix_TempFileR prelude("header\n#+MACRO x X\n#+LUA_BEGIN\nfunction f() return 'F' end\n#+LUA_END\n");
+        const ix_TempFileR foo("[[[x]]] [[[__LUA__(f())]]]\n");
+        const ix_TempFile library;
+        {
+            ix_TempFileW out;
+            ix_TempFileW err;
+            const int ret = gokurai_main(null, out.file_handle(), err.file_handle(),
+                                         {"gokurai", "--compile-library", library.filename(), prelude.filename()});
+            ix_EXPECT(ret == 0);
+            ix_EXPECT_EQSTR(out.data(), "");
+            ix_EXPECT_EQSTR(err.data(), "");
+        }
+
+        {
+            ix_TempFileW out;
+            ix_TempFileW err;
+            const int ret = gokurai_main(null, out.file_handle(), err.file_handle(),
+                                         {"gokurai", "--library", library.filename(), foo.filename()});
+            ix_EXPECT(ret == 0);
+            ix_EXPECT_EQSTR(out.data(), "X F\n");
+            ix_EXPECT_EQSTR(err.data(), "");
+        }
+
+        { // As a batch prelude.
+            char output_path[ix_MAX_PATH + 1];
+            ix_snprintf(output_path, sizeof(output_path), "%s", ix_temp_filename("gokurai_"));
+            char manifest_text[ix_MAX_PATH * 4];
+            ix_snprintf(manifest_text, sizeof(manifest_text), "%s %s %s\n", library.filename(), foo.filename(),
+                        output_path);
+            const ix_TempFileR manifest(manifest_text);
+            ix_TempFileW out;
+            ix_TempFileW err;
+            const int ret =
+                gokurai_main(null, out.file_handle(), err.file_handle(), {"gokurai", "--batch", manifest.filename()});
+            ix_EXPECT(ret == 0);
+            ix_EXPECT(ix_strstr(err.data(), "1 jobs, 1 preludes") != nullptr);
+            ix_EXPECT_EQSTR(ix_load_file(output_path).get(), "X F\n");
+            ix_EXPECT(ix_remove_file(output_path).is_ok());
+        }
+
+        { // With a text batch prelude, which starts with the library.
+            const ix_TempFileR text_prelude("#+MACRO y <[[[x]]]>\n");
+            const ix_TempFileR bar("[[[y]]] [[[__LUA__(f())]]]\n");
+            char output_path[ix_MAX_PATH + 1];
+            ix_snprintf(output_path, sizeof(output_path), "%s", ix_temp_filename("gokurai_"));
+            char manifest_text[ix_MAX_PATH * 4];
+            ix_snprintf(manifest_text, sizeof(manifest_text), "%s %s %s\n", text_prelude.filename(), bar.filename(),
+                        output_path);
+            const ix_TempFileR manifest(manifest_text);
+            ix_TempFileW out;
+            ix_TempFileW err;
+            const int ret = gokurai_main(null, out.file_handle(), err.file_handle(),
+                                         {"gokurai", "--library", library.filename(), "--batch", manifest.filename()});
+            ix_EXPECT(ret == 0);
+            ix_EXPECT_EQSTR(ix_load_file(output_path).get(), "<X> F\n");
+            ix_EXPECT(ix_remove_file(output_path).is_ok());
+        }
+
+        { // With a library batch prelude.
+            char manifest_text[ix_MAX_PATH * 4];
+            ix_snprintf(manifest_text, sizeof(manifest_text), "%s %s %s\n", library.filename(), foo.filename(),
+                        ix_temp_filename("gokurai_"));
+            const ix_TempFileR manifest(manifest_text);
+            ix_TempFileW out;
+            ix_TempFileW err;
+            const int ret = gokurai_main(null, out.file_handle(), err.file_handle(),
+                                         {"gokurai", "--library", library.filename(), "--batch", manifest.filename()});
+            ix_EXPECT(ret == 1);
+            char expected[ix_MAX_PATH * 2];
+            ix_snprintf(expected, sizeof(expected), ERROR_TEXT_LIBRARY_PRELUDE_WITH_LIBRARY, library.filename());
+            ix_EXPECT_EQSTR(err.data(), expected);
+        }
+
+        { // Not a library.
+            ix_TempFileW out;
+            ix_TempFileW err;
+            const int ret = gokurai_main(null, out.file_handle(), err.file_handle(),
+                                         {"gokurai", "--library", prelude.filename(), foo.filename()});
+            ix_EXPECT(ret == 1);
+            char expected[ix_MAX_PATH * 2];
+            ix_snprintf(expected, sizeof(expected), ERROR_TEXT_LIBRARY_LOAD_FAILED, prelude.filename());
+            ix_EXPECT_EQSTR(err.data(), expected);
+        }
+    }
+
+    { // Invalid batch manifest.
+        const ix_TempFileR manifest("a b\n");
+        ix_TempFileW out;
+        ix_TempFileW err;
+        const int ret =
+            gokurai_main(null, out.file_handle(), err.file_handle(), {"gokurai", "--batch", manifest.filename()});
+        ix_EXPECT(ret == 1);
+        char expected[ix_MAX_PATH * 2];
+        ix_snprintf(expected, sizeof(expected), ERROR_TEXT_INVALID_MANIFEST_LINE, manifest.filename(), size_t{1});
+        ix_EXPECT_EQSTR(err.data(), expected);
+    }
+
+    { // Invalid number of jobs.
+        ix_TempFileW out;
+        ix_TempFileW err;
+        gokurai_main(null, out.file_handle(), err.file_handle(), {"gokurai", "-j", "0", "-o", "foo", "-"});
+        ix_EXPECT_EQSTR(out.data(), "");
+        ix_EXPECT_EQSTR(err.data(), "Invalid number of jobs: 0\n");
+    }
+
+    { // stdin with an output directory.
+        ix_TempFileW out;
+        ix_TempFileW err;
+        gokurai_main(null, out.file_handle(), err.file_handle(), {"gokurai", "-o", "foo", "-"});
+        ix_EXPECT_EQSTR(out.data(), "");
+        ix_EXPECT_EQSTR(err.data(), ERROR_TEXT_STDIN_WITH_OUTPUT_DIR);
+    }
+
     { // Read from stdin erroneously.
         ix_TempFileW out;
         ix_TempFileW err;
@@ -1,11 +1,17 @@
 #include "ix_Clock.hpp"
+#include "ix_TempFile.hpp"
 #include "ix_doctest.hpp"
 
+#include <math.h>
 #include <sokol_time.h>
+#include <stdlib.h>
 
 ix_Clock::BenchmarkOption::BenchmarkOption()
     : num_warmups(3),
-      num_trials(10)
+      num_trials(10),
+      num_iterations(1),
+      target_trial_sec(0.01),
+      json(false)
 {
 }
 
@@ -108,6 +114,117 @@ void ix_Clock::report_ns(const char *title, const ix_FileHandle *file) const
     this_or_stdout(file)->write_stringf("[ix_Clock] %s: %f ns\n", title, d);
 }
 
+size_t ix_Clock::calibrate_num_iterations(size_t num_iterations, double elapsed_sec, double target_sec)
+{
+    if (elapsed_sec >= target_sec)
+    {
+        return num_iterations;
+    }
+
+    // Too short a trial says little about how long a call takes, so grow by at most 100 times at once.
+    const double scale = (elapsed_sec * 100.0 < target_sec) ? 100.0 : (target_sec / elapsed_sec) * 1.2;
+    const double next = static_cast<double>(num_iterations) * scale;
+    return (next > static_cast<double>(num_iterations + 1)) ? static_cast<size_t>(next) : num_iterations + 1;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    const double x = *static_cast<const double *>(a);
+    const double y = *static_cast<const double *>(b);
+    return (x < y) ? -1 : (y < x) ? 1 : 0;
+}
+
+// Nearest-rank percentile of sorted values.
+static double percentile(const double *sorted, size_t n, size_t p)
+{
+    const size_t rank = (p * n + 99) / 100;
+    return sorted[(rank == 0) ? 0 : rank - 1];
+}
+
+ix_Clock::BenchmarkResult ix_Clock::summarize_benchmark(double *trial_secs, size_t num_trials, size_t num_iterations)
+{
+    ix_ASSERT(num_trials > 0);
+    qsort(trial_secs, num_trials, sizeof(double), compare_double);
+
+    double sum = 0.0;
+    for (size_t i = 0; i < num_trials; i++)
+    {
+        sum += trial_secs[i];
+    }
+    const double mean = sum / static_cast<double>(num_trials);
+
+    double sum_of_squares = 0.0;
+    for (size_t i = 0; i < num_trials; i++)
+    {
+        const double d = trial_secs[i] - mean;
+        sum_of_squares += d * d;
+    }
+
+    const size_t middle = num_trials / 2;
+    BenchmarkResult result;
+    result.num_trials = num_trials;
+    result.num_iterations = num_iterations;
+    result.min_sec = trial_secs[0];
+    result.median_sec =
+        ((num_trials % 2) == 1) ? trial_secs[middle] : (trial_secs[middle - 1] + trial_secs[middle]) / 2.0;
+    result.p90_sec = percentile(trial_secs, num_trials, 90);
+    result.p99_sec = percentile(trial_secs, num_trials, 99);
+    result.max_sec = trial_secs[num_trials - 1];
+    result.mean_sec = mean;
+    result.stddev_sec = (num_trials == 1) ? 0.0 : sqrt(sum_of_squares / static_cast<double>(num_trials - 1));
+    return result;
+}
+
+void ix_Clock::report_benchmark(const char *title, const BenchmarkResult &result, bool json, const ix_FileHandle *file)
+{
+    file = this_or_stdout(file);
+
+    if (json)
+    {
+        // Always in nanoseconds, so that the lines of different runs can be compared as they are.
+        file->write_string("{\"title\": \"");
+        for (const char *p = title; *p != '\0'; p++)
+        {
+            if ((*p == '"') || (*p == '\\'))
+            {
+                file->write_char('\\');
+            }
+            file->write_char(*p);
+        }
+        file->write_stringf("\", \"trials\": %zu, \"iterations\": %zu, \"min_ns\": %.3f, \"median_ns\": %.3f, "
+                            "\"p90_ns\": %.3f, \"p99_ns\": %.3f, \"max_ns\": %.3f, \"mean_ns\": %.3f, "
+                            "\"stddev_ns\": %.3f}\n",
+                            result.num_trials, result.num_iterations, result.min_sec * 1e9, result.median_sec * 1e9,
+                            result.p90_sec * 1e9, result.p99_sec * 1e9, result.max_sec * 1e9, result.mean_sec * 1e9,
+                            result.stddev_sec * 1e9);
+        return;
+    }
+
+    const char *unit = "sec";
+    double scale = 1.0;
+    if (result.median_sec < 1e-6)
+    {
+        unit = "ns";
+        scale = 1e9;
+    }
+    else if (result.median_sec < 1e-3)
+    {
+        unit = "us";
+        scale = 1e6;
+    }
+    else if (result.median_sec < 1.0)
+    {
+        unit = "ms";
+        scale = 1e3;
+    }
+
+    file->write_stringf("[ix_Clock] Benchmark result: %9.3f %-3s (min %.3f, p90 %.3f, p99 %.3f, stddev %.3f; "
+                        "%zu x %zu) - %s\n",
+                        result.median_sec * scale, unit, result.min_sec * scale, result.p90_sec * scale,
+                        result.p99_sec * scale, result.stddev_sec * scale, result.num_trials, result.num_iterations,
+                        title);
+}
+
 ix_TEST_CASE("ix_Clock::elaplsed")
 {
     // without capture()
@@ -220,20 +337,82 @@ ix_TEST_CASE("ix_Clock: report")
 ix_TEST_CASE("ix_Clock: benchmark")
 {
     ix_Clock c;
-    const ix_Clock::BenchmarkOption option;
+    ix_Clock::BenchmarkOption option;
     const ix_FileHandle null = ix_FileHandle::null();
 
-    auto f = []() {
+    size_t num_calls = 0;
+    auto f = [&]() {
         size_t sum = 0;
         for (size_t i = 0; i < 1000; i++)
         {
             sum += i;
         }
         ix_EXPECT(sum == 499500);
+        num_calls += 1;
     };
 
-    c.benchmark_sec("sum", f, option, &null);
-    c.benchmark_ms("sum", f, option, &null);
-    c.benchmark_us("sum", f, option, &null);
-    c.benchmark_ns("sum", f, option, &null);
+    const ix_Clock::BenchmarkResult result = c.benchmark("sum", f, option, &null);
+    ix_EXPECT(num_calls == option.num_warmups + option.num_trials);
+    ix_EXPECT(result.num_trials == option.num_trials);
+    ix_EXPECT(result.num_iterations == 1);
+    ix_EXPECT(result.min_sec <= result.median_sec);
+    ix_EXPECT(result.median_sec <= result.p90_sec);
+    ix_EXPECT(result.p90_sec <= result.p99_sec);
+    ix_EXPECT(result.p99_sec <= result.max_sec);
+
+    num_calls = 0;
+    option.num_warmups = 0;
+    option.num_trials = 2;
+    option.num_iterations = 0;
+    option.target_trial_sec = 0.001;
+    option.json = true;
+    const ix_Clock::BenchmarkResult calibrated = c.benchmark("sum", f, option, &null);
+    ix_EXPECT(calibrated.num_iterations > 1);
+    ix_EXPECT(num_calls > 2 * calibrated.num_iterations);
+}
+
+ix_TEST_CASE("ix_Clock: summarize_benchmark")
+{
+    double trial_secs[] = {5.0, 1.0, 4.0, 2.0, 3.0, 10.0, 6.0, 7.0, 9.0, 8.0};
+    const ix_Clock::BenchmarkResult result = ix_Clock::summarize_benchmark(trial_secs, ix_LENGTH_OF(trial_secs), 4);
+    ix_EXPECT(result.num_trials == 10);
+    ix_EXPECT(result.num_iterations == 4);
+    ix_EXPECT(result.min_sec == 1.0);
+    ix_EXPECT(result.median_sec == 5.5);
+    ix_EXPECT(result.p90_sec == 9.0);
+    ix_EXPECT(result.p99_sec == 10.0);
+    ix_EXPECT(result.max_sec == 10.0);
+    ix_EXPECT(result.mean_sec == 5.5);
+    ix_EXPECT(fabs(result.stddev_sec - 3.0276503540974917) < 1e-9);
+    ix_EXPECT(trial_secs[0] == 1.0);
+
+    double one[] = {2.0};
+    const ix_Clock::BenchmarkResult single = ix_Clock::summarize_benchmark(one, 1, 1);
+    ix_EXPECT(single.median_sec == 2.0);
+    ix_EXPECT(single.p90_sec == 2.0);
+    ix_EXPECT(single.stddev_sec == 0.0);
+}
+
+ix_TEST_CASE("ix_Clock: report_benchmark")
+{
+    double trial_secs[] = {0.002, 0.001, 0.003};
+    const ix_Clock::BenchmarkResult result = ix_Clock::summarize_benchmark(trial_secs, 3, 1);
+
+    {
+        ix_TempFileW file;
+        ix_Clock::report_benchmark("a \"b\"", result, false, &file.file_handle());
+        file.close();
+        ix_EXPECT_EQSTR(file.data(), "[ix_Clock] Benchmark result:     2.000 ms  (min 1.000, p90 3.000, p99 3.000, "
+                                     "stddev 1.000; 3 x 1) - a \"b\"\n");
+    }
+
+    {
+        ix_TempFileW file;
+        ix_Clock::report_benchmark("a \"b\"", result, true, &file.file_handle());
+        file.close();
+        ix_EXPECT_EQSTR(file.data(), "{\"title\": \"a \\\"b\\\"\", \"trials\": 3, \"iterations\": 1, "
+                                     "\"min_ns\": 1000000.000, \"median_ns\": 2000000.000, \"p90_ns\": 3000000.000, "
+                                     "\"p99_ns\": 3000000.000, \"max_ns\": 3000000.000, \"mean_ns\": 2000000.000, "
+                                     "\"stddev_ns\": 1000000.000}\n");
+    }
 }
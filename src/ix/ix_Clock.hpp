@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ix.hpp"
+#include "ix_Vector.hpp"
 #include "ix_file.hpp"
 
 class ix_Clock
@@ -31,105 +32,80 @@ class ix_Clock
     {
         size_t num_warmups;
         size_t num_trials;
+        size_t num_iterations;   // Calls per trial. Zero calibrates it so that a trial takes `target_trial_sec`.
+        double target_trial_sec; // Used only for calibration.
+        bool json;               // Report as a line of JSON instead of text.
 
         BenchmarkOption();
     };
 
-    // TODO: Auto-detect the proper unit of time to print.
-
-    template <typename F>
-    void benchmark_sec(const char *title, const F &f, const BenchmarkOption &option = BenchmarkOption(),
-                       const ix_FileHandle *file = nullptr)
+    // The time of a call, in seconds, over the trials.
+    struct BenchmarkResult
     {
-        // Warnup
-        for (size_t i = 0; i < option.num_warmups; i++)
-        {
-            f();
-        }
-
-        capture();
-        for (size_t i = 0; i < option.num_trials; i++)
-        {
-            f();
-        }
-
-        double elapsed = elaplsed_sec() / static_cast<double>(option.num_trials);
-
-        if (file == nullptr)
-        {
-            file = &ix_FileHandle::of_stdout();
-        }
-        file->write_stringf("[ix_Clock] Benchmark result: %9.3f sec - %s\n", elapsed, title);
-    }
+        size_t num_trials;
+        size_t num_iterations;
+        double min_sec;
+        double median_sec;
+        double p90_sec;
+        double p99_sec;
+        double max_sec;
+        double mean_sec;
+        double stddev_sec;
+    };
 
+    // Calls `f` for the warmups, then times each trial and reports the time of a call to `file` (stdout by default).
     template <typename F>
-    void benchmark_ms(const char *title, const F &f, const BenchmarkOption &option = BenchmarkOption(),
-                      const ix_FileHandle *file = nullptr)
+    BenchmarkResult benchmark(const char *title, const F &f, const BenchmarkOption &option = BenchmarkOption(),
+                              const ix_FileHandle *file = nullptr)
     {
         for (size_t i = 0; i < option.num_warmups; i++)
         {
             f();
         }
 
-        capture();
-        for (size_t i = 0; i < option.num_trials; i++)
-        {
-            f();
-        }
-
-        double elapsed = elaplsed_ms() / static_cast<double>(option.num_trials);
-        if (file == nullptr)
-        {
-            file = &ix_FileHandle::of_stdout();
-        }
-        file->write_stringf("[ix_Clock] Benchmark result: %9.3f ms - %s\n", elapsed, title);
-    }
-
-    template <typename F>
-    void benchmark_us(const char *title, const F &f, const BenchmarkOption &option = BenchmarkOption(),
-                      const ix_FileHandle *file = nullptr)
-    {
-        // Warnup
-        for (size_t i = 0; i < option.num_warmups; i++)
+        size_t num_iterations = option.num_iterations;
+        if (num_iterations == 0)
         {
-            f();
+            num_iterations = 1;
+            while (true)
+            {
+                capture();
+                for (size_t i = 0; i < num_iterations; i++)
+                {
+                    f();
+                }
+                const size_t next = calibrate_num_iterations(num_iterations, elaplsed_sec(), option.target_trial_sec);
+                if (next == num_iterations)
+                {
+                    break;
+                }
+                num_iterations = next;
+            }
         }
 
-        capture();
+        ix_Vector<double> trial_secs;
+        trial_secs.reserve(option.num_trials);
         for (size_t i = 0; i < option.num_trials; i++)
         {
-            f();
+            capture();
+            for (size_t j = 0; j < num_iterations; j++)
+            {
+                f();
+            }
+            trial_secs.push_back(elaplsed_sec() / static_cast<double>(num_iterations));
         }
 
-        double elapsed = elaplsed_us() / static_cast<double>(option.num_trials);
-        if (file == nullptr)
-        {
-            file = &ix_FileHandle::of_stdout();
-        }
-        file->write_stringf("[ix_Clock] Benchmark result: %9.3f us - %s\n", elapsed, title);
+        const BenchmarkResult result = summarize_benchmark(trial_secs.data(), trial_secs.size(), num_iterations);
+        report_benchmark(title, result, option.json, file);
+        return result;
     }
 
-    template <typename F>
-    void benchmark_ns(const char *title, const F &f, const BenchmarkOption &option = BenchmarkOption(),
-                      const ix_FileHandle *file = nullptr)
-    {
-        // Warnup
-        for (size_t i = 0; i < option.num_warmups; i++)
-        {
-            f();
-        }
-
-        capture();
-        for (size_t i = 0; i < option.num_trials; i++)
-        {
-            f();
-        }
+    // Sorts `trial_secs`.
+    static BenchmarkResult summarize_benchmark(double *trial_secs, size_t num_trials, size_t num_iterations);
+    static void report_benchmark(const char *title, const BenchmarkResult &result, bool json,
+                                 const ix_FileHandle *file = nullptr);
 
-        double elapsed = elaplsed_ns() / static_cast<double>(option.num_trials);
-        if (file == nullptr)
-        {
-            file = &ix_FileHandle::of_stdout();
-        }
-        file->write_stringf("[ix_Clock] Benchmark result: %9.3f ns - %s\n", elapsed, title);
-    }
+  private:
+    // Returns `num_iterations` once a trial of that many calls takes `target_sec`, and a larger count otherwise.
+    static size_t calibrate_num_iterations(size_t num_iterations, double elapsed_sec, double target_sec);
 };
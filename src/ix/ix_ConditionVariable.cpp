@@ -0,0 +1,114 @@
+#include "ix_ConditionVariable.hpp"
+#include "ix_Mutex.hpp"
+#include "ix_Thread.hpp"
+#include "ix_doctest.hpp"
+
+#if ix_PLATFORM(WIN)
+#include "ix_Windows.hpp"
+#include <synchapi.h>
+#else
+#include <pthread.h>
+#endif
+
+#if ix_PLATFORM(WIN)
+using NativeConditionVariable = CONDITION_VARIABLE;
+#else
+using NativeConditionVariable = pthread_cond_t;
+#endif
+
+ix_ConditionVariable::ix_ConditionVariable()
+{
+    static_assert(sizeof(NativeConditionVariable) <= sizeof(m_detail));
+    NativeConditionVariable *handle = reinterpret_cast<NativeConditionVariable *>(m_detail);
+#if ix_PLATFORM(WIN)
+    InitializeConditionVariable(handle);
+#else
+    pthread_cond_init(handle, nullptr);
+#endif
+}
+
+ix_ConditionVariable::~ix_ConditionVariable()
+{
+#if !ix_PLATFORM(WIN)
+    NativeConditionVariable *handle = reinterpret_cast<NativeConditionVariable *>(m_detail);
+    pthread_cond_destroy(handle);
+#endif
+}
+
+void ix_ConditionVariable::wait(ix_Mutex &mutex)
+{
+    NativeConditionVariable *handle = reinterpret_cast<NativeConditionVariable *>(m_detail);
+#if ix_PLATFORM(WIN)
+    SleepConditionVariableCS(handle, mutex.native_handle<CRITICAL_SECTION>(), INFINITE);
+#else
+    pthread_cond_wait(handle, mutex.native_handle<pthread_mutex_t>());
+#endif
+}
+
+void ix_ConditionVariable::notify_one()
+{
+    NativeConditionVariable *handle = reinterpret_cast<NativeConditionVariable *>(m_detail);
+#if ix_PLATFORM(WIN)
+    WakeConditionVariable(handle);
+#else
+    pthread_cond_signal(handle);
+#endif
+}
+
+void ix_ConditionVariable::notify_all()
+{
+    NativeConditionVariable *handle = reinterpret_cast<NativeConditionVariable *>(m_detail);
+#if ix_PLATFORM(WIN)
+    WakeAllConditionVariable(handle);
+#else
+    pthread_cond_broadcast(handle);
+#endif
+}
+
+ix_TEST_CASE("ix_ConditionVariable")
+{
+    constexpr static const size_t N = 8;
+
+    static struct SharedData
+    {
+        ix_Mutex *mutex;
+        ix_ConditionVariable *cv;
+        size_t turn;
+        size_t order[N];
+    } shared_data;
+
+    ix_Mutex mutex;
+    ix_ConditionVariable cv;
+    shared_data.mutex = &mutex;
+    shared_data.cv = &cv;
+    shared_data.turn = 0;
+
+    // Each thread waits for its turn, so they finish in order no matter how they are scheduled.
+    ix_Thread threads[N];
+    for (size_t i = 0; i < N; i++)
+    {
+        const size_t my_turn = N - 1 - i;
+        threads[i].start([my_turn]() {
+            shared_data.mutex->lock();
+            while (shared_data.turn != my_turn)
+            {
+                shared_data.cv->wait(*shared_data.mutex);
+            }
+            shared_data.order[my_turn] = my_turn;
+            shared_data.turn += 1;
+            shared_data.cv->notify_all();
+            shared_data.mutex->unlock();
+        });
+    }
+
+    for (size_t i = 0; i < N; i++)
+    {
+        threads[i].join();
+    }
+
+    ix_EXPECT(shared_data.turn == N);
+    for (size_t i = 0; i < N; i++)
+    {
+        ix_EXPECT(shared_data.order[i] == i);
+    }
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "ix.hpp"
+
+class ix_Mutex;
+
+class ix_ConditionVariable
+{
+    alignas(void *) uint8_t m_detail[64];
+
+  public:
+    ix_ConditionVariable();
+    ix_ConditionVariable(const ix_ConditionVariable &) = delete;
+    ix_ConditionVariable(ix_ConditionVariable &&) = delete;
+    ix_ConditionVariable &operator=(const ix_ConditionVariable &) = delete;
+    ix_ConditionVariable &operator=(ix_ConditionVariable &&) = delete;
+    ~ix_ConditionVariable();
+
+    // `mutex` must be locked. It is unlocked while waiting and locked again before returning.
+    // Spurious wakeups are possible, so check the condition in a loop.
+    void wait(ix_Mutex &mutex);
+    void notify_one();
+    void notify_all();
+};
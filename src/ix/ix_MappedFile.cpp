@@ -0,0 +1,256 @@
+#include "ix_MappedFile.hpp"
+#include "ix_TempFile.hpp"
+#include "ix_assert.hpp"
+#include "ix_doctest.hpp"
+#include "ix_file.hpp"
+#include "ix_memory.hpp"
+#include "ix_string.hpp"
+#include "ix_utility.hpp"
+
+#if ix_PLATFORM(WIN)
+#include "ix_Windows.hpp"
+
+#include <fileapi.h>
+#include <handleapi.h>
+#include <memoryapi.h>
+#elif ix_PLATFORM(LINUX) || ix_PLATFORM(MAC)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+ix_MappedFile::ix_MappedFile()
+    : m_data(nullptr),
+      m_size(0),
+      m_mapping(nullptr),
+      m_mapping_size(0)
+{
+}
+
+ix_MappedFile::ix_MappedFile(const ix_FileHandle &file)
+    : ix_MappedFile()
+{
+#if ix_PLATFORM(WIN)
+    const HANDLE handle = file.v.handle;
+    if ((handle == INVALID_HANDLE_VALUE) || (GetFileType(handle) != FILE_TYPE_DISK))
+    {
+        return;
+    }
+
+    LARGE_INTEGER file_size;
+    LARGE_INTEGER offset;
+    LARGE_INTEGER zero = {};
+    if ((GetFileSizeEx(handle, &file_size) == 0) || (SetFilePointerEx(handle, zero, &offset, FILE_CURRENT) == 0) ||
+        (offset.QuadPart > file_size.QuadPart))
+    {
+        return;
+    }
+
+    const size_t mapping_size = static_cast<size_t>(file_size.QuadPart);
+    const size_t start = static_cast<size_t>(offset.QuadPart);
+    if (start == mapping_size)
+    {
+        m_data = "";
+    }
+    else
+    {
+        const HANDLE mapping = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr)
+        {
+            return;
+        }
+        void *p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping); // The view keeps the mapping alive.
+        if (p == nullptr)
+        {
+            return;
+        }
+        m_mapping = p;
+        m_mapping_size = mapping_size;
+        m_data = static_cast<const char *>(p) + start;
+        m_size = mapping_size - start;
+    }
+
+    SetFilePointerEx(handle, zero, nullptr, FILE_END);
+#elif ix_PLATFORM(LINUX) || ix_PLATFORM(MAC)
+    const int fd = file.v.fd;
+    struct stat sb;
+    if ((fd == -1) || (fstat(fd, &sb) != 0) || ((sb.st_mode & S_IFMT) != S_IFREG))
+    {
+        return;
+    }
+
+    const off_t offset = lseek(fd, 0, SEEK_CUR);
+    if ((offset == off_t{-1}) || (offset > sb.st_size))
+    {
+        return;
+    }
+
+    const size_t mapping_size = static_cast<size_t>(sb.st_size);
+    const size_t start = static_cast<size_t>(offset);
+    if (start == mapping_size)
+    {
+        m_data = "";
+    }
+    else
+    {
+        void *p = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            return;
+        }
+        posix_madvise(p, mapping_size, POSIX_MADV_SEQUENTIAL);
+        m_mapping = p;
+        m_mapping_size = mapping_size;
+        m_data = static_cast<const char *>(p) + start;
+        m_size = mapping_size - start;
+    }
+
+    lseek(fd, 0, SEEK_END);
+#else
+    ix_UNUSED(file);
+#endif
+}
+
+ix_MappedFile::~ix_MappedFile()
+{
+    unmap();
+}
+
+ix_MappedFile::ix_MappedFile(ix_MappedFile &&other) noexcept
+    : m_data(other.m_data),
+      m_size(other.m_size),
+      m_mapping(other.m_mapping),
+      m_mapping_size(other.m_mapping_size)
+{
+    other.m_data = nullptr;
+    other.m_size = 0;
+    other.m_mapping = nullptr;
+    other.m_mapping_size = 0;
+}
+
+ix_MappedFile &ix_MappedFile::operator=(ix_MappedFile &&other) noexcept
+{
+    if (this == &other)
+    {
+        return *this;
+    }
+
+    unmap();
+    m_data = other.m_data;
+    m_size = other.m_size;
+    m_mapping = other.m_mapping;
+    m_mapping_size = other.m_mapping_size;
+    other.m_data = nullptr;
+    other.m_size = 0;
+    other.m_mapping = nullptr;
+    other.m_mapping_size = 0;
+
+    return *this;
+}
+
+bool ix_MappedFile::is_valid() const
+{
+    return (m_data != nullptr);
+}
+
+const char *ix_MappedFile::data() const
+{
+    return m_data;
+}
+
+size_t ix_MappedFile::size() const
+{
+    return m_size;
+}
+
+void ix_MappedFile::unmap()
+{
+    if (m_mapping != nullptr)
+    {
+#if ix_PLATFORM(WIN)
+        UnmapViewOfFile(m_mapping);
+#elif ix_PLATFORM(LINUX) || ix_PLATFORM(MAC)
+        munmap(m_mapping, m_mapping_size);
+#endif
+    }
+
+    m_data = nullptr;
+    m_size = 0;
+    m_mapping = nullptr;
+    m_mapping_size = 0;
+}
+
+void ix_MappedFile::drop_pages_before(size_t offset) const
+{
+    ix_ASSERT(offset <= m_size);
+#if ix_PLATFORM(LINUX) || ix_PLATFORM(MAC)
+    if (m_mapping == nullptr)
+    {
+        return;
+    }
+
+    const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t mapping_offset = static_cast<size_t>(m_data - static_cast<const char *>(m_mapping)) + offset;
+    const size_t length = mapping_offset - (mapping_offset % page_size);
+    if (length != 0)
+    {
+        madvise(m_mapping, length, MADV_DONTNEED); // Never written to, so the pages are read again if needed.
+    }
+#else
+    ix_UNUSED(offset);
+#endif
+}
+
+#if ix_PLATFORM(LINUX) || ix_PLATFORM(MAC) || ix_PLATFORM(WIN)
+ix_TEST_CASE("ix_MappedFile")
+{
+    {
+        const ix_MappedFile mapped;
+        ix_EXPECT(!mapped.is_valid());
+    }
+
+    {
+        const ix_TempFileR file("hello world\n");
+        ix_MappedFile mapped(file.file_handle());
+        ix_EXPECT(mapped.is_valid());
+        ix_EXPECT(mapped.size() == 12);
+        ix_EXPECT(ix_memcmp(mapped.data(), "hello world\n", 12) == 0);
+
+        char c;
+        ix_EXPECT(file.file_handle().read(&c, 1) == 0); // The handle is at the end.
+
+        const ix_MappedFile moved(ix_move(mapped));
+        ix_EXPECT(!mapped.is_valid()); // NOLINT(bugprone-use-after-move)
+        ix_EXPECT(moved.size() == 12);
+
+        mapped = ix_MappedFile(file.file_handle());
+        ix_EXPECT(mapped.is_valid());
+        ix_EXPECT(mapped.size() == 0);
+    }
+
+    {
+        const ix_TempFileR file("hello world\n");
+        char buf[6];
+        ix_EXPECT(file.file_handle().read(buf, 6) == 6);
+        const ix_MappedFile mapped(file.file_handle());
+        ix_EXPECT(mapped.size() == 6);
+        ix_EXPECT(ix_memcmp(mapped.data(), "world\n", 6) == 0);
+        mapped.drop_pages_before(6);
+        ix_EXPECT(ix_memcmp(mapped.data(), "world\n", 6) == 0);
+    }
+
+    {
+        const ix_TempFileR file("");
+        const ix_MappedFile mapped(file.file_handle());
+        ix_EXPECT(mapped.is_valid());
+        ix_EXPECT(mapped.size() == 0);
+    }
+
+    {
+        const ix_FileHandle null = ix_FileHandle::null(ix_READ_ONLY);
+        const ix_MappedFile mapped(null);
+        ix_EXPECT(!mapped.is_valid());
+    }
+}
+#endif
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "ix.hpp"
+
+class ix_FileHandle;
+
+// A read-only view of a regular file from the current position of a file handle to its end.
+// Mapping fails for pipes, terminals and the like, which are left untouched so that the caller can read them instead.
+// On success, the file handle is moved to the end of the file as if the view had been read.
+class ix_MappedFile
+{
+    const char *m_data;
+    size_t m_size;
+    void *m_mapping;
+    size_t m_mapping_size;
+
+  public:
+    ix_MappedFile();
+    explicit ix_MappedFile(const ix_FileHandle &file);
+    ~ix_MappedFile();
+
+    ix_MappedFile(const ix_MappedFile &) = delete;
+    ix_MappedFile &operator=(const ix_MappedFile &) = delete;
+    ix_MappedFile(ix_MappedFile &&other) noexcept;
+    ix_MappedFile &operator=(ix_MappedFile &&other) noexcept;
+
+    bool is_valid() const;
+    const char *data() const;
+    size_t size() const;
+    void unmap();
+
+    // Tells the OS that the view before `offset` will not be read again, so that its pages need not stay resident.
+    void drop_pages_before(size_t offset) const;
+};
@@ -36,17 +36,21 @@ void ix_StringArena::clear()
     {
         m_pools.set_size(1);
         m_current_pool = &m_pools[0];
+        m_current_pool->remain += static_cast<size_t>(m_current_pool->next - m_current_pool->start);
+        m_current_pool->next = m_current_pool->start;
     }
 }
 
 ix_TEST_CASE("ix_StringArena::clear()")
 {
     ix_StringArena arena(128);
+    const char *first_string;
 
     {
         const char *s1 = arena.push_str("foo");
         ix_EXPECT_EQSTR(s1, "foo");
         ix_EXPECT(arena.push_str("foo") != s1);
+        first_string = s1;
 
         const char *s2 = arena.push_str("bar");
         ix_EXPECT_EQSTR(s2, "bar");
@@ -61,6 +65,7 @@ ix_TEST_CASE("ix_StringArena::clear()")
     {
         const char *s1 = arena.push_str("foo");
         ix_EXPECT_EQSTR(s1, "foo");
+        ix_EXPECT(s1 == first_string); // The first pool is reused.
         ix_EXPECT(arena.push_str("foo") != s1);
 
         const char *s2 = arena.push_str("bar");
@@ -231,6 +236,56 @@ ix_TEST_CASE("ix_StringArena::push_between")
     ix_EXPECT_EQSTR(s2, "world");
 }
 
+void ix_StringArena::detach(ix_Vector<char *> &chunks)
+{
+    for (const Pool &pool : m_pools)
+    {
+        if (pool.next != pool.start)
+        {
+            chunks.push_back(pool.start);
+        }
+        else
+        {
+            ix_FREE(pool.start);
+        }
+    }
+
+    m_pools.clear();
+    m_current_pool = nullptr;
+}
+
+ix_TEST_CASE("ix_StringArena::detach")
+{
+    ix_Vector<char *> chunks;
+
+    {
+        ix_StringArena arena(4);
+        arena.detach(chunks);
+        ix_EXPECT(chunks.empty());
+
+        const char *s1 = arena.push_str("foo");
+        const char *s2 = arena.push_str("bar");
+        arena.detach(chunks);
+        ix_EXPECT(chunks.size() == 2);
+        ix_EXPECT(arena.size() == 0);
+
+        const char *s3 = arena.push_str("baz");
+        ix_EXPECT_EQSTR(s1, "foo");
+        ix_EXPECT_EQSTR(s2, "bar");
+        ix_EXPECT_EQSTR(s3, "baz");
+
+        arena.clear();
+        arena.push_str("xxx");
+        ix_EXPECT_EQSTR(s1, "foo");
+        ix_EXPECT_EQSTR(s2, "bar");
+    }
+
+    for (char *chunk : chunks)
+    {
+        ix_FREE(chunk);
+    }
+}
+
 ix_TEST_CASE("ix_StringArena:many pools")
 {
     ix_StringArena arena(10);
@@ -36,4 +36,8 @@ class ix_StringArena
     const char *push(const char *data, size_t length);
     const char *push_str(const char *str);
     const char *push_between(const char *start, const char *end);
+
+    // Hands the memory of the strings pushed so far over to `chunks`, to be freed later with `ix_FREE`.
+    // The strings stay valid and are never written again, since the arena goes on in new memory.
+    void detach(ix_Vector<char *> &chunks);
 };
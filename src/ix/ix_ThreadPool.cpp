@@ -0,0 +1,134 @@
+#include "ix_ThreadPool.hpp"
+#include "ix_assert.hpp"
+#include "ix_doctest.hpp"
+
+ix_ThreadPool::ix_ThreadPool(size_t num_threads)
+{
+    ix_ASSERT(num_threads > 0);
+    m_threads.reserve(num_threads);
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        m_threads.emplace_back(ix_make_unique<ix_Thread>());
+        m_threads.back()->start([this]() { run_worker(); });
+    }
+}
+
+ix_ThreadPool::~ix_ThreadPool()
+{
+    wait();
+
+    m_mutex.lock();
+    m_stopping = true;
+    m_task_added.notify_all();
+    m_mutex.unlock();
+
+    for (ix_UniquePointer<ix_Thread> &thread : m_threads)
+    {
+        thread->join();
+    }
+}
+
+size_t ix_ThreadPool::size() const
+{
+    return m_threads.size();
+}
+
+void ix_ThreadPool::add_task(const ix_FunctionN<16, void()> &task)
+{
+    m_mutex.lock();
+    m_tasks.push_back(task);
+    m_task_added.notify_one();
+    m_mutex.unlock();
+}
+
+void ix_ThreadPool::wait()
+{
+    m_mutex.lock();
+    while ((m_next_task_index < m_tasks.size()) || (m_num_running_tasks != 0))
+    {
+        m_all_tasks_done.wait(m_mutex);
+    }
+    m_mutex.unlock();
+}
+
+void ix_ThreadPool::run_worker()
+{
+    m_mutex.lock();
+    while (true)
+    {
+        while ((m_next_task_index == m_tasks.size()) && !m_stopping)
+        {
+            m_task_added.wait(m_mutex);
+        }
+
+        if (m_next_task_index == m_tasks.size())
+        {
+            break;
+        }
+
+        const ix_Vector<ix_FunctionN<16, void()>> &tasks = m_tasks;
+        const ix_FunctionN<16, void()> task = tasks[m_next_task_index]; // Copied, as `m_tasks` may grow meanwhile.
+        m_next_task_index += 1;
+        m_num_running_tasks += 1;
+        m_mutex.unlock();
+
+        task();
+
+        m_mutex.lock();
+        m_num_running_tasks -= 1;
+        const bool all_tasks_done = (m_next_task_index == m_tasks.size()) && (m_num_running_tasks == 0);
+        if (all_tasks_done)
+        {
+            m_tasks.clear();
+            m_next_task_index = 0;
+            m_all_tasks_done.notify_all();
+        }
+    }
+    m_mutex.unlock();
+}
+
+ix_TEST_CASE("ix_ThreadPool")
+{
+    constexpr static const size_t N = 1024;
+    static size_t out[N];
+
+    ix_ThreadPool pool(8);
+    ix_EXPECT(pool.size() == 8);
+
+    for (size_t round = 0; round < 3; round++)
+    {
+        for (size_t i = 0; i < N; i++)
+        {
+            pool.add_task([i, round]() { out[i] = i * round; });
+        }
+        pool.wait();
+
+        for (size_t i = 0; i < N; i++)
+        {
+            ix_EXPECT(out[i] == i * round);
+        }
+    }
+
+    pool.wait(); // No tasks.
+}
+
+ix_TEST_CASE("ix_ThreadPool: remaining tasks are run before destruction")
+{
+    static size_t counter;
+    counter = 0;
+
+    {
+        static ix_Mutex mutex;
+        ix_ThreadPool pool(3);
+        for (size_t i = 0; i < 100; i++)
+        {
+            pool.add_task([]() {
+                mutex.lock();
+                counter += 1;
+                mutex.unlock();
+            });
+        }
+    }
+
+    ix_EXPECT(counter == 100);
+}
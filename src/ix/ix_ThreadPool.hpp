@@ -0,0 +1,37 @@
+#pragma once
+
+#include "ix.hpp"
+#include "ix_ConditionVariable.hpp"
+#include "ix_Function.hpp"
+#include "ix_Mutex.hpp"
+#include "ix_Thread.hpp"
+#include "ix_UniquePointer.hpp"
+#include "ix_Vector.hpp"
+
+// A fixed number of threads that run tasks in the order they are added.
+class ix_ThreadPool
+{
+    ix_Vector<ix_UniquePointer<ix_Thread>> m_threads;
+    ix_Vector<ix_FunctionN<16, void()>> m_tasks;
+    size_t m_next_task_index = 0;
+    size_t m_num_running_tasks = 0;
+    bool m_stopping = false;
+    ix_Mutex m_mutex;
+    ix_ConditionVariable m_task_added;
+    ix_ConditionVariable m_all_tasks_done;
+
+  public:
+    explicit ix_ThreadPool(size_t num_threads);
+    ix_ThreadPool(const ix_ThreadPool &) = delete;
+    ix_ThreadPool(ix_ThreadPool &&) = delete;
+    ix_ThreadPool &operator=(const ix_ThreadPool &) = delete;
+    ix_ThreadPool &operator=(ix_ThreadPool &&) = delete;
+    ~ix_ThreadPool(); // Waits for the remaining tasks.
+
+    size_t size() const;
+    void add_task(const ix_FunctionN<16, void()> &task);
+    void wait();
+
+  private:
+    void run_worker();
+};
@@ -50,7 +50,10 @@ class ix_Vector
           m_capacity(other.m_capacity)
     {
         m_data = ix_ALLOC_ARRAY(T, m_capacity);
-        ix_bulk_copy_construct(m_data, other.m_data, m_size);
+        if (m_size != 0) // `other.m_data` is null if `other` has never allocated.
+        {
+            ix_bulk_copy_construct(m_data, other.m_data, m_size);
+        }
     }
 
     constexpr ix_Vector(ix_Vector &&other) noexcept
@@ -77,7 +80,10 @@ class ix_Vector
         m_capacity = other.m_capacity;
 
         m_data = ix_ALLOC_ARRAY(T, m_capacity);
-        ix_bulk_copy_construct(m_data, other.m_data, m_size);
+        if (m_size != 0) // `other.m_data` is null if `other` has never allocated.
+        {
+            ix_bulk_copy_construct(m_data, other.m_data, m_size);
+        }
 
         return *this;
     }
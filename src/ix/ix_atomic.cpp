@@ -0,0 +1,39 @@
+#include "ix_atomic.hpp"
+#include "ix_Thread.hpp"
+#include "ix_doctest.hpp"
+
+ix_TEST_CASE("ix_atomic")
+{
+    size_t x = 10;
+    ix_EXPECT(ix_atomic_load(&x) == 10);
+    ix_EXPECT(ix_atomic_fetch_add(&x, 5) == 10);
+    ix_EXPECT(ix_atomic_fetch_sub(&x, 3) == 15);
+    ix_EXPECT(ix_atomic_load(&x) == 12);
+}
+
+ix_TEST_CASE("ix_atomic: concurrent increments")
+{
+    constexpr static const size_t N = 16;
+    constexpr static const size_t M = 10000;
+    static size_t counter;
+    counter = 0;
+
+    ix_Thread threads[N];
+    for (size_t i = 0; i < N; i++)
+    {
+        threads[i].start([]() {
+            for (size_t j = 0; j < M; j++)
+            {
+                ix_atomic_fetch_add(&counter, 2);
+                ix_atomic_fetch_sub(&counter, 1);
+            }
+        });
+    }
+
+    for (size_t i = 0; i < N; i++)
+    {
+        threads[i].join();
+    }
+
+    ix_EXPECT(ix_atomic_load(&counter) == N * M);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "ix.hpp"
+
+#if ix_COMPILER(MSVC)
+#include <intrin.h>
+#endif
+
+// Sequentially consistent, like the default memory order of std::atomic.
+ix_FORCE_INLINE size_t ix_atomic_load(const size_t *p)
+{
+#if ix_COMPILER(MSVC)
+    return static_cast<size_t>(_InterlockedOr64(reinterpret_cast<volatile int64_t *>(const_cast<size_t *>(p)), 0));
+#else
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Returns the value before the addition.
+ix_FORCE_INLINE size_t ix_atomic_fetch_add(size_t *p, size_t value)
+{
+#if ix_COMPILER(MSVC)
+    return static_cast<size_t>(
+        _InterlockedExchangeAdd64(reinterpret_cast<volatile int64_t *>(p), static_cast<int64_t>(value)));
+#else
+    return __atomic_fetch_add(p, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Returns the value before the subtraction.
+ix_FORCE_INLINE size_t ix_atomic_fetch_sub(size_t *p, size_t value)
+{
+#if ix_COMPILER(MSVC)
+    return static_cast<size_t>(
+        _InterlockedExchangeAdd64(reinterpret_cast<volatile int64_t *>(p), -static_cast<int64_t>(value)));
+#else
+    return __atomic_fetch_sub(p, value, __ATOMIC_SEQ_CST);
+#endif
+}
@@ -44,6 +44,8 @@ int ix_do_doctest(int argc, const char *const *argv)
     context.setOption("no-colors", true);
 #endif
 
+    context.addFilter("test-suite-exclude", "benchmark");
+
     ix_log_verbose("initialization finished.");
     const int ret = context.run();
     ix_log_verbose("tests finished.");
@@ -51,6 +53,30 @@ int ix_do_doctest(int argc, const char *const *argv)
     return ret;
 }
 
+int ix_do_doctest_benchmark(int argc, const char *const *argv)
+{
+    const auto &sm = ix_SystemManager::get();
+    ix_ASSERT_FATAL(sm.is_initialized("stdio"));
+    ix_ASSERT_FATAL(sm.is_initialized("sokol_time"));
+    ix_ASSERT_FATAL(sm.is_initialized("logger"));
+
+    doctest::Context context(argc, argv);
+    context.setOption("no-intro", true);
+    context.setOption("no-version", true);
+    context.setOption("gnu-file-line", true);
+    context.addFilter("test-suite", "benchmark");
+
+#if ix_PLATFORM(WASM)
+    context.setOption("no-colors", true);
+#endif
+
+    ix_log_verbose("initialization finished.");
+    const int ret = context.run();
+    ix_log_verbose("benchmarks finished.");
+
+    return ret;
+}
+
 // Based on doctest.h (https://github.com/doctest/doctest, MIT License)
 namespace doctest
 {
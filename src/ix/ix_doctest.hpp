@@ -8,6 +8,7 @@
 #include <doctest.hpp>
 
 #define ix_TEST_CASE(name) DOCTEST_TEST_CASE(name)
+#define ix_BENCHMARK_CASE(name) DOCTEST_TEST_CASE(name * doctest::test_suite("benchmark"))
 
 #if !ix_MEASURE_COVERAGE && ix_DO_TEST
 #define ix_EXPECT(...) DOCTEST_CHECK((__VA_ARGS__))
@@ -20,7 +21,7 @@
 #endif
 
 int ix_do_doctest(int argc, const char *const *argv);
-int ix_do_doctest_benchmark(int argc, const char **argv);
+int ix_do_doctest_benchmark(int argc, const char *const *argv);
 
 // Based on doctest.h (https://github.com/doctest/doctest, MIT License)
 namespace doctest
@@ -1,15 +1,26 @@
 #include "ix_environment.hpp"
 #include "ix_Thread.hpp"
 #include "ix_doctest.hpp"
+#include "ix_memory.hpp"
 
 #if ix_PLATFORM(WIN)
 #include "ix_Windows.hpp"
 #include <process.h>
+#include <psapi.h>
 #elif ix_PLATFORM(LINUX) || ix_PLATFORM(MAC) || ix_PLATFORM(WASM)
 #include <pthread.h>
 #include <unistd.h>
 #endif
 
+#if ix_PLATFORM(LINUX)
+#include "ix_file.hpp"
+#include "ix_scanf.hpp"
+#include "ix_string.hpp"
+#include <fcntl.h>
+#elif ix_PLATFORM(MAC)
+#include <sys/resource.h>
+#endif
+
 #if ix_PLATFORM(LINUX) || ix_PLATFORM(MAC)
 #include <valgrind/valgrind.h>
 #endif
@@ -72,6 +83,80 @@ ix_TEST_CASE("ix_thread_id")
     }
 }
 
+size_t ix_peak_resident_set_size()
+{
+#if ix_PLATFORM(WIN)
+    PROCESS_MEMORY_COUNTERS counters;
+    const BOOL ret = K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return (ret == 0) ? 0 : counters.PeakWorkingSetSize;
+#elif ix_PLATFORM(LINUX)
+    // Unlike `ru_maxrss`, VmHWM is reset by `ix_reset_peak_resident_set_size()`.
+    const ix_FileHandle file("/proc/self/status", ix_READ_ONLY);
+    char buf[4096];
+    const size_t length = file.is_valid() ? file.read(buf, sizeof(buf) - 1) : ix_SIZE_MAX;
+    if (length == ix_SIZE_MAX)
+    {
+        return 0;
+    }
+    buf[length] = '\0';
+    const char *hwm = ix_strstr(buf, "VmHWM:");
+    if (hwm == nullptr)
+    {
+        return 0;
+    }
+    hwm += ix_strlen("VmHWM:");
+    ix_skip_to_next_word(&hwm);
+    return static_cast<size_t>(ix_read_uint(&hwm)) * 1024; // Kilobytes.
+#elif ix_PLATFORM(MAC)
+    struct rusage usage;
+    const int ret = getrusage(RUSAGE_SELF, &usage);
+    return (ret != 0) ? 0 : static_cast<size_t>(usage.ru_maxrss); // Bytes.
+#elif ix_PLATFORM(WASM)
+    return 0;
+#else
+#error
+#endif
+}
+
+bool ix_reset_peak_resident_set_size()
+{
+#if ix_PLATFORM(LINUX)
+    const int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd == -1)
+    {
+        return false;
+    }
+    const ssize_t bytes_written = write(fd, "5", 1);
+    close(fd);
+    return (bytes_written == 1);
+#else
+    return false;
+#endif
+}
+
+ix_TEST_CASE("ix_peak_resident_set_size")
+{
+    const size_t before = ix_peak_resident_set_size();
+    if (before == 0)
+    {
+        return;
+    }
+
+    ix_EXPECT(before <= ix_peak_resident_set_size());
+
+    if (!ix_reset_peak_resident_set_size())
+    {
+        return;
+    }
+
+    const size_t size = 16 * 1024 * 1024;
+    char *p = ix_MALLOC(char *, size);
+    ix_memset(p, 1, size);
+    const size_t peak = ix_peak_resident_set_size();
+    ix_FREE(p);
+    ix_EXPECT(peak >= size);
+}
+
 bool ix_is_valgrind_active()
 {
 #if ix_PLATFORM(LINUX) || ix_PLATFORM(MAC)
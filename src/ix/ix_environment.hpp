@@ -5,5 +5,7 @@
 size_t ix_hardware_concurrency();
 size_t ix_process_id();
 size_t ix_thread_id();
+size_t ix_peak_resident_set_size();        // In bytes, or 0 if unknown.
+bool ix_reset_peak_resident_set_size(); // Linux only.
 
 bool ix_is_valgrind_active();
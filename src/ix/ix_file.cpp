@@ -1,5 +1,6 @@
 #include "ix_file.hpp"
 #include "ix_DumbString.hpp"
+#include "ix_Function.hpp"
 #include "ix_HollowValue.hpp"
 #include "ix_TempFile.hpp"
 #include "ix_assert.hpp"
@@ -24,6 +25,7 @@
 #else
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <string.h>
 #include <sys/stat.h>
 #endif
@@ -803,6 +805,318 @@ ix_TEST_CASE("ix_create_directories_and_file")
     ix_EXPECT(ix_remove_file(temp_path).is_ok());
 }
 
+static ix_Result walk_directory(char path[ix_MAX_PATH + 1], size_t root_length, size_t path_length,
+                                const ix_FunctionN<16, void(const char *)> &on_file)
+{
+#if ix_PLATFORM(WIN)
+    if (path_length + 1 > ix_MAX_PATH)
+    {
+        return ix_ERROR;
+    }
+    path[path_length] = '*';
+    path[path_length + 1] = '\0';
+    wchar_t pattern_wchar[ix_MAX_PATH];
+    utf8_path_to_wchar(path, pattern_wchar);
+    path[path_length] = '\0';
+
+    WIN32_FIND_DATAW entry;
+    const HANDLE find = FindFirstFileW(pattern_wchar, &entry);
+    if (find == INVALID_HANDLE_VALUE)
+    {
+        return ix_ERROR;
+    }
+
+    ix_Result result = ix_OK;
+    do
+    {
+        char name[ix_MAX_PATH];
+        wchar_path_to_utf8(entry.cFileName, name);
+        const bool is_dot = (ix_strcmp(name, ".") == 0) || (ix_strcmp(name, "..") == 0);
+        if (is_dot)
+        {
+            continue;
+        }
+
+        const size_t name_length = ix_strlen(name);
+        if (path_length + name_length + 1 > ix_MAX_PATH)
+        {
+            result = ix_ERROR;
+            break;
+        }
+        ix_memcpy(path + path_length, name, name_length + 1);
+
+        if ((entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+        {
+            path[path_length + name_length] = '/';
+            path[path_length + name_length + 1] = '\0';
+            result = walk_directory(path, root_length, path_length + name_length + 1, on_file);
+        }
+        else
+        {
+            on_file(path + root_length);
+        }
+    } while (result.is_ok() && (FindNextFileW(find, &entry) != 0));
+
+    FindClose(find);
+    path[path_length] = '\0';
+    return result;
+#else
+    DIR *dir = opendir(path);
+    if (dir == nullptr)
+    {
+        return ix_ERROR;
+    }
+
+    ix_Result result = ix_OK;
+    const struct dirent *entry;
+    while (result.is_ok() && ((entry = readdir(dir)) != nullptr))
+    {
+        const char *name = entry->d_name;
+        const bool is_dot = (ix_strcmp(name, ".") == 0) || (ix_strcmp(name, "..") == 0);
+        if (is_dot)
+        {
+            continue;
+        }
+
+        const size_t name_length = ix_strlen(name);
+        if (path_length + name_length + 1 > ix_MAX_PATH)
+        {
+            result = ix_ERROR;
+            break;
+        }
+        ix_memcpy(path + path_length, name, name_length + 1);
+
+        struct stat sb;
+        if (stat(path, &sb) != 0)
+        {
+            continue; // e.g. a dangling symbolic link.
+        }
+
+        if ((sb.st_mode & S_IFMT) == S_IFDIR)
+        {
+            path[path_length + name_length] = '/';
+            path[path_length + name_length + 1] = '\0';
+            result = walk_directory(path, root_length, path_length + name_length + 1, on_file);
+        }
+        else if ((sb.st_mode & S_IFMT) == S_IFREG)
+        {
+            on_file(path + root_length);
+        }
+    }
+
+    closedir(dir);
+    path[path_length] = '\0';
+    return result;
+#endif
+}
+
+ix_Result ix_walk_directory(const char *path, const ix_FunctionN<16, void(const char *)> &on_file)
+{
+    const size_t path_length = ix_strlen(path);
+    if ((path_length == 0) || (path_length + 1 > ix_MAX_PATH))
+    {
+        return ix_ERROR;
+    }
+
+    char buf[ix_MAX_PATH + 1];
+    ix_memcpy(buf, path, path_length);
+    size_t root_length = path_length;
+    if (!ix_is_path_separator(buf[root_length - 1]))
+    {
+        buf[root_length] = '/';
+        root_length += 1;
+    }
+    buf[root_length] = '\0';
+
+    return walk_directory(buf, root_length, root_length, on_file);
+}
+
+ix_TEST_CASE("ix_walk_directory")
+{
+    mount_cwd();
+
+    ix_EXPECT(ix_walk_directory("", [](const char *) {}).is_error());
+    ix_EXPECT(ix_walk_directory("foo", [](const char *) {}).is_error());
+
+    ix_EXPECT(ix_ensure_directories("foo/bar/baz").is_ok());
+    ix_EXPECT(ix_write_string_to_file("foo/a.txt", "a").is_ok());
+    ix_EXPECT(ix_write_string_to_file("foo/bar/b.txt", "b").is_ok());
+    ix_EXPECT(ix_write_string_to_file("foo/bar/baz/c.txt", "c").is_ok());
+
+    static size_t num_files;
+    static bool found[3];
+    for (const char *root : {"foo", "foo/"})
+    {
+        num_files = 0;
+        found[0] = found[1] = found[2] = false;
+        const ix_Result result = ix_walk_directory(root, [](const char *relative_path) {
+            num_files += 1;
+            found[0] |= (ix_strcmp(relative_path, "a.txt") == 0);
+            found[1] |= (ix_strcmp(relative_path, "bar/b.txt") == 0);
+            found[2] |= (ix_strcmp(relative_path, "bar/baz/c.txt") == 0);
+        });
+        ix_EXPECT(result.is_ok());
+        ix_EXPECT(num_files == 3);
+        ix_EXPECT(found[0] && found[1] && found[2]);
+    }
+
+    ix_EXPECT(ix_remove_file("foo/bar/baz/c.txt").is_ok());
+    ix_EXPECT(ix_remove_file("foo/bar/b.txt").is_ok());
+    ix_EXPECT(ix_remove_file("foo/a.txt").is_ok());
+    ix_EXPECT(ix_remove_directory("foo/bar/baz").is_ok());
+    ix_EXPECT(ix_remove_directory("foo/bar").is_ok());
+    ix_EXPECT(ix_remove_directory("foo").is_ok());
+
+    unmount_cwd();
+}
+
+#if !ix_PLATFORM(WIN)
+// Appends the components of `rest`, which do not exist, to the resolved path of size `length`.
+static size_t append_unresolved_components(char *resolved, size_t length, const char *rest)
+{
+    const char *p = rest;
+    while (*p != '\0')
+    {
+        while (ix_is_path_separator(*p))
+        {
+            p += 1;
+        }
+        const char *component = p;
+        while ((*p != '\0') && !ix_is_path_separator(*p))
+        {
+            p += 1;
+        }
+
+        const size_t component_length = static_cast<size_t>(p - component);
+        if ((component_length == 0) || ((component_length == 1) && (component[0] == '.')))
+        {
+            continue;
+        }
+
+        if ((component_length == 2) && (component[0] == '.') && (component[1] == '.'))
+        {
+            // The directory does not exist, so it cannot be a symbolic link, and ".." just removes it.
+            const size_t dirname_length = ix_dirname_length(resolved, length - 1);
+            length = (dirname_length <= 1) ? 1 : dirname_length - 1;
+            continue;
+        }
+
+        if (!ix_is_path_separator(resolved[length - 1]))
+        {
+            resolved[length] = '/';
+            length += 1;
+        }
+        ix_memcpy(resolved + length, component, component_length);
+        length += component_length;
+    }
+    return length;
+}
+#endif
+
+ix_UniquePointer<char[]> ix_resolve_path(const char *path)
+{
+    const size_t path_length = ix_strlen(path);
+    if ((path_length == 0) || (path_length + 1 > ix_MAX_PATH))
+    {
+        return ix_UniquePointer<char[]>(nullptr);
+    }
+
+#if ix_PLATFORM(WIN)
+    wchar_t path_wchar[ix_MAX_PATH];
+    utf8_path_to_wchar(path, path_wchar);
+    wchar_t full_path_wchar[ix_MAX_PATH];
+    const DWORD full_path_length = GetFullPathName(path_wchar, ix_MAX_PATH, full_path_wchar, nullptr);
+    if ((full_path_length == 0) || (full_path_length >= ix_MAX_PATH))
+    {
+        return ix_UniquePointer<char[]>(nullptr);
+    }
+    char *resolved = ix_MALLOC(char *, ix_MAX_PATH);
+    wchar_path_to_utf8(full_path_wchar, resolved);
+    return ix_UniquePointer<char[]>(ix_move(resolved));
+#else
+    // `realpath()` fails on a path that does not exist, so it is given the longest prefix of the path that does.
+    char existing[ix_MAX_PATH + 1];
+    ix_memcpy(existing, path, path_length + 1);
+    size_t existing_length = path_length;
+    char *resolved_existing;
+    while (true)
+    {
+        resolved_existing = realpath((existing_length == 0) ? "." : existing, nullptr);
+        if ((resolved_existing != nullptr) || (existing_length == 0))
+        {
+            break;
+        }
+
+        const size_t previous_length = existing_length;
+        while ((existing_length != 0) && !ix_is_path_separator(existing[existing_length - 1]))
+        {
+            existing_length -= 1;
+        }
+        while ((existing_length > 1) && ix_is_path_separator(existing[existing_length - 1]))
+        {
+            existing_length -= 1;
+        }
+        if (existing_length == previous_length)
+        {
+            return ix_UniquePointer<char[]>(nullptr);
+        }
+        existing[existing_length] = '\0';
+    }
+
+    if (resolved_existing == nullptr)
+    {
+        return ix_UniquePointer<char[]>(nullptr);
+    }
+
+    const size_t resolved_existing_length = ix_strlen(resolved_existing);
+    char *resolved = ix_MALLOC(char *, resolved_existing_length + (path_length - existing_length) + 2);
+    ix_memcpy(resolved, resolved_existing, resolved_existing_length);
+    free(resolved_existing); // Allocated by `realpath()`.
+    const size_t resolved_length =
+        append_unresolved_components(resolved, resolved_existing_length, path + existing_length);
+    resolved[resolved_length] = '\0';
+    return ix_UniquePointer<char[]>(ix_move(resolved));
+#endif
+}
+
+ix_TEST_CASE("ix_resolve_path")
+{
+    mount_cwd();
+
+    ix_EXPECT(ix_resolve_path("").get() == nullptr);
+
+    ix_EXPECT(ix_ensure_directories("foo/bar").is_ok());
+    ix_EXPECT(ix_write_string_to_file("foo/a.txt", "a").is_ok());
+
+    const ix_UniquePointer<char[]> a = ix_resolve_path(CWD "foo/a.txt");
+    ix_ASSERT_FATAL(a.get() != nullptr);
+    ix_EXPECT(ix_strcmp(ix_resolve_path(CWD "./foo//bar/../a.txt").get(), a.get()) == 0);
+    ix_EXPECT(ix_strcmp(ix_resolve_path(a.get()).get(), a.get()) == 0);
+
+    // Paths that do not exist (yet).
+    const ix_UniquePointer<char[]> b = ix_resolve_path(CWD "foo/baz/b.txt");
+    ix_ASSERT_FATAL(b.get() != nullptr);
+    ix_EXPECT(ix_strcmp(ix_resolve_path(CWD "foo/bar/../baz/./qux/../b.txt").get(), b.get()) == 0);
+    ix_EXPECT(ix_strcmp(ix_resolve_path(CWD "foo/baz/b.txt/").get(), b.get()) == 0);
+    ix_EXPECT(ix_strcmp(a.get(), b.get()) != 0);
+    const size_t b_length = ix_strlen(b.get());
+    ix_EXPECT(ix_strcmp(b.get() + b_length - ix_strlen("foo/baz/b.txt"), "foo/baz/b.txt") == 0);
+
+#if !ix_PLATFORM(WIN)
+    ix_EXPECT(a.get()[0] == '/');
+    ix_EXPECT(ix_strcmp(ix_resolve_path("/").get(), "/") == 0);
+    ix_EXPECT(symlink("bar", "foo/link") == 0);
+    ix_EXPECT(ix_strcmp(ix_resolve_path(CWD "foo/link/c.txt").get(), ix_resolve_path(CWD "foo/bar/c.txt").get()) == 0);
+    ix_EXPECT(ix_remove_file("foo/link").is_ok());
+#endif
+
+    ix_EXPECT(ix_remove_file("foo/a.txt").is_ok());
+    ix_EXPECT(ix_remove_directory("foo/bar").is_ok());
+    ix_EXPECT(ix_remove_directory("foo").is_ok());
+
+    unmount_cwd();
+}
+
 const char *ix_temp_file_dirname()
 {
 #if ix_PLATFORM(WIN)
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ix.hpp"
+#include "ix_Function.hpp"
 #include "ix_Result.hpp"
 #include "ix_UniquePointer.hpp"
 #include "ix_printf.hpp"
@@ -27,6 +28,14 @@ ix_FileHandle ix_create_directories_and_file(const char *path);
 ix_Result ix_remove_directory(const char *path);
 ix_Result ix_remove_file(const char *path);
 
+// Calls `on_file` with the path of every regular file under `path`, relative to `path`, in no particular order.
+ix_Result ix_walk_directory(const char *path, const ix_FunctionN<16, void(const char *)> &on_file);
+
+// Makes `path` absolute and follows its symbolic links, so that paths to the same file resolve to the same string.
+// The path need not exist (e.g. a file about to be created): the part of it that does not is appended as it is,
+// without "." components. Returns `nullptr` if the path is empty or too long.
+ix_UniquePointer<char[]> ix_resolve_path(const char *path);
+
 const char *ix_temp_file_dirname();
 size_t ix_temp_file_dirname_length();
 
@@ -45,6 +54,7 @@ enum ix_FileOpenOption : uint8_t
 class ix_FileHandle
 {
     friend ix_Result ix_init_stdio();
+    friend class ix_MappedFile;
 
     union
     {
@@ -1,9 +1,18 @@
 #include "ix_string.hpp"
+#include "ix_bit.hpp"
 #include "ix_doctest.hpp"
+#include "ix_memory.hpp"
 
 #include <stdlib.h>
 #include <string.h>
 
+#if ix_ARCH(x64)
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#endif
+
 ix_TEST_CASE("ix_strlen")
 {
     ix_EXPECT(ix_strlen("") == 0);
@@ -212,6 +221,240 @@ ix_TEST_CASE("ix_memnext2")
     ix_EXPECT(ix_memnext2(buf, 'c', 'b') == buf + 1);
 }
 
+#if ix_ARCH(x64) && defined(__AVX2__)
+#define ix_STRING_SIMD 1
+using SimdChunk = __m256i;
+static constexpr size_t SIMD_WIDTH = 32;
+
+ix_FORCE_INLINE static SimdChunk simd_splat(char c)
+{
+    return _mm256_set1_epi8(c);
+}
+
+ix_FORCE_INLINE static SimdChunk simd_load(const char *p)
+{
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+}
+
+ix_FORCE_INLINE static SimdChunk simd_eq(const SimdChunk &a, const SimdChunk &b)
+{
+    return _mm256_cmpeq_epi8(a, b);
+}
+
+ix_FORCE_INLINE static SimdChunk simd_or(const SimdChunk &a, const SimdChunk &b)
+{
+    return _mm256_or_si256(a, b);
+}
+
+ix_FORCE_INLINE static uint32_t simd_mask(const SimdChunk &a)
+{
+    return static_cast<uint32_t>(_mm256_movemask_epi8(a));
+}
+#elif ix_ARCH(x64)
+#define ix_STRING_SIMD 1
+using SimdChunk = __m128i;
+static constexpr size_t SIMD_WIDTH = 16;
+
+ix_FORCE_INLINE static SimdChunk simd_splat(char c)
+{
+    return _mm_set1_epi8(c);
+}
+
+ix_FORCE_INLINE static SimdChunk simd_load(const char *p)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+}
+
+ix_FORCE_INLINE static SimdChunk simd_eq(const SimdChunk &a, const SimdChunk &b)
+{
+    return _mm_cmpeq_epi8(a, b);
+}
+
+ix_FORCE_INLINE static SimdChunk simd_or(const SimdChunk &a, const SimdChunk &b)
+{
+    return _mm_or_si128(a, b);
+}
+
+ix_FORCE_INLINE static uint32_t simd_mask(const SimdChunk &a)
+{
+    return static_cast<uint32_t>(_mm_movemask_epi8(a));
+}
+#else
+#define ix_STRING_SIMD 0
+#endif
+
+#if ix_STRING_SIMD
+ix_FORCE_INLINE static const char *last_set_bit_position(const char *p, uint32_t mask)
+{
+    return p + (31 - ix_count_leading_zeros<uint32_t>(mask));
+}
+#endif
+
+const char *ix_memrchr(const char *haystack, char c, size_t length)
+{
+    const char *p = haystack + length;
+
+#if ix_STRING_SIMD
+    const SimdChunk needle = simd_splat(c);
+    while (static_cast<size_t>(p - haystack) >= SIMD_WIDTH)
+    {
+        p -= SIMD_WIDTH;
+        const uint32_t mask = simd_mask(simd_eq(simd_load(p), needle));
+        if (mask != 0)
+        {
+            return last_set_bit_position(p, mask);
+        }
+    }
+#endif
+
+    while (haystack < p)
+    {
+        p -= 1;
+        if (*p == c)
+        {
+            return p;
+        }
+    }
+
+    return nullptr;
+}
+
+char *ix_memrchr(char *haystack, char c, size_t length)
+{
+    const char *found = ix_memrchr(static_cast<const char *>(haystack), c, length);
+    return const_cast<char *>(found);
+}
+
+ix_TEST_CASE("ix_memrchr")
+{
+    ix_EXPECT(ix_memrchr("", 'X', 0) == nullptr);
+    const char *msg = "FooBar";
+    ix_EXPECT(ix_memrchr(msg, 'F', 0) == nullptr);
+    ix_EXPECT(ix_memrchr(msg, 'F', 1) == msg);
+    ix_EXPECT(ix_memrchr(msg, 'o', 6) == msg + 2);
+    ix_EXPECT(ix_memrchr(msg, 'o', 2) == msg + 1);
+    ix_EXPECT(ix_memrchr(msg, 'r', 5) == nullptr);
+    ix_EXPECT(ix_memrchr(msg, '\0', 7) == msg + ix_strlen(msg));
+
+    char buf[128];
+    ix_memset(buf, 'a', sizeof(buf));
+    ix_EXPECT(ix_memrchr(buf, 'b', sizeof(buf)) == nullptr);
+    for (size_t i = 0; i < sizeof(buf); i++)
+    {
+        buf[i] = 'b';
+        ix_EXPECT(ix_memrchr(buf, 'b', sizeof(buf)) == buf + i);
+        ix_EXPECT(ix_memrchr(buf, 'b', i) == ((i == 0) ? nullptr : buf + i - 1));
+    }
+}
+
+const char *ix_memrchr2(const char *haystack, char c0, char c1, size_t length)
+{
+    const char *p = haystack + length;
+
+#if ix_STRING_SIMD
+    const SimdChunk needle0 = simd_splat(c0);
+    const SimdChunk needle1 = simd_splat(c1);
+    while (static_cast<size_t>(p - haystack) >= SIMD_WIDTH)
+    {
+        p -= SIMD_WIDTH;
+        const SimdChunk chunk = simd_load(p);
+        const uint32_t mask = simd_mask(simd_or(simd_eq(chunk, needle0), simd_eq(chunk, needle1)));
+        if (mask != 0)
+        {
+            return last_set_bit_position(p, mask);
+        }
+    }
+#endif
+
+    while (haystack < p)
+    {
+        p -= 1;
+        if ((*p == c0) || (*p == c1))
+        {
+            return p;
+        }
+    }
+
+    return nullptr;
+}
+
+char *ix_memrchr2(char *haystack, char c0, char c1, size_t length)
+{
+    const char *found = ix_memrchr2(static_cast<const char *>(haystack), c0, c1, length);
+    return const_cast<char *>(found);
+}
+
+ix_TEST_CASE("ix_memrchr2")
+{
+    ix_EXPECT(ix_memrchr2("", 'X', 'Y', 0) == nullptr);
+    const char *msg = "FooBar";
+    ix_EXPECT(ix_memrchr2(msg, 'F', 'B', 6) == msg + 3);
+    ix_EXPECT(ix_memrchr2(msg, 'B', 'F', 3) == msg);
+    ix_EXPECT(ix_memrchr2(msg, 'a', 'o', 6) == msg + 4);
+    ix_EXPECT(ix_memrchr2(msg, 'X', 'Y', 6) == nullptr);
+
+    char buf[128];
+    ix_memset(buf, 'a', sizeof(buf));
+    ix_EXPECT(ix_memrchr2(buf, 'b', 'c', sizeof(buf)) == nullptr);
+    for (size_t i = 0; i < sizeof(buf); i++)
+    {
+        buf[i] = ((i % 2) == 0) ? 'b' : 'c';
+        ix_EXPECT(ix_memrchr2(buf, 'b', 'c', sizeof(buf)) == buf + i);
+    }
+}
+
+const char *ix_memchr3(const char *haystack, char c0, char c1, char c2, size_t length)
+{
+    const char *p = haystack;
+    const char *end = haystack + length;
+
+#if ix_STRING_SIMD
+    const SimdChunk needle0 = simd_splat(c0);
+    const SimdChunk needle1 = simd_splat(c1);
+    const SimdChunk needle2 = simd_splat(c2);
+    while (static_cast<size_t>(end - p) >= SIMD_WIDTH)
+    {
+        const SimdChunk chunk = simd_load(p);
+        const SimdChunk eq01 = simd_or(simd_eq(chunk, needle0), simd_eq(chunk, needle1));
+        const uint32_t mask = simd_mask(simd_or(eq01, simd_eq(chunk, needle2)));
+        if (mask != 0)
+        {
+            return p + ix_count_trailing_zeros<uint32_t>(mask);
+        }
+        p += SIMD_WIDTH;
+    }
+#endif
+
+    while (p < end)
+    {
+        if ((*p == c0) || (*p == c1) || (*p == c2))
+        {
+            return p;
+        }
+        p += 1;
+    }
+
+    return nullptr;
+}
+
+ix_TEST_CASE("ix_memchr3")
+{
+    ix_EXPECT(ix_memchr3("", 'X', 'Y', 'Z', 0) == nullptr);
+    const char *msg = "FooBar";
+    ix_EXPECT(ix_memchr3(msg, 'a', 'r', 'B', 6) == msg + 3);
+    ix_EXPECT(ix_memchr3(msg, 'r', 'a', 'X', 6) == msg + 4);
+    ix_EXPECT(ix_memchr3(msg, 'r', 'a', 'X', 4) == nullptr);
+
+    char buf[128];
+    ix_memset(buf, 'a', sizeof(buf));
+    ix_EXPECT(ix_memchr3(buf, 'b', 'c', 'd', sizeof(buf)) == nullptr);
+    for (size_t i = sizeof(buf); i > 0; i--)
+    {
+        buf[i - 1] = "bcd"[i % 3];
+        ix_EXPECT(ix_memchr3(buf, 'b', 'c', 'd', sizeof(buf)) == buf + i - 1);
+    }
+}
+
 size_t ix_strlen_runtime(char const *s)
 {
     return strlen(s);
@@ -19,6 +19,15 @@ const char *ix_memnext(const char *haystack, char c);
 char *ix_memnext2(char *haystack, char c0, char c1);
 const char *ix_memnext2(const char *haystack, char c0, char c1);
 
+// The functions below scan 16 (SSE2) or 32 (AVX2) bytes at a time when possible.
+char *ix_memrchr(char *haystack, char c, size_t length);
+const char *ix_memrchr(const char *haystack, char c, size_t length);
+
+char *ix_memrchr2(char *haystack, char c0, char c1, size_t length);
+const char *ix_memrchr2(const char *haystack, char c0, char c1, size_t length);
+
+const char *ix_memchr3(const char *haystack, char c0, char c1, char c2, size_t length);
+
 size_t ix_strlen_runtime(char const *s);
 int ix_strcmp_runtime(char const *a, const char *b);
 